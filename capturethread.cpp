@@ -0,0 +1,185 @@
+#include "capturethread.h"
+#include "videosource.h"
+
+#include <QDebug>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+CaptureThread::CaptureThread(VideoSource *c, DropPolicy p):
+    capture(c),
+    policy(p),
+    ring_write(0),
+    ring_read(0),
+    dropped_frames(0),
+    capture_error(0)
+{
+    /* Leave one buffer for the consumer and at least one for the driver */
+    unsigned int buffers = capture->buffer_count();
+    depth = buffers > 3 ? buffers - 2 : 1;
+    if (depth >= RING_SIZE)
+        depth = RING_SIZE - 1;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+CaptureThread::~CaptureThread()
+{
+    stop();
+    ::close(stop_fd);
+    ::close(event_fd);
+}
+
+void CaptureThread::stop()
+{
+    uint64_t one = 1;
+    if (::write(stop_fd, &one, sizeof(one)) < 0)
+        qWarning() << "Failed to signal capture thread";
+    wait();
+}
+
+void CaptureThread::run()
+{
+    struct pollfd fds[2];
+    fds[0].fd = capture->device_handle();
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (::poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            __atomic_store_n(&capture_error, -errno, __ATOMIC_RELEASE);
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & POLLERR)
+        {
+            __atomic_store_n(&capture_error, -EIO, __ATOMIC_RELEASE);
+            break;
+        }
+
+        /* Take everything the driver has ready */
+        Slot slot;
+        int r;
+        while ((r = capture->dequeue_buffer(&slot.index, &slot.bytesused, &slot.timestamp)) > 0)
+            push(slot);
+        if (r < 0)
+        {
+            __atomic_store_n(&capture_error, r, __ATOMIC_RELEASE);
+            break;
+        }
+        notify();
+    }
+    /* Wake up the consumer to have it look at the error */
+    notify();
+}
+
+void CaptureThread::notify()
+{
+    uint64_t one = 1;
+    if (::write(event_fd, &one, sizeof(one)) < 0)
+        qWarning() << "Failed to signal new frame";
+}
+
+void CaptureThread::drop(unsigned int index)
+{
+    capture->queue_buffer(index);
+    __atomic_add_fetch(&dropped_frames, 1, __ATOMIC_RELAXED);
+}
+
+/* Only called from the capture thread */
+void CaptureThread::push(const Slot &slot)
+{
+    unsigned int w = ring_write;
+    while (w - __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE) >= depth)
+    {
+        if (policy == DropNewest)
+        {
+            drop(slot.index);
+            return;
+        }
+        Slot oldest;
+        if (pop(&oldest))
+            drop(oldest.index);
+    }
+    Slot *s = &ring[w & (RING_SIZE - 1)];
+    __atomic_store_n(&s->index, slot.index, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->bytesused, slot.bytesused, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->timestamp, slot.timestamp, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring_write, w + 1, __ATOMIC_RELEASE);
+}
+
+/* Both threads pop, the compare-and-swap decides who owns the slot. The
+ * slot contents are only used when the swap succeeds, so a slot that was
+ * overwritten in the meantime is never used. */
+bool CaptureThread::pop(Slot *slot)
+{
+    unsigned int r = __atomic_load_n(&ring_read, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        if (r == __atomic_load_n(&ring_write, __ATOMIC_ACQUIRE))
+            return false;
+        const Slot *s = &ring[r & (RING_SIZE - 1)];
+        slot->index = __atomic_load_n(&s->index, __ATOMIC_RELAXED);
+        slot->bytesused = __atomic_load_n(&s->bytesused, __ATOMIC_RELAXED);
+        slot->timestamp = __atomic_load_n(&s->timestamp, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&ring_read, &r, r + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+    }
+}
+
+bool CaptureThread::take(CapturedFrame *frame)
+{
+    /* Reset the notification before looking, so a frame that arrives
+     * after this will trigger a new one */
+    uint64_t count;
+    if (::read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        qWarning() << "Failed to read capture notification";
+
+    Slot latest;
+    if (!pop(&latest))
+        return false;
+    if (policy == DropNewest)
+    {
+        /* The rest stays queued, have the consumer come back for it */
+        if (__atomic_load_n(&ring_read, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring_write, __ATOMIC_ACQUIRE))
+            notify();
+    }
+    else
+    {
+        Slot next;
+        while (pop(&next))
+        {
+            drop(latest.index);
+            latest = next;
+        }
+    }
+
+    frame->index = latest.index;
+    frame->bytesused = latest.bytesused;
+    frame->data = capture->buffer_data(latest.index);
+    frame->timestamp = latest.timestamp;
+    return true;
+}
+
+int CaptureThread::release(const CapturedFrame &frame)
+{
+    return capture->queue_buffer(frame.index);
+}
+
+int CaptureThread::error() const
+{
+    return __atomic_load_n(&capture_error, __ATOMIC_ACQUIRE);
+}
+
+unsigned int CaptureThread::dropped() const
+{
+    return __atomic_load_n(&dropped_frames, __ATOMIC_RELAXED);
+}
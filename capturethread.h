@@ -0,0 +1,82 @@
+#ifndef CAPTURETHREAD_H
+#define CAPTURETHREAD_H
+
+#include <QThread>
+
+class VideoSource;
+
+/* A frame that was dequeued from the driver */
+struct CapturedFrame
+{
+    unsigned int index; /* Driver buffer index */
+    unsigned int bytesused;
+    const void *data;
+    long long timestamp; /* Capture time in microseconds, CLOCK_MONOTONIC */
+};
+
+/* Dequeues frames from the capture device as soon as the driver has them,
+ * independent of how busy the GUI thread is. The frames wait in a small
+ * lock-free ring until the processing stage takes them, notify_handle()
+ * becomes readable when there is something in the ring.
+ * DropOldest delivers the freshest frame: when the ring is full the oldest
+ * frame goes back to the driver, and take() skips over the frames that
+ * are older than the newest one. DropNewest delivers every frame in order:
+ * take() returns the oldest one, and when the ring is full the newly
+ * captured frame goes back to the driver. Frames that go back are counted
+ * as dropped. */
+class CaptureThread : public QThread
+{
+public:
+    enum DropPolicy
+    {
+        DropOldest,
+        DropNewest
+    };
+
+    CaptureThread(VideoSource *capture, DropPolicy policy);
+    ~CaptureThread();
+
+    void stop();
+
+    /* For use in select() or a QSocketNotifier */
+    int notify_handle() const { return event_fd; }
+
+    /* Take the next frame according to the policy. Returns false when
+     * there is no frame waiting. */
+    bool take(CapturedFrame *frame);
+    /* Give a frame back to the driver when done with it */
+    int release(const CapturedFrame &frame);
+
+    /* Negative errno when capturing failed, the thread has stopped then */
+    int error() const;
+    /* Number of frames that were never processed */
+    unsigned int dropped() const;
+
+protected:
+    struct Slot
+    {
+        unsigned int index;
+        unsigned int bytesused;
+        long long timestamp;
+    };
+    enum { RING_SIZE = 32 }; /* power of two, larger than any depth */
+
+    VideoSource *capture;
+    DropPolicy policy;
+    unsigned int depth;
+    int event_fd;
+    int stop_fd;
+    Slot ring[RING_SIZE];
+    unsigned int ring_write; /* Only modified by the capture thread */
+    unsigned int ring_read; /* Advanced with compare-and-swap by both threads */
+    unsigned int dropped_frames;
+    int capture_error;
+
+    void run();
+    void push(const Slot &slot);
+    bool pop(Slot *slot);
+    void drop(unsigned int index);
+    void notify();
+};
+
+#endif // CAPTURETHREAD_H
@@ -0,0 +1,78 @@
+#include "dmafifostats.h"
+#include <string.h>
+
+DmaFifoStats::DmaFifoStats()
+{
+    reset(0);
+}
+
+void DmaFifoStats::reset(unsigned int blocks)
+{
+    memset(occupancy, 0, sizeof(occupancy));
+    samples = 0;
+    this->blocks = blocks;
+    transfers = 0;
+    drops = 0;
+    short_blocks = 0;
+}
+
+void DmaFifoStats::sample(unsigned int used)
+{
+    if (used > MAX_BLOCKS)
+        used = MAX_BLOCKS;
+    ++occupancy[used];
+    ++samples;
+}
+
+unsigned int DmaFifoStats::percentAtMost(unsigned int used) const
+{
+    if (!samples)
+        return 0;
+    if (used > MAX_BLOCKS)
+        used = MAX_BLOCKS;
+    unsigned int count = 0;
+    for (unsigned int i = 0; i <= used; ++i)
+        count += occupancy[i];
+    return (count * 100ULL) / samples;
+}
+
+unsigned int DmaFifoStats::fullPercent() const
+{
+    if (!samples || !blocks)
+        return 0;
+    return 100 - percentAtMost(blocks - 1);
+}
+
+QString DmaFifoStats::toString() const
+{
+    QString result = QString("%1 blocks, %2 transfers, %3 dropped, %4 short, in use:")
+            .arg(blocks).arg(transfers).arg(drops).arg(short_blocks);
+    for (unsigned int i = 0; i <= blocks && i <= MAX_BLOCKS; ++i)
+    {
+        unsigned int count = occupancy[i];
+        /* The last bucket includes anything above */
+        if (i == blocks)
+            for (unsigned int j = i + 1; j <= MAX_BLOCKS; ++j)
+                count += occupancy[j];
+        result += QString(" %1:%2%").arg(i).arg(samples ? (count * 100ULL) / samples : 0);
+    }
+    return result;
+}
+
+unsigned int tuneBlockCount(const DmaFifoStats &stats, unsigned int minimum, unsigned int maximum)
+{
+    unsigned int current = stats.blockCount();
+
+    /* A few seconds of video */
+    if (stats.transferCount() < 100)
+        return current;
+
+    /* More than 1% lost, or full for a tenth of the time */
+    if (stats.dropped() * 100 > stats.transferCount() || stats.fullPercent() >= 10)
+        return current < maximum ? current + 1 : current;
+
+    if (!stats.dropped() && current > minimum && current >= 2 && stats.percentAtMost(current - 2) == 100)
+        return current - 1;
+
+    return current;
+}
@@ -0,0 +1,47 @@
+#ifndef DMAFIFOSTATS_H
+#define DMAFIFOSTATS_H
+
+#include <QString>
+
+/* Counters for a DMA FIFO between the CPU and the logic: the blocks that
+ * went through, the frames that got lost and how many of the blocks were
+ * in use when it was sampled. */
+class DmaFifoStats
+{
+public:
+    DmaFifoStats();
+
+    void reset(unsigned int blocks);
+    void transferred(unsigned int count = 1) { transfers += count; }
+    /* No free block, the frame was dropped */
+    void drop() { ++drops; }
+    /* Block with less than a frame in it, not shown */
+    void shortBlock() { ++short_blocks; }
+    void sample(unsigned int used);
+
+    unsigned int blockCount() const { return blocks; }
+    unsigned int transferCount() const { return transfers; }
+    unsigned int dropped() const { return drops + short_blocks; }
+    /* Percentage of the samples that found all blocks in use */
+    unsigned int fullPercent() const;
+    /* Percentage of the samples that found at most "used" blocks in use */
+    unsigned int percentAtMost(unsigned int used) const;
+    /* Single line, for logging */
+    QString toString() const;
+
+protected:
+    enum { MAX_BLOCKS = 16 }; /* Last bucket collects everything above */
+    unsigned int occupancy[MAX_BLOCKS + 1];
+    unsigned int samples;
+    unsigned int blocks;
+    unsigned int transfers;
+    unsigned int drops;
+    unsigned int short_blocks;
+};
+
+/* Block count for the next run based on what "stats" observed. One more
+ * block when frames got lost or the ring was often full, one less when the
+ * last block was never needed. Stays the same without enough samples. */
+unsigned int tuneBlockCount(const DmaFifoStats &stats, unsigned int minimum, unsigned int maximum);
+
+#endif // DMAFIFOSTATS_H
@@ -0,0 +1,155 @@
+#include "fractalkernels.h"
+
+/* Points calculated in parallel. The compiler maps these vectors onto
+ * whatever SIMD unit the target has (SSE2/AVX, NEON on aarch64) and falls
+ * back to unrolled scalar code otherwise. */
+#define FRACTAL_LANES 4
+
+typedef double vdouble __attribute__((vector_size(FRACTAL_LANES * sizeof(double))));
+typedef long long vmask __attribute__((vector_size(FRACTAL_LANES * sizeof(long long))));
+
+static inline bool any_lane(const vmask &m)
+{
+    long long result = 0;
+    for (int i = 0; i < FRACTAL_LANES; ++i)
+        result |= m[i];
+    return result != 0;
+}
+
+/* z^Power by repeated complex multiplication, unrolled at compile time */
+template <int Power> struct ComplexPower
+{
+    static inline void apply(vdouble &zx, vdouble &zy)
+    {
+        vdouble px = zx;
+        vdouble py = zy;
+        ComplexPower<Power - 1>::apply(px, py);
+        vdouble t = px * zx - py * zy;
+        zy = px * zy + py * zx;
+        zx = t;
+    }
+};
+
+template <> struct ComplexPower<2>
+{
+    static inline void apply(vdouble &zx, vdouble &zy)
+    {
+        vdouble t = zx * zx - zy * zy;
+        zy = zx * zy;
+        zy += zy;
+        zx = t;
+    }
+};
+
+/* The formulas. "start" sets up the initial z and c for a pixel at (px, py),
+ * "step" calculates the next z. */
+template <int Power> struct Multibrot
+{
+    static inline void start(const vdouble &px, const vdouble &py, double, double,
+                             vdouble &zx, vdouble &zy, vdouble &cx, vdouble &cy)
+    {
+        zx = px;
+        zy = py;
+        cx = px;
+        cy = py;
+    }
+    static inline void step(vdouble &zx, vdouble &zy, const vdouble &cx, const vdouble &cy)
+    {
+        ComplexPower<Power>::apply(zx, zy);
+        zx += cx;
+        zy += cy;
+    }
+};
+
+typedef Multibrot<2> Mandelbrot;
+
+struct Julia
+{
+    static inline void start(const vdouble &px, const vdouble &py, double param_x, double param_y,
+                             vdouble &zx, vdouble &zy, vdouble &cx, vdouble &cy)
+    {
+        zx = px;
+        zy = py;
+        cx = vdouble() + param_x;
+        cy = vdouble() + param_y;
+    }
+    static inline void step(vdouble &zx, vdouble &zy, const vdouble &cx, const vdouble &cy)
+    {
+        Mandelbrot::step(zx, zy, cx, cy);
+    }
+};
+
+struct BurningShip
+{
+    static inline void start(const vdouble &px, const vdouble &py, double param_x, double param_y,
+                             vdouble &zx, vdouble &zy, vdouble &cx, vdouble &cy)
+    {
+        Mandelbrot::start(px, py, param_x, param_y, zx, zy, cx, cy);
+    }
+    static inline void step(vdouble &zx, vdouble &zy, const vdouble &cx, const vdouble &cy)
+    {
+        /* Clear the sign bits to get the absolute values */
+        vdouble ax = (vdouble)((vmask)zx & 0x7FFFFFFFFFFFFFFFLL);
+        vdouble ay = (vdouble)((vmask)zy & 0x7FFFFFFFFFFFFFFFLL);
+        Mandelbrot::step(ax, ay, cx, cy);
+        zx = ax;
+        zy = ay;
+    }
+};
+
+/* Number of iterations before a point is considered to be inside the set.
+ * Colors 0..254 are escape counts, 255 (black) is reserved for "inside" */
+static constexpr int FRACTAL_MAX_ITERATIONS = 254;
+
+template <class Formula, int MaxIterations>
+static void render_scanline(unsigned char *output, unsigned int width,
+                            double x, double y, double dx,
+                            double param_x, double param_y)
+{
+    const vdouble py = vdouble() + y;
+
+    for (unsigned int pixel = 0; pixel < width; pixel += FRACTAL_LANES)
+    {
+        vdouble px;
+        for (int i = 0; i < FRACTAL_LANES; ++i)
+            px[i] = x + (pixel + i) * dx;
+        vdouble zx, zy, cx, cy;
+        Formula::start(px, py, param_x, param_y, zx, zy, cx, cy);
+
+        vmask active = (vmask)(zx * zx + zy * zy <= 4.0);
+        vmask count = active & 1;
+        for (int n = 1; n < MaxIterations; ++n)
+        {
+            if (!any_lane(active))
+                break;
+            Formula::step(zx, zy, cx, cy);
+            active &= (vmask)(zx * zx + zy * zy <= 4.0);
+            count -= active; /* "true" lanes are -1 */
+        }
+
+        unsigned int lanes = width - pixel;
+        if (lanes > FRACTAL_LANES)
+            lanes = FRACTAL_LANES;
+        for (unsigned int i = 0; i < lanes; ++i)
+            output[pixel + i] = (count[i] >= MaxIterations) ? 255 : (unsigned char)count[i];
+    }
+}
+
+FractalScanlineFunc getFractalScanlineFunc(EFilters fractal)
+{
+    switch (fractal)
+    {
+    case FilterMandelbrot:
+        return &render_scanline<Mandelbrot, FRACTAL_MAX_ITERATIONS>;
+    case FilterJulia:
+        return &render_scanline<Julia, FRACTAL_MAX_ITERATIONS>;
+    case FilterBurningShip:
+        return &render_scanline<BurningShip, FRACTAL_MAX_ITERATIONS>;
+    case FilterMultibrot3:
+        return &render_scanline<Multibrot<3>, FRACTAL_MAX_ITERATIONS>;
+    case FilterMultibrot4:
+        return &render_scanline<Multibrot<4>, FRACTAL_MAX_ITERATIONS>;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef FRACTALKERNELS_H
+#define FRACTALKERNELS_H
+
+#include "types.h"
+
+/* Renders a single scanline of "width" Indexed8 pixels, in the same format
+ * as the "mandelbrot" bitstream produces: the value is the iteration count
+ * at which the point escaped, 255 means it never did (inside the set).
+ * Pixel i is at (x + i * dx, y). For Julia sets, (cx, cy) is the constant
+ * parameter, the other formulas ignore it. */
+typedef void (*FractalScanlineFunc)(unsigned char *output, unsigned int width,
+                                    double x, double y, double dx,
+                                    double cx, double cy);
+
+/* Returns NULL if there is no software implementation for "fractal" */
+FractalScanlineFunc getFractalScanlineFunc(EFilters fractal);
+
+#endif // FRACTALKERNELS_H
@@ -0,0 +1,66 @@
+#include "framelender.h"
+#include <stdlib.h>
+
+FrameLender::FrameLender():
+    leases(0),
+    retired(false)
+{
+}
+
+QImage FrameLender::lend(void *buffer, const uchar *data, int width, int height, int bytesPerLine, QImage::Format format)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    Lease *lease = new Lease;
+    lease->lender = this;
+    lease->buffer = buffer;
+    ++leases;
+    return QImage(data, width, height, bytesPerLine, format, cleanup, lease);
+#else
+    QImage result = QImage(data, width, height, bytesPerLine, format).copy();
+    giveBack(buffer);
+    return result;
+#endif
+}
+
+void FrameLender::cleanup(void *info)
+{
+    Lease *lease = (Lease *)info;
+    FrameLender *lender = lease->lender;
+    lender->giveBack(lease->buffer);
+    delete lease;
+    --lender->leases;
+    if (lender->retired && !lender->leases)
+        delete lender;
+}
+
+void FrameLender::retire()
+{
+    retired = true;
+    if (!leases)
+        delete this;
+}
+
+BufferFrameLender::BufferFrameLender(unsigned int _size):
+    size(_size)
+{
+}
+
+BufferFrameLender::~BufferFrameLender()
+{
+    for (unsigned int i = 0; i < free_buffers.size(); ++i)
+        free(free_buffers[i]);
+}
+
+unsigned char *BufferFrameLender::take()
+{
+    if (free_buffers.empty())
+        return (unsigned char *)malloc(size);
+    unsigned char *result = free_buffers.back();
+    free_buffers.pop_back();
+    return result;
+}
+
+void BufferFrameLender::giveBack(void *buffer)
+{
+    free_buffers.push_back((unsigned char *)buffer);
+}
@@ -0,0 +1,56 @@
+#ifndef FRAMELENDER_H
+#define FRAMELENDER_H
+
+#include <QImage>
+#include <vector>
+
+/* Lends out frame buffers as QImages, without copying them. The buffer
+ * comes back through the QImage cleanup function when the last copy of
+ * the image is gone, so a receiver can simply hold on to the image for as
+ * long as it needs the frame. All images must be released in the thread
+ * that runs the pipeline.
+ * Without image cleanup functions (Qt 4), lend() returns a copy. */
+class FrameLender
+{
+public:
+    /* An image on "data", which lies within "buffer" */
+    QImage lend(void *buffer, const uchar *data, int width, int height, int bytesPerLine, QImage::Format format);
+    unsigned int outstanding() const { return leases; }
+    /* The owner is done with the lender. It's deleted now, or when the
+     * last image is gone. */
+    void retire();
+
+protected:
+    FrameLender();
+    virtual ~FrameLender() {}
+    virtual void giveBack(void *buffer) = 0;
+
+    unsigned int leases;
+    bool retired;
+
+private:
+    struct Lease {
+        FrameLender *lender;
+        void *buffer;
+    };
+    static void cleanup(void *info);
+};
+
+/* Lends out heap buffers of a fixed size. When all are out, another one
+ * is allocated, so there are only as many as the receivers keep. */
+class BufferFrameLender: public FrameLender
+{
+public:
+    BufferFrameLender(unsigned int size);
+
+    unsigned char *take();
+
+protected:
+    ~BufferFrameLender();
+    void giveBack(void *buffer);
+
+    unsigned int size;
+    std::vector<unsigned char *> free_buffers;
+};
+
+#endif // FRAMELENDER_H
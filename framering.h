@@ -0,0 +1,132 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+/* Layout of the shared memory frame ring that FrameRingPublisher writes,
+ * for the processes that read it. No Qt in here, so that the readers can
+ * include it as well, from C or C++. C readers need the GNU extensions
+ * for syscall(), e.g. -std=gnu99.
+ *
+ * The ring is a POSIX shared memory object, e.g. "/pr-video". The first
+ * page holds the FrameRingHeader and a FrameRingSlot per slot, the pixels
+ * of slot "i" are at data_offset + i * slot_size. Frame "id" goes into slot
+ * id % slot_count, a reader has slot_count - 1 frame times to use a frame
+ * in place before it is overwritten. The publisher never waits for the
+ * readers.
+ *
+ * Each slot is a seqlock, "sequence" is odd while the publisher writes the
+ * slot. A reader takes the sequence with frame_ring_begin(), uses the
+ * frame where it is and checks with frame_ring_valid() afterwards. When
+ * that fails, the frame was overwritten in the meantime and whatever was
+ * made of it must be discarded.
+ *
+ * Reading the latest frames, with the mapping opened read-only:
+ *
+ *   uint32_t seen = frame_ring_published(header);
+ *   while (!header->closed)
+ *   {
+ *       frame_ring_wait(header, seen);
+ *       seen = frame_ring_published(header);
+ *       const FrameRingSlot *slot = frame_ring_latest(header);
+ *       uint32_t sequence = frame_ring_begin(slot);
+ *       if (sequence & 1)
+ *           continue;
+ *       ... use slot->width, ... and frame_ring_data(header, slot) ...
+ *       if (!frame_ring_valid(slot, sequence))
+ *           ... discard ...
+ *   }
+ *
+ * A closed ring stays mapped until the reader unmaps it, a new publisher
+ * creates a new object under the same name. */
+
+#include <stdint.h>
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define FRAME_RING_MAGIC 0x474e5246 /* "FRNG" */
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_MAX_SLOTS 32
+#define FRAME_RING_HEADER_SIZE 4096
+
+/* The pixel formats are QImage::Format values, always one of these. Other
+ * formats, like the indexed colors of the fractal, are published as RGB32. */
+#define FRAME_RING_FORMAT_RGB32 4 /* 0xffRRGGBB in native byte order */
+#define FRAME_RING_FORMAT_RGB16 7 /* RGB565 */
+#define FRAME_RING_FORMAT_RGB888 13 /* R, G, B bytes */
+#define FRAME_RING_FORMAT_GRAYSCALE8 24
+
+typedef struct FrameRingSlot
+{
+    uint32_t sequence; /* Odd while being written */
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; /* Bytes from one row to the next */
+    uint32_t bytes; /* Pixel data in use, stride * height */
+    uint64_t id; /* Counts from 0 since the ring was created */
+    int64_t timestamp; /* Capture time on CLOCK_MONOTONIC in microseconds */
+} __attribute__((aligned(64))) FrameRingSlot;
+
+typedef struct FrameRingHeader
+{
+    uint32_t magic; /* Set last, when the rest is valid */
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size; /* Bytes of pixel data per slot */
+    uint32_t data_offset; /* Of the first slot's pixels */
+    uint32_t published; /* Frames published so far, futex for the readers */
+    uint32_t closed; /* The publisher has gone */
+    uint32_t reserved;
+    uint64_t latest; /* Id of the newest complete frame */
+} __attribute__((aligned(64))) FrameRingHeader;
+
+typedef struct FrameRingLayout
+{
+    FrameRingHeader header;
+    FrameRingSlot slot_table[FRAME_RING_MAX_SLOTS];
+} FrameRingLayout;
+
+static inline uint32_t frame_ring_published(const FrameRingHeader *header)
+{
+    return __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+}
+
+/* Sleep until "published" differs from "seen". Returns 0 or -1 with errno
+ * set like futex(2), EAGAIN means it already changed. */
+static inline int frame_ring_wait(const FrameRingHeader *header, uint32_t seen)
+{
+    return syscall(SYS_futex, &header->published, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+static inline const FrameRingSlot *frame_ring_slot(const FrameRingHeader *header, uint64_t id)
+{
+    return &((const FrameRingLayout *)header)->slot_table[id % header->slot_count];
+}
+
+static inline const FrameRingSlot *frame_ring_latest(const FrameRingHeader *header)
+{
+    return frame_ring_slot(header, __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE));
+}
+
+static inline const unsigned char *frame_ring_data(const FrameRingHeader *header, const FrameRingSlot *slot)
+{
+    const FrameRingSlot *first = ((const FrameRingLayout *)header)->slot_table;
+    return (const unsigned char *)header + header->data_offset + (slot - first) * header->slot_size;
+}
+
+static inline uint32_t frame_ring_begin(const FrameRingSlot *slot)
+{
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+}
+
+/* The frame was not touched since frame_ring_begin() returned "sequence" */
+static inline bool frame_ring_valid(const FrameRingSlot *slot, uint32_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+#endif // FRAMERING_H
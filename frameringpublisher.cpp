@@ -0,0 +1,167 @@
+#include "frameringpublisher.h"
+#include "framering.h"
+#include "latencyhistogram.h"
+#include "videokernels.h"
+
+#include <QDebug>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Page aligned pixels, so readers can hand them to anything that maps
+ * memory in pages */
+static unsigned int pageAlign(unsigned int size)
+{
+    return (size + FRAME_RING_HEADER_SIZE - 1) & ~(FRAME_RING_HEADER_SIZE - 1);
+}
+
+FrameRingPublisher::FrameRingPublisher(QObject *parent):
+    QObject(parent),
+    header(NULL),
+    map_size(0),
+    next_id(0),
+    dropped_frames(0)
+{
+}
+
+FrameRingPublisher::~FrameRingPublisher()
+{
+    close();
+}
+
+int FrameRingPublisher::open(const char *filename, unsigned int slot_size, unsigned int slot_count)
+{
+    close();
+
+    if (slot_count < 2)
+        slot_count = 2;
+    if (slot_count > FRAME_RING_MAX_SLOTS)
+        slot_count = FRAME_RING_MAX_SLOTS;
+    slot_size = pageAlign(slot_size);
+
+    /* Readers of a previous ring keep that one, a new object is created
+     * rather than resizing one that may be mapped */
+    shm_unlink(filename);
+    int fd = shm_open(filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -errno;
+    size_t size = FRAME_RING_HEADER_SIZE + (size_t)slot_size * slot_count;
+    if (ftruncate(fd, size) < 0)
+    {
+        int r = -errno;
+        ::close(fd);
+        shm_unlink(filename);
+        return r;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        int r = -errno;
+        shm_unlink(filename);
+        return r;
+    }
+
+    name = filename;
+    header = (FrameRingHeader *)map;
+    map_size = size;
+    next_id = 0;
+    dropped_frames = 0;
+
+    /* The object starts out zeroed, all slots are empty and even */
+    header->version = FRAME_RING_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->data_offset = FRAME_RING_HEADER_SIZE;
+    __atomic_store_n(&header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+    qDebug() << "Publishing frames in shared memory" << name << "with" << slot_count << "slots of" << slot_size << "bytes";
+    return 0;
+}
+
+void FrameRingPublisher::close()
+{
+    if (!header)
+        return;
+    /* Wake the readers to have them look at "closed" */
+    __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->published, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->published, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    munmap(header, map_size);
+    shm_unlink(name.constData());
+    if (dropped_frames)
+        qDebug() << "Shared memory" << name << "dropped" << dropped_frames << "frames";
+    header = NULL;
+}
+
+/* The formats framering.h defines, readers can use these as they are */
+static bool ringFormat(QImage::Format format)
+{
+    switch (format)
+    {
+    case QImage::Format_RGB32:
+    case QImage::Format_RGB16:
+    case QImage::Format_RGB888:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    case QImage::Format_Grayscale8:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+void FrameRingPublisher::publish(const QImage &frame, qint64 timestamp)
+{
+    if (frame.isNull() || !header)
+        return;
+
+    /* Readers don't get a color table, so indexed frames must be
+     * converted */
+    const QImage image = ringFormat(frame.format()) ? frame : frame.convertToFormat(QImage::Format_RGB32);
+
+    const unsigned int bytes = image.bytesPerLine() * image.height();
+    if (bytes > header->slot_size)
+    {
+        if (!dropped_frames)
+            qWarning() << "Frames of" << bytes << "bytes don't fit in" << name;
+        ++dropped_frames;
+        return;
+    }
+
+    FrameRingSlot *slot = const_cast<FrameRingSlot *>(frame_ring_slot(header, next_id));
+    unsigned char *data = const_cast<unsigned char *>(frame_ring_data(header, slot));
+
+    /* Odd sequence, then the frame, then even again. The fences keep the
+     * frame in between for readers on other cores. */
+    uint32_t sequence = slot->sequence;
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->format = image.format();
+    slot->width = image.width();
+    slot->height = image.height();
+    slot->stride = image.bytesPerLine();
+    slot->bytes = bytes;
+    slot->id = next_id;
+    slot->timestamp = timestamp;
+    /* The readers are on other cores, keep it out of this one's cache */
+    VideoStreamRowFunc stream = video_stream_row_kernel();
+    if (stream)
+        stream(data, image.constBits(), bytes);
+    else
+        memcpy(data, image.constBits(), bytes);
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&header->latest, next_id, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->published, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->published, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    ++next_id;
+}
+
+void FrameRingPublisher::publish(const QImage &image)
+{
+    publish(image, monotonicMicroseconds());
+}
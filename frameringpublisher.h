@@ -0,0 +1,50 @@
+#ifndef FRAMERINGPUBLISHER_H
+#define FRAMERINGPUBLISHER_H
+
+#include <QObject>
+#include <QImage>
+#include <QByteArray>
+
+struct FrameRingHeader;
+
+/* Makes the rendered frames available to other processes, in a ring of
+ * fixed size slots in POSIX shared memory, see framering.h for the layout.
+ * Each frame is copied into the ring once, the readers use it in place.
+ * Indexed frames are converted to RGB32 first. Frames that don't fit in a
+ * slot are dropped. */
+class FrameRingPublisher : public QObject
+{
+    Q_OBJECT
+public:
+    enum {
+        DEFAULT_SLOT_COUNT = 4,
+        DEFAULT_SLOT_SIZE = 1920 * 1080 * 4
+    };
+
+    FrameRingPublisher(QObject *parent = 0);
+    ~FrameRingPublisher(); /* Removes the ring */
+
+    /* Create the shared memory object "name", a ring that exists under
+     * that name is replaced */
+    int open(const char *name, unsigned int slot_size = DEFAULT_SLOT_SIZE, unsigned int slot_count = DEFAULT_SLOT_COUNT);
+
+    unsigned int dropped() const { return dropped_frames; }
+
+public slots:
+    /* Connect with a direct connection, the image data may be reused
+     * as soon as this returns */
+    void publish(const QImage &image, qint64 timestamp);
+    /* For sources without a capture time, stamped with the current time */
+    void publish(const QImage &image);
+
+protected:
+    QByteArray name;
+    FrameRingHeader *header;
+    size_t map_size;
+    unsigned long long next_id;
+    unsigned int dropped_frames;
+
+    void close();
+};
+
+#endif // FRAMERINGPUBLISHER_H
@@ -0,0 +1,62 @@
+#include "latencyhistogram.h"
+#include <string.h>
+#include <time.h>
+
+qint64 monotonicMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    memset(buckets, 0, sizeof(buckets));
+    total = 0;
+    max_ms = 0;
+}
+
+void LatencyHistogram::add(qint64 microseconds)
+{
+    if (microseconds < 0)
+        microseconds = 0;
+    unsigned int ms = (unsigned int)(microseconds / 1000);
+    if (ms > max_ms)
+        max_ms = ms;
+    if (ms >= BUCKETS)
+        ms = BUCKETS - 1;
+    ++buckets[ms];
+    ++total;
+}
+
+unsigned int LatencyHistogram::percentile(unsigned int percent) const
+{
+    if (!total)
+        return 0;
+    unsigned int wanted = (total * percent + 99) / 100;
+    unsigned int seen = 0;
+    for (unsigned int ms = 0; ms < BUCKETS; ++ms)
+    {
+        seen += buckets[ms];
+        if (seen >= wanted)
+            return ms;
+    }
+    return max_ms;
+}
+
+QString LatencyHistogram::toString() const
+{
+    QString result = QString("%1 frames, p50=%2ms p90=%3ms p99=%4ms max=%5ms")
+            .arg(total).arg(percentile(50)).arg(percentile(90)).arg(percentile(99)).arg(max_ms);
+    for (unsigned int ms = 0; ms < BUCKETS; ++ms)
+    {
+        if (buckets[ms])
+            result += QString("\n%1%2ms: %3").arg(ms == BUCKETS - 1 ? ">=" : "").arg(ms).arg(buckets[ms]);
+    }
+    return result;
+}
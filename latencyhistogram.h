@@ -0,0 +1,33 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QString>
+
+/* Microseconds on CLOCK_MONOTONIC, the same clock V4L2 uses for its
+ * buffer timestamps */
+qint64 monotonicMicroseconds();
+
+/* Histogram of latencies in 1ms buckets */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void add(qint64 microseconds);
+    void reset();
+
+    unsigned int count() const { return total; }
+    /* Latency in ms below which "percent" of the samples are */
+    unsigned int percentile(unsigned int percent) const;
+    unsigned int maximum() const { return max_ms; }
+    /* Multi-line text representation, for logging */
+    QString toString() const;
+
+protected:
+    enum { BUCKETS = 250 }; /* Last bucket collects everything above */
+    unsigned int buckets[BUCKETS];
+    unsigned int total;
+    unsigned int max_ms;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -3,7 +3,10 @@
 #include "dyplocontext.h"
 #include "sysfile.hpp"
 #include "qprregionlabel.h"
+#include "frameringpublisher.h"
+#include "videopointfilter.h"
 
+#include <QFile>
 #include <QGraphicsOpacityEffect>
 #include <QMouseEvent>
 #include <QPropertyAnimation>
@@ -21,6 +24,45 @@ static const bool allow_all_in_one_window = false;
 
 static DyploContext dyploContext;
 
+/* Fractals in the order of the cbFractal items, with a point on the edge
+ * of the set to zoom in on */
+static const struct {
+    EFilters fractal;
+    double x;
+    double y;
+} fractal_types[] = {
+    { FilterMandelbrot, -0.86122562296399741, -0.23139131123653386 },
+    { FilterJulia, 0.07, -0.7 },
+    { FilterBurningShip, -0.425, -0.97 },
+    { FilterMultibrot3, -0.49, -0.595 },
+    { FilterMultibrot4, 0.36, -0.7 },
+};
+
+/* VIDEO_SHM=<name> publishes the frames of the video in a shared memory
+ * ring for other processes, see framering.h. The second and further
+ * cameras get their number appended to the name. MANDELBROT_SHM does the
+ * same for the fractal. Returns NULL when not set or on failure. */
+static FrameRingPublisher *openFrameRing(const char *variable, int index, QObject *parent)
+{
+    const char *env = getenv(variable);
+    if (!env || !*env)
+        return NULL;
+    QByteArray name = env;
+    if (name[0] != '/')
+        name.prepend('/');
+    if (index)
+        name += QByteArray::number(index);
+    FrameRingPublisher *ring = new FrameRingPublisher(parent);
+    int r = ring->open(name.constData());
+    if (r < 0)
+    {
+        qWarning() << "Cannot create shared memory" << name << ":" << -r;
+        delete ring;
+        return NULL;
+    }
+    return ring;
+}
+
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
@@ -141,23 +183,29 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(&cpuStatsTimer, SIGNAL(timeout()), this, SLOT(updateCpuStats()));
     cpuStatsTimer.start(1000);
 
-    connect(&video, SIGNAL(renderedImage(QImage)), ui_video->video, SLOT(updatePixmap(QImage)));
-    connect(&video, SIGNAL(setActive(bool)), this, SLOT(updateVideoDemoState(bool)));
+    createVideoPipelines();
+    watchLookFile();
     connect(&dyploContext, SIGNAL(programmedPartial(int,const char*,uint,uint)), this, SLOT(showProgrammingMetrics(int,const char*,uint,uint)));
-    connect(&ui_video->video->framerateCounter, SIGNAL(frameRate(uint,uint)), this, SLOT(showVideoStats(uint,uint)));
     connect(ui_video->video, SIGNAL(resized(QWidget*)), this, SLOT(videoWindowResized(QWidget*)));
 
     connect(&mandelbrot, SIGNAL(renderedImage(QImage)), ui_fractal->mandelbrot, SLOT(updatePixmap(QImage)));
+    FrameRingPublisher *fractalRing = openFrameRing("MANDELBROT_SHM", 0, this);
+    if (fractalRing)
+        connect(&mandelbrot, SIGNAL(renderedImage(QImage)), fractalRing, SLOT(publish(QImage)), Qt::DirectConnection);
     connect(&mandelbrot, SIGNAL(setActive(bool)), this, SLOT(updateMandelbrotDemoState(bool)));
     connect(&ui_fractal->mandelbrot->framerateCounter, SIGNAL(frameRate(uint,uint)), this, SLOT(showMandelbrotStats(uint,uint)));
 
     connect(ui_fractal->mandelbrot, SIGNAL(clicked(QMouseEvent*)), this, SLOT(mandelbrotClicked(QMouseEvent*)));
 
     connect(ui_video->buttonVideodemo, SIGNAL(toggled(bool)), this, SLOT(buttonVideodemo_toggled(bool)));
+    connect(ui_video->cbFilterContrast, SIGNAL(toggled(bool)), this, SLOT(cbVideoFilter_toggled()));
+    connect(ui_video->cbFilterGray, SIGNAL(toggled(bool)), this, SLOT(cbVideoFilter_toggled()));
+    connect(ui_video->cbFilterTreshold, SIGNAL(toggled(bool)), this, SLOT(cbVideoFilter_toggled()));
     connect(ui_fractal->buttonMandelbrotDemo, SIGNAL(toggled(bool)), this, SLOT(buttonMandelbrotDemo_toggled(bool)));
     connect(ui_fractal->btnPresetA, SIGNAL(pressed()), this, SLOT(btnPresetA_clicked()));
     connect(ui_fractal->btnPresetB, SIGNAL(pressed()), this, SLOT(btnPresetB_clicked()));
     connect(ui_fractal->btnPresetC, SIGNAL(pressed()), this, SLOT(btnPresetC_clicked()));
+    connect(ui_fractal->cbFractal, SIGNAL(currentIndexChanged(int)), this, SLOT(cbFractal_currentIndexChanged(int)));
 
     connect(ui_toppanel->pbTopicLogo, SIGNAL(clicked()), this, SLOT(pbTopicLogo_clicked()));
 
@@ -168,7 +216,10 @@ MainWindow::MainWindow(QWidget *parent) :
 MainWindow::~MainWindow()
 {
     mandelbrot.deactivate(); /* Calls back to UI, so we must do this before destroying the UI */
-    video.deactivate();
+    for (unsigned int i = 0; i < videos.size(); ++i)
+        videos[i]->deactivate();
+    for (unsigned int i = 0; i < videos.size(); ++i)
+        delete videos[i];
     delete ui;
     delete ui_fractal;
     delete ui_video;
@@ -176,6 +227,55 @@ MainWindow::~MainWindow()
     delete ui_floorplan;
 }
 
+/* VIDEO_CAMERAS=2 runs a pipeline for each of two cameras, each shown in
+ * its own view. They share the logic through the resource pool. */
+void MainWindow::createVideoPipelines()
+{
+    unsigned int regions = 0;
+    for (const auto& item: dyploContext.nodeInfo)
+        if (item.type == DyploNodeInfo::PR)
+            ++regions;
+    videoResources.setTotal(VideoResourcePool::PR_REGION, regions);
+    videoResources.setTotal(VideoResourcePool::DMA_CHANNEL, dyploContext.num_dma_nodes);
+
+    int count = 1;
+    const char *env = getenv("VIDEO_CAMERAS");
+    if (env && *env)
+        count = atoi(env);
+    if (count < 1)
+        count = 1;
+    if (count > 4)
+        count = 4;
+
+    for (int i = 0; i < count; ++i)
+    {
+        VideoWidget *view = ui_video->video;
+        if (i)
+        {
+            view = new VideoWidget(videoWidget);
+            view->setSizePolicy(ui_video->video->sizePolicy());
+            view->setMinimumSize(320, 240);
+            view->setAutoFillBackground(true);
+            view->setPalette(ui_video->video->palette());
+            ui_video->horizontalLayout->addWidget(view, 1);
+        }
+        VideoPipeline *video = new VideoPipeline(&videoResources, i);
+        videos.push_back(video);
+        videoViews.push_back(view);
+        videoStats.append("---");
+
+        connect(video, SIGNAL(renderedImage(QImage,qint64)), view, SLOT(updateFrame(QImage,qint64)));
+        FrameRingPublisher *ring = openFrameRing("VIDEO_SHM", i, this);
+        if (ring)
+            connect(video, SIGNAL(renderedImage(QImage,qint64)), ring, SLOT(publish(QImage,qint64)), Qt::DirectConnection);
+        connect(video, SIGNAL(setActive(bool)), this, SLOT(updateVideoDemoState(bool)));
+        connect(video, SIGNAL(stagesChanged()), this, SLOT(updateFloorplan()));
+        connect(&view->framerateCounter, SIGNAL(frameRate(uint,uint)), this, SLOT(showVideoStats(uint,uint)));
+        if (i)
+            connect(view, SIGNAL(resized(QWidget*)), this, SLOT(videoWindowResized(QWidget*)));
+    }
+}
+
 /* Display everything in the given rectangle (desktop area) */
 void MainWindow::showIn(const QRect &rec)
 {
@@ -301,7 +401,8 @@ void MainWindow::updateFloorplan()
 
     DyploNodeResourceList nodes;
     nodes.clear();
-    video.enumDyploResources(nodes);
+    for (unsigned int i = 0; i < videos.size(); ++i)
+        videos[i]->enumDyploResources(nodes);
     for (DyploNodeResourceList::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
         QLabel* l = getPrRegion(it->id);
         if (l) {
@@ -378,12 +479,26 @@ void MainWindow::showProgrammingMetrics(int node, const char *name, unsigned int
 
 void MainWindow::showVideoStats(unsigned int frames, unsigned int milliseconds)
 {
+    /* Each view has its own counter */
+    unsigned int index = 0;
+    while (index < videoViews.size() && sender() != &videoViews[index]->framerateCounter)
+        ++index;
+    if (index == videoViews.size())
+        return;
+
     QString message;
     if (frames)
         message = QString("%1 FPS").arg(((frames*1000)+500)/milliseconds);
     else
         message = "-";
-    ui_video->lblVideoStats->setText(message);
+    const LatencyHistogram &latency = videoViews[index]->latency;
+    if (latency.count())
+        message += QString(", %1 ms (p99 %2 ms)").arg(latency.percentile(50)).arg(latency.percentile(99));
+    unsigned int dropped = videos[index]->droppedFrames();
+    if (dropped)
+        message += QString(" (%1 dropped)").arg(dropped);
+    videoStats[index] = message;
+    ui_video->lblVideoStats->setText(videoStats.join("\n"));
 }
 
 void MainWindow::showMandelbrotStats(unsigned int frames, unsigned int milliseconds)
@@ -398,7 +513,8 @@ void MainWindow::showMandelbrotStats(unsigned int frames, unsigned int milliseco
     for (std::vector< std::pair<int, int> >::const_iterator it = mandelbrot.completed_work.begin(); it != mandelbrot.completed_work.end(); ++it)
     {
         QLabel* l = getPrRegion(it->second);
-        l->setText(QString("mandelbrot\n%2").arg(it->first));
+        if (l)
+            l->setText(QString("mandelbrot\n%2").arg(it->first));
     }
 }
 
@@ -407,19 +523,110 @@ void MainWindow::buttonVideodemo_toggled(bool checked)
     if (checked)
     {
         ui_video->lblVideoStats->setText("---");
-        if (video.activate(
-                    &dyploContext,
-                    ui_video->video->width(),
-                    ui_video->video->height(),
-                    ui_video->cbYUVToRGB->isChecked(),
-                    ui_video->cbFilterContrast->isChecked(),
-                    ui_video->cbFilterGray->isChecked(),
-                    ui_video->cbFilterTreshold->isChecked()))
+        /* Video runs when at least one camera works */
+        bool active = false;
+        /* Each leaves a share of the logic for the ones after it */
+        for (unsigned int i = 0; i < videos.size(); ++i)
+            videoResources.setStarting(videos[i], true);
+        for (unsigned int i = 0; i < videos.size(); ++i)
+            if (activateVideo(i) == 0)
+                active = true;
+        if (!active)
             updateVideoDemoState(false);
     }
     else
     {
-        video.deactivate();
+        for (unsigned int i = 0; i < videos.size(); ++i)
+            videos[i]->deactivate();
+    }
+}
+
+int MainWindow::activateVideo(unsigned int i)
+{
+    videoStats[i] = "---";
+    videoViews[i]->latency.reset();
+    int r = videos[i]->activate(
+                &dyploContext,
+                videoViews[i]->width(),
+                videoViews[i]->height(),
+                ui_video->cbYUVToRGB->isChecked(),
+                ui_video->cbFilterContrast->isChecked(),
+                ui_video->cbFilterGray->isChecked(),
+                ui_video->cbFilterTreshold->isChecked());
+    /* From here on it holds what it uses */
+    videoResources.setStarting(videos[i], false);
+    return r;
+}
+
+/* Start one video again, the others keep running */
+void MainWindow::restartVideo(unsigned int i)
+{
+    /* Keep the button down when this is the only video that runs */
+    ui_video->buttonVideodemo->blockSignals(true);
+    videos[i]->deactivate();
+    activateVideo(i);
+    ui_video->buttonVideodemo->setChecked(true);
+    ui_video->buttonVideodemo->blockSignals(false);
+    updateVideoDemoState(videos[i]->isActive());
+}
+
+/* VIDEO_LOOK_FILE=<file> holds a look like VIDEO_LOOK does, e.g.
+ * "gamma:1.5|posterize:4". The videos pick it up whenever the file
+ * changes, so the look can be adjusted while they run. */
+void MainWindow::watchLookFile()
+{
+    const char *env = getenv("VIDEO_LOOK_FILE");
+    if (!env || !*env)
+        return;
+    lookFile = env;
+    connect(&lookWatcher, SIGNAL(fileChanged(QString)), this, SLOT(lookFileChanged()));
+    lookFileChanged();
+}
+
+void MainWindow::lookFileChanged()
+{
+    /* Editors that save by renaming make the watcher lose the file */
+    if (!lookWatcher.files().contains(lookFile))
+        lookWatcher.addPath(lookFile);
+
+    QFile file(lookFile);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Cannot read" << lookFile;
+        return;
+    }
+    QByteArray description = file.readAll().trimmed();
+    /* Keep the current look when the new one is invalid */
+    VideoPointFilter check;
+    if (!check.parse(description.constData()))
+        return;
+
+    for (unsigned int i = 0; i < videos.size(); ++i)
+    {
+        /* This pipeline has no CPU pass for the look, start it again */
+        if (videos[i]->setLook(description.constData()) != 0 && videos[i]->isActive())
+            restartVideo(i);
+    }
+}
+
+void MainWindow::cbVideoFilter_toggled()
+{
+    if (!ui_video->buttonVideodemo->isChecked())
+        return;
+    bool restart = false;
+    for (unsigned int i = 0; i < videos.size(); ++i)
+    {
+        if (videos[i]->isActive() && videos[i]->setFilters(
+                    ui_video->cbFilterContrast->isChecked(),
+                    ui_video->cbFilterGray->isChecked(),
+                    ui_video->cbFilterTreshold->isChecked()) != 0)
+            restart = true;
+    }
+    if (restart)
+    {
+        /* Can't change the filters on the fly, start again */
+        ui_video->buttonVideodemo->setChecked(false);
+        ui_video->buttonVideodemo->setChecked(true);
     }
 }
 
@@ -444,6 +651,16 @@ void MainWindow::mandelbrotClicked(QMouseEvent *event)
     int w2 = ui_fractal->mandelbrot->width() / 2;
     int h2 = ui_fractal->mandelbrot->height() / 2;
 
+    /* A right click on a Julia set makes the point under the cursor its
+     * parameter c */
+    if (mandelbrot.getFractal() == FilterJulia && event->button() == Qt::RightButton)
+    {
+        mandelbrot.setJuliaParameter(
+                    x + z * (event->x() - w2),
+                    y + z * (event->y() - h2));
+        return;
+    }
+
     mandelbrot.setCoordinates(
                 x + z * (event->x() - w2),
                 y + z * (event->y() - h2));
@@ -511,24 +728,44 @@ void MainWindow::updateCpuStats()
 
 void MainWindow::videoWindowResized(QWidget *sender)
 {
-    ui_video->lblViewportSize->setText(
+    if (sender == ui_video->video)
+        ui_video->lblViewportSize->setText(
                 QString("Viewport: %1 x %2").arg(sender->width()).arg(sender->height()));
+    /* The video follows the new size from the next frame on */
+    for (unsigned int i = 0; i < videos.size(); ++i)
+        if (videoViews[i] == sender)
+            videos[i]->setViewport(sender->width(), sender->height());
 }
 
-void MainWindow::updateVideoDemoState(bool active)
+void MainWindow::updateVideoDemoState(bool)
 {
-    ui_video->buttonVideodemo->setChecked(active);
+    /* With more cameras, video runs as long as one of them does */
+    bool active = false;
+    QStringList sizes;
+    for (unsigned int i = 0; i < videos.size(); ++i)
+    {
+        if (!videos[i]->isActive())
+            continue;
+        active = true;
+        QSize s = videos[i]->getVideoSize();
+        sizes.append(QString("Video: %1 x %2").arg(s.width()).arg(s.height()));
+    }
+
+    /* Only the button starts video, it stops when the last one stops */
+    if (!active)
+        ui_video->buttonVideodemo->setChecked(false);
     ui_video->cbYUVToRGB->setEnabled(!active);
-    ui_video->cbFilterContrast->setEnabled(!active);
-    ui_video->cbFilterGray->setEnabled(!active);
-    ui_video->cbFilterTreshold->setEnabled(!active);
     ui_video->lblVideoStats->setVisible(active);
     ui_video->lblVideoSize->setVisible(active);
     if (active)
     {
-        QSize s = video.getVideoSize();
-        ui_video->lblVideoSize->setText(
-                    QString("Video: %1 x %2").arg(s.width()).arg(s.height()));
+        ui_video->lblVideoSize->setText(sizes.join("\n"));
+    }
+    else
+    {
+        for (unsigned int i = 0; i < videoViews.size(); ++i)
+            if (videoViews[i]->latency.count())
+                qDebug() << "Capture to paint latency:" << videoViews[i]->latency.toString();
     }
     updateFloorplan();
 }
@@ -575,6 +812,26 @@ void MainWindow::btnPresetC_clicked()
     mandelbrot.resetZoom();
 }
 
+void MainWindow::cbFractal_currentIndexChanged(int index)
+{
+    if (index < 0 || index >= (int)(sizeof(fractal_types) / sizeof(fractal_types[0])))
+        return;
+
+    /* The formula cannot change while running, so restart if needed */
+    bool active = ui_fractal->buttonMandelbrotDemo->isChecked();
+    if (active)
+        mandelbrot.deactivate();
+    mandelbrot.setFractal(fractal_types[index].fractal);
+    mandelbrot.setCoordinates(fractal_types[index].x, fractal_types[index].y);
+    mandelbrot.resetZoom();
+    /* The preset coordinates are for the mandelbrot only */
+    ui_fractal->btnPresetA->setEnabled(fractal_types[index].fractal == FilterMandelbrot);
+    ui_fractal->btnPresetB->setEnabled(fractal_types[index].fractal == FilterMandelbrot);
+    ui_fractal->btnPresetC->setEnabled(fractal_types[index].fractal == FilterMandelbrot);
+    if (active)
+        ui_fractal->buttonMandelbrotDemo->setChecked(true);
+}
+
 void MainWindow::pbTopicLogo_clicked()
 {
     if (isFullScreen())
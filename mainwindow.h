@@ -2,9 +2,12 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QFileSystemWatcher>
 #include <QTimer>
 #include <QLabel>
+#include <QStringList>
 #include "videopipeline.h"
+#include "videoresourcepool.h"
 #include "externalresources.h"
 #include "mandelbrotpipeline.h"
 #include "cpu/cpuinfo.h"
@@ -21,6 +24,7 @@ class FloorplanFrame;
 class IIOTempSensor;
 class SupplyCurrentSensor;
 class QScrollArea;
+class VideoWidget;
 
 class MainWindow : public QMainWindow
 {
@@ -45,14 +49,18 @@ private slots:
     void showMandelbrotStats(unsigned int frames,  unsigned int milliseconds);
     void updateCpuStats();
     void videoWindowResized(QWidget *sender);
+    void updateFloorplan();
 
     void buttonVideodemo_toggled(bool checked);
+    void cbVideoFilter_toggled();
+    void lookFileChanged();
     void buttonMandelbrotDemo_toggled(bool checked);
     void mandelbrotClicked(QMouseEvent *event);
     void prNodeLinkActivated(const QString &link);
     void btnPresetA_clicked();
     void btnPresetB_clicked();
     void btnPresetC_clicked();
+    void cbFractal_currentIndexChanged(int index);
     void pbTopicLogo_clicked();
 
 private:
@@ -67,7 +75,12 @@ private:
     QWidget*    toppanelWidget;
     CpuInfo cpuInfo;
     QTimer cpuStatsTimer;
-    VideoPipeline video;
+    VideoResourcePool videoResources;
+    std::vector<VideoPipeline*> videos;
+    std::vector<VideoWidget*> videoViews; /* For each of the videos */
+    QStringList videoStats;
+    QString lookFile; /* VIDEO_LOOK_FILE */
+    QFileSystemWatcher lookWatcher;
     MandelbrotPipeline mandelbrot;
     ExternalResources externals;
     QString programmingMetrics;
@@ -78,7 +91,10 @@ private:
     int updateStatsRobin;
 
     QLabel *getPrRegion(int id);
-    void updateFloorplan();
+    void createVideoPipelines();
+    int activateVideo(unsigned int i);
+    void restartVideo(unsigned int i);
+    void watchLookFile();
     void externalResourceEnable(int id, bool active);
 };
 
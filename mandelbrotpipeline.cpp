@@ -4,23 +4,18 @@
 #include <QDebug>
 #include <QImage>
 #include <QSocketNotifier>
+#include <QThread>
 #include <QTimer>
 #include <dyplo/hardware.hpp>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include "dyplocontext.h"
 #include "colormap.h"
 
 /* Scanline + 32-bit header*/
 #define SCANLINE_HEADER_SIZE 4
 
-struct MandelbrotRequest
-{
-    unsigned short line;
-    unsigned short size;
-    long long ax;
-    long long ay;
-    long long incr;
-} __attribute__((packed));
-
 static const char BITSTREAM_MANDELBROT[] = "mandelbrot";
 static const char BITSTREAM_MUX_NAME[] = "stream_mux";
 static const char BITSTREAM_MUX_DESC[] = "MUX";
@@ -44,20 +39,45 @@ static inline long long to_fixed_point(double v)
     return (long long)(v * ((long long)1 << 53));
 }
 
+static inline double from_fixed_point(long long v)
+{
+    return ((double)v) / ((long long)1 << 53);
+}
+
 class MandelbrotWorker
 {
+public:
+    std::vector<MandelbrotRequest> work_to_do;
+
+    virtual ~MandelbrotWorker() {}
+    virtual int getNodeIndex() const = 0;
+    virtual void commit_work() = 0;
+};
+
+/* Sends work to a "mandelbrot" node in logic */
+class MandelbrotWorkerDyplo : public MandelbrotWorker
+{
 protected:
     dyplo::HardwareConfig *node;
     dyplo::HardwareFifo *to_logic;
 public:
-    std::vector<MandelbrotRequest> work_to_do;
-
-    MandelbrotWorker(DyploContext *dyplo);
-    ~MandelbrotWorker();
+    MandelbrotWorkerDyplo(DyploContext *dyplo);
+    ~MandelbrotWorkerDyplo();
     int getNodeIndex() const;
     void commit_work();
 };
 
+/* Hands work to a software renderer, which then also delivers the results */
+class MandelbrotWorkerSoftware : public MandelbrotWorker
+{
+protected:
+    MandelbrotIncomingSoftware *renderer;
+public:
+    MandelbrotWorkerSoftware(MandelbrotIncomingSoftware *r): renderer(r) {}
+    int getNodeIndex() const { return -1; }
+    void commit_work();
+};
+
 MandelbrotPipeline::MandelbrotPipeline(QObject *parent) : QObject(parent),
     video_width(640),
     video_height(480),
@@ -66,7 +86,10 @@ MandelbrotPipeline::MandelbrotPipeline(QObject *parent) : QObject(parent),
     next_x(-0.86122562296399741),
     next_y(-0.23139131123653386),
     next_xy_valid(false),
-    next_z_reset(false)
+    next_z_reset(false),
+    fractal(FilterMandelbrot),
+    julia_x(-0.8),
+    julia_y(0.156)
 {
     setSize(video_width, video_height);
 }
@@ -88,6 +111,20 @@ bool MandelbrotPipeline::setSize(int width, int height)
     return true;
 }
 
+bool MandelbrotPipeline::setFractal(EFilters f)
+{
+    if (!outgoing.empty() || !incoming.empty())
+        return false; /* Cannot change formula while running */
+    fractal = f;
+    return true;
+}
+
+void MandelbrotPipeline::setJuliaParameter(double cx, double cy)
+{
+    julia_x = cx;
+    julia_y = cy;
+}
+
 int MandelbrotPipeline::activate(DyploContext *dyplo, int max_nodes)
 {
     unsigned int connectedNodes = 0;
@@ -101,26 +138,34 @@ int MandelbrotPipeline::activate(DyploContext *dyplo, int max_nodes)
 
     completed_work.clear();
 
-    /* Allocate the workers first */
-    try
+    /* Allocate the workers first. Only the mandelbrot exists in logic. */
+    if (fractal == FilterMandelbrot)
     {
-        for (int num_nodes = 0; num_nodes < max_nodes; ++num_nodes)
+        try
         {
-            MandelbrotWorker *next_outgoing = new MandelbrotWorker(dyplo);
-            outgoing.push_back(next_outgoing);
+            for (int num_nodes = 0; num_nodes < max_nodes; ++num_nodes)
+            {
+                MandelbrotWorker *next_outgoing = new MandelbrotWorkerDyplo(dyplo);
+                outgoing.push_back(next_outgoing);
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            // No action, this is normal...
+            qDebug() << "Worker allocation ended:" << ex.what();
         }
-    }
-    catch (const std::exception& ex)
-    {
-        // No action, this is normal...
-        qDebug() << "Worker allocation ended:" << ex.what();
     }
 
     if (outgoing.empty())
     {
-        /* Nothing allocated, cannot start */
-        deactivate_impl();
-        return -ENODEV;
+        /* No logic available, render in software */
+        if (activateSoftware() < 0)
+        {
+            /* Nothing allocated, cannot start */
+            deactivate_impl();
+            return -ENODEV;
+        }
+        connectedNodes = outgoing.size();
     }
 
     /* Ideally, create enough work do do just under one frame */
@@ -131,7 +176,7 @@ int MandelbrotPipeline::activate(DyploContext *dyplo, int max_nodes)
         video_lines_per_block = 2;
 
     /* No muxes needed with up to two workers */
-    if (outgoing.size() <= std::min(MAX_DMA_NODES, dyplo->num_dma_nodes))
+    if (!connectedNodes && outgoing.size() <= std::min(MAX_DMA_NODES, dyplo->num_dma_nodes))
     {
         try
         {
@@ -256,6 +301,17 @@ int MandelbrotPipeline::activate(DyploContext *dyplo, int max_nodes)
     return 0;
 }
 
+int MandelbrotPipeline::activateSoftware()
+{
+    FractalScanlineFunc func = getFractalScanlineFunc(fractal);
+    if (!func)
+        return -ENODEV;
+    MandelbrotIncomingSoftware *renderer = new MandelbrotIncomingSoftware(this, func);
+    incoming.push_back(renderer);
+    outgoing.push_back(new MandelbrotWorkerSoftware(renderer));
+    return 0;
+}
+
 void MandelbrotPipeline::setCoordinates(double _next_x, double _next_y)
 {
     next_x = _next_x;
@@ -294,7 +350,8 @@ void MandelbrotPipeline::deactivate()
 void MandelbrotPipeline::enumDyploResources(DyploNodeResourceList &list)
 {
     for (MandelbrotWorkerList::iterator it = outgoing.begin(); it != outgoing.end(); ++it)
-        list.push_back(DyploNodeResource((*it)->getNodeIndex(), BITSTREAM_MANDELBROT));
+        if ((*it)->getNodeIndex() >= 0)
+            list.push_back(DyploNodeResource((*it)->getNodeIndex(), BITSTREAM_MANDELBROT));
     for (HardwareConfigList::iterator it = mux.begin(); it != mux.end(); ++it)
         list.push_back(DyploNodeResource((*it)->getNodeIndex(), BITSTREAM_MUX_DESC));
 }
@@ -483,8 +540,144 @@ void MandelbrotIncomingCPU::dataAvailable(int)
     }
 }
 
+class MandelbrotIncomingSoftware::RenderThread : public QThread
+{
+public:
+    RenderThread(MandelbrotIncomingSoftware *r): renderer(r) {}
+protected:
+    MandelbrotIncomingSoftware *renderer;
+    void run() { renderer->renderLoop(); }
+};
+
+/* Renders a batch of lines into "header + scanline" blocks, a stripe is a
+ * range of lines */
+class MandelbrotIncomingSoftware::RenderJob : public StripeExecutor::Job
+{
+public:
+    FractalScanlineFunc render_scanline;
+    const MandelbrotRequest *work;
+    uchar *output;
+    unsigned int line_size;
+    double param_x;
+    double param_y;
+
+    void processStripe(unsigned int first, unsigned int last)
+    {
+        for (unsigned int i = first; i < last; ++i)
+        {
+            const MandelbrotRequest &request = work[i];
+            uchar *data = output + i * line_size;
+            ((unsigned int *)data)[0] = request.line | ((unsigned int)request.size << 16);
+            render_scanline(data + SCANLINE_HEADER_SIZE, request.size,
+                            from_fixed_point(request.ax), from_fixed_point(request.ay), from_fixed_point(request.incr),
+                            param_x, param_y);
+        }
+    }
+};
+
+MandelbrotIncomingSoftware::MandelbrotIncomingSoftware(MandelbrotPipeline *parent, FractalScanlineFunc func):
+    MandelbrotIncomingBase(parent),
+    render_scanline(func),
+    param_x(0),
+    param_y(0),
+    stopping(false),
+    event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    /* The results arrive on the GUI thread, like those from the logic */
+    fromLogicNotifier = new QSocketNotifier(event_fd, QSocketNotifier::Read, this);
+    connect(fromLogicNotifier, SIGNAL(activated(int)), this, SLOT(dataAvailable(int)));
+    fromLogicNotifier->setEnabled(true);
+    thread = new RenderThread(this);
+    thread->start();
+}
+
+MandelbrotIncomingSoftware::~MandelbrotIncomingSoftware()
+{
+    mutex.lock();
+    stopping = true;
+    workAvailable.wakeAll();
+    mutex.unlock();
+    thread->wait();
+    delete thread;
+    delete fromLogicNotifier;
+    fromLogicNotifier = NULL;
+    ::close(event_fd);
+}
+
+void MandelbrotIncomingSoftware::addWork(const std::vector<MandelbrotRequest> &work)
+{
+    QMutexLocker lock(&mutex);
+    pending.insert(pending.end(), work.begin(), work.end());
+    param_x = pipeline->getJuliaX();
+    param_y = pipeline->getJuliaY();
+    workAvailable.wakeAll();
+}
+
+void MandelbrotIncomingSoftware::renderLoop()
+{
+    std::vector<MandelbrotRequest> work;
+    std::vector<uchar> output;
+    RenderJob job;
+    job.render_scanline = render_scanline;
+
+    for (;;)
+    {
+        mutex.lock();
+        while (pending.empty() && !stopping)
+            workAvailable.wait(&mutex);
+        if (stopping)
+        {
+            mutex.unlock();
+            return;
+        }
+        work.clear();
+        work.swap(pending);
+        job.param_x = param_x;
+        job.param_y = param_y;
+        mutex.unlock();
+
+        /* Produce the same "header + scanline" format as the logic does */
+        job.line_size = SCANLINE_HEADER_SIZE + work[0].size;
+        output.resize(work.size() * job.line_size);
+        job.work = &work[0];
+        job.output = &output[0];
+        /* The time per line varies a lot, so hand them out one at a time */
+        executor.run(&job, work.size(), 1);
+
+        mutex.lock();
+        rendered.insert(rendered.end(), output.begin(), output.end());
+        mutex.unlock();
+        uint64_t one = 1;
+        if (::write(event_fd, &one, sizeof(one)) < 0)
+            qWarning() << "Failed to signal rendered lines";
+    }
+}
+
+void MandelbrotIncomingSoftware::dataAvailable(int)
+{
+    uint64_t count;
+    if (::read(event_fd, &count, sizeof(count)) < 0)
+        return;
+    mutex.lock();
+    buffer.swap(rendered);
+    mutex.unlock();
+    if (buffer.empty())
+        return;
+    /* This hands out new work, which takes the mutex again */
+    pipeline->dataAvailable(&buffer[0], buffer.size());
+    buffer.clear();
+}
+
+void MandelbrotWorkerSoftware::commit_work()
+{
+    if (!work_to_do.empty())
+    {
+        renderer->addWork(work_to_do);
+        work_to_do.clear();
+    }
+}
 
-MandelbrotWorker::MandelbrotWorker(DyploContext *dyplo):
+MandelbrotWorkerDyplo::MandelbrotWorkerDyplo(DyploContext *dyplo):
     node(dyplo->createConfig(BITSTREAM_MANDELBROT))
 {
     try
@@ -502,7 +695,7 @@ MandelbrotWorker::MandelbrotWorker(DyploContext *dyplo):
     to_logic->addRouteTo(node->getNodeIndex());
 }
 
-MandelbrotWorker::~MandelbrotWorker()
+MandelbrotWorkerDyplo::~MandelbrotWorkerDyplo()
 {
     if (to_logic) {
         delete to_logic;
@@ -515,12 +708,12 @@ MandelbrotWorker::~MandelbrotWorker()
     }
 }
 
-int MandelbrotWorker::getNodeIndex() const
+int MandelbrotWorkerDyplo::getNodeIndex() const
 {
     return node->getNodeIndex();
 }
 
-void MandelbrotWorker::commit_work()
+void MandelbrotWorkerDyplo::commit_work()
 {
     unsigned int bytes_to_write = work_to_do.size() * sizeof(MandelbrotRequest);
     if (bytes_to_write)
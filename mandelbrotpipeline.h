@@ -4,10 +4,14 @@
 #include <QObject>
 #include <QImage>
 #include "dyploresources.h"
+#include "fractalkernels.h"
+#include "stripeexecutor.h"
+#include "types.h"
 #include <vector>
 
 /* Forward declarations */
 class QSocketNotifier;
+class QTimer;
 class DyploContext;
 class MandelbrotPipeline;
 
@@ -24,7 +28,15 @@ struct MandelbrotImage {
     void initialize(int width, int height);
 };
 
-struct MandelbrotRequest;
+/* Work item as sent to the hardware */
+struct MandelbrotRequest
+{
+    unsigned short line;
+    unsigned short size;
+    long long ax;
+    long long ay;
+    long long incr;
+} __attribute__((packed));
 
 class MandelbrotWorker;
 typedef std::vector<MandelbrotWorker *> MandelbrotWorkerList;
@@ -69,6 +81,41 @@ private slots:
     void dataAvailable(int socket);
 };
 
+/* Renders the requested lines in software. Acts as both worker and
+ * incoming data source, see MandelbrotWorkerSoftware. A render thread
+ * takes the pending lines and spreads them over the cores, the results
+ * go back to the GUI thread like the data from a FIFO does, through a
+ * handle that becomes readable. */
+class MandelbrotIncomingSoftware : public MandelbrotIncomingBase
+{
+    Q_OBJECT
+protected:
+    class RenderThread;
+    class RenderJob;
+
+    FractalScanlineFunc render_scanline;
+    StripeExecutor executor;
+    RenderThread *thread;
+    QMutex mutex;
+    QWaitCondition workAvailable;
+    /* Guarded by the mutex */
+    std::vector<MandelbrotRequest> pending;
+    std::vector<uchar> rendered;
+    double param_x;
+    double param_y;
+    bool stopping;
+    int event_fd;
+    std::vector<uchar> buffer; /* Only used on the GUI thread */
+
+    void renderLoop();
+public:
+    MandelbrotIncomingSoftware(MandelbrotPipeline *parent, FractalScanlineFunc func);
+    ~MandelbrotIncomingSoftware();
+    void addWork(const std::vector<MandelbrotRequest> &work);
+private slots:
+    void dataAvailable(int socket);
+};
+
 typedef std::vector<MandelbrotIncomingBase *> MandelbrotIncomingList;
 
 typedef std::vector<dyplo::HardwareConfig *> HardwareConfigList;
@@ -83,6 +130,11 @@ public:
     virtual ~MandelbrotPipeline();
 
     bool setSize(int width, int height);
+    /* Select the formula. Only FilterMandelbrot has a bitstream, the
+     * other fractals are always rendered in software. */
+    bool setFractal(EFilters fractal);
+    /* The constant c of the Julia set, used from the next scanline on */
+    void setJuliaParameter(double cx, double cy);
     int activate(DyploContext* dyplo, int max_nodes);
 
     /* Go to this location on the next frame. */
@@ -97,6 +149,9 @@ public:
     double getX() const { return x; }
     double getY() const { return y; }
     double getZ() const { return z; }
+    double getJuliaX() const { return julia_x; }
+    double getJuliaY() const { return julia_y; }
+    EFilters getFractal() const { return fractal; }
 
     std::vector< std::pair<int, int> > completed_work;
 
@@ -127,8 +182,12 @@ protected:
     int current_image;
     bool next_xy_valid;
     bool next_z_reset;
+    EFilters fractal;
+    double julia_x;
+    double julia_y;
 
     void deactivate_impl();
+    int activateSoftware();
     void zoomFrame();
     void requestNext(unsigned short worker_index);
 };
@@ -0,0 +1,137 @@
+#include "mjpegdecoder.h"
+
+#include <QRunnable>
+#include <QByteArray>
+
+/* Many cameras leave out the Huffman tables and expect the decoder to use
+ * the standard ones from the JPEG specification (K.3). libjpeg refuses
+ * such images, so insert a DHT segment with those tables. */
+static const unsigned char standard_dht[] = {
+    0xFF, 0xC4, 0x01, 0xA2,
+    /* DC luminance */
+    0x00,
+    0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    /* DC chrominance */
+    0x01,
+    0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    /* AC luminance */
+    0x10,
+    0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+    /* AC chrominance */
+    0x11,
+    0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+};
+
+/* Walk the segments up to the start of scan, insert the standard tables
+ * there if the image did not define any */
+static void insertHuffmanTables(QByteArray &jpeg)
+{
+    const unsigned char *p = (const unsigned char *)jpeg.constData();
+    int size = jpeg.size();
+    int pos = 2; /* Skip SOI */
+
+    while (pos + 4 <= size)
+    {
+        if (p[pos] != 0xFF)
+            return; /* Corrupt, let the decoder complain */
+        unsigned char marker = p[pos + 1];
+        if (marker == 0xC4)
+            return; /* Has its own tables */
+        if (marker == 0xDA)
+        {
+            jpeg.insert(pos, (const char *)standard_dht, sizeof(standard_dht));
+            return;
+        }
+        pos += 2 + ((p[pos + 2] << 8) | p[pos + 3]);
+    }
+}
+
+class MjpegDecodeTask : public QRunnable
+{
+public:
+    MjpegDecodeTask(MjpegDecoder *d, const QByteArray &j, const QRect &c, qint64 t):
+        decoder(d), jpeg(j), crop(c), timestamp(t)
+    {}
+
+    void run()
+    {
+        QImage image;
+        insertHuffmanTables(jpeg);
+        if (image.loadFromData((const uchar *)jpeg.constData(), jpeg.size(), "JPEG"))
+        {
+            if (crop != image.rect())
+                image = image.copy(crop & image.rect());
+        }
+        QMetaObject::invokeMethod(decoder, "frameDecoded", Qt::QueuedConnection,
+                                  Q_ARG(QImage, image), Q_ARG(qint64, timestamp));
+        decoder->busy.deref();
+    }
+
+protected:
+    MjpegDecoder *decoder;
+    QByteArray jpeg;
+    QRect crop;
+    qint64 timestamp;
+};
+
+MjpegDecoder::MjpegDecoder(QObject *parent):
+    QObject(parent),
+    busy(0),
+    last_timestamp(0),
+    dropped_frames(0)
+{
+}
+
+MjpegDecoder::~MjpegDecoder()
+{
+    /* Results still in the event queue are dropped with this object */
+    pool.waitForDone();
+}
+
+bool MjpegDecoder::decode(const void *data, unsigned int size, const QRect &crop, qint64 timestamp)
+{
+    /* One frame per thread, more would only add latency */
+    if (busy.fetchAndAddOrdered(1) >= pool.maxThreadCount())
+    {
+        busy.deref();
+        ++dropped_frames;
+        return false;
+    }
+    pool.start(new MjpegDecodeTask(this, QByteArray((const char *)data, size), crop, timestamp));
+    return true;
+}
+
+void MjpegDecoder::frameDecoded(const QImage &image, qint64 timestamp)
+{
+    if (image.isNull() || timestamp < last_timestamp)
+    {
+        ++dropped_frames;
+        return;
+    }
+    last_timestamp = timestamp;
+    emit decoded(image, timestamp);
+}
@@ -0,0 +1,40 @@
+#ifndef MJPEGDECODER_H
+#define MJPEGDECODER_H
+
+#include <QObject>
+#include <QImage>
+#include <QRect>
+#include <QAtomicInt>
+#include <QThreadPool>
+
+/* Decodes MJPEG camera frames on a pool of threads, each thread works on
+ * its own frame. Frames are delivered in capture order, a frame that
+ * completes after a newer one was delivered is discarded. */
+class MjpegDecoder : public QObject
+{
+    Q_OBJECT
+public:
+    MjpegDecoder(QObject *parent = 0);
+    ~MjpegDecoder();
+
+    /* Takes a copy of the compressed data, so the capture buffer can be
+     * given back right away. Returns false when all threads are busy. */
+    bool decode(const void *data, unsigned int size, const QRect &crop, qint64 timestamp);
+    unsigned int dropped() const { return dropped_frames; }
+    int threadCount() const { return pool.maxThreadCount(); }
+
+signals:
+    void decoded(const QImage &image, qint64 timestamp);
+
+protected slots:
+    void frameDecoded(const QImage &image, qint64 timestamp);
+
+protected:
+    friend class MjpegDecodeTask;
+    QThreadPool pool;
+    QAtomicInt busy;
+    qint64 last_timestamp;
+    unsigned int dropped_frames;
+};
+
+#endif // MJPEGDECODER_H
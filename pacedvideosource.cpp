@@ -0,0 +1,230 @@
+#include "pacedvideosource.h"
+#include "latencyhistogram.h"
+
+#include <QMutexLocker>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/videodev2.h>
+
+PacedVideoSource::PacedVideoSource(unsigned int w, unsigned int h, unsigned int f, int r):
+    width(w),
+    height(h),
+    format(f),
+    fps(r),
+    rate(0),
+    fd(-1),
+    userptr(false)
+{
+    memset(&settings, 0, sizeof(settings));
+}
+
+PacedVideoSource::~PacedVideoSource()
+{
+    close();
+}
+
+int PacedVideoSource::negotiate(int w, int h, int f, const unsigned int *formats, unsigned int count, VideoCaptureFormat *result)
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (formats[i] == format)
+        {
+            result->format = format;
+            result->width = width ? width : w;
+            result->height = height ? height : h;
+            result->fps = fps > 0 ? fps : f;
+            result->scalable = !width || !height;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int PacedVideoSource::setup(int w, int h, int f, unsigned int /* pixelformat */, VideoCaptureSettings *result)
+{
+    /* Whole pixel pairs, and whole chroma lines for NV12 */
+    settings.width = (width ? width : w) & ~1;
+    settings.height = height ? height : h;
+    settings.format = format;
+    if (format == V4L2_PIX_FMT_NV12)
+    {
+        settings.height &= ~1;
+        settings.stride = settings.width;
+        settings.size = settings.stride * settings.height * 3 / 2;
+    }
+    else
+    {
+        settings.stride = settings.width * 2;
+        settings.size = settings.stride * settings.height;
+    }
+    if (!settings.width || !settings.height)
+        return -EINVAL;
+
+    rate = fps < 0 ? f : fps;
+    if (fd >= 0)
+        ::close(fd);
+    if (rate)
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    else
+        fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    int r = prepare();
+    if (r < 0)
+        return r;
+
+    *result = settings;
+    return 0;
+}
+
+int PacedVideoSource::crop(int, int, VideoCaptureSettings *)
+{
+    /* Cropping what we generate ourselves saves nothing */
+    return -ENOTTY;
+}
+
+void PacedVideoSource::free_buffer_memory()
+{
+    if (!userptr)
+    {
+        for (unsigned int i = 0; i < buffers.size(); ++i)
+            free(buffers[i].start);
+    }
+    buffers.clear();
+    free_buffers.clear();
+    userptr = false;
+}
+
+int PacedVideoSource::init_mmap()
+{
+    free_buffer_memory();
+    for (unsigned int i = 0; i < requested_buffers; ++i)
+    {
+        Buffer buffer;
+        if (posix_memalign(&buffer.start, 64, settings.size) != 0)
+            return -ENOMEM;
+        buffer.data = buffer.start;
+        buffers.push_back(buffer);
+    }
+    return 0;
+}
+
+int PacedVideoSource::init_userptr(void * const *pointers, unsigned int count, unsigned int length)
+{
+    if (length < settings.size)
+        return -EINVAL;
+    free_buffer_memory();
+    userptr = true;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        Buffer buffer;
+        buffer.start = pointers[i];
+        buffer.data = buffer.start;
+        buffers.push_back(buffer);
+    }
+    return 0;
+}
+
+int PacedVideoSource::start()
+{
+    free_buffers.clear();
+    for (unsigned int i = 0; i < buffers.size(); ++i)
+        free_buffers.push_back(i);
+
+    if (rate)
+    {
+        /* A periodic timer does not drift, unlike sleeping between frames */
+        struct itimerspec period;
+        long long interval = 1000000000LL / rate;
+        period.it_interval.tv_sec = interval / 1000000000LL;
+        period.it_interval.tv_nsec = interval % 1000000000LL;
+        period.it_value = period.it_interval;
+        if (timerfd_settime(fd, 0, &period, NULL) < 0)
+            return -errno;
+    }
+    else
+    {
+        uint64_t count = buffers.size();
+        if (::write(fd, &count, sizeof(count)) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+int PacedVideoSource::dequeue_buffer(unsigned int *index, unsigned int *bytesused, long long *timestamp)
+{
+    uint64_t ticks;
+    if (::read(fd, &ticks, sizeof(ticks)) < 0)
+        return errno == EAGAIN ? 0 : -errno;
+
+    unsigned int i;
+    {
+        QMutexLocker lock(&free_lock);
+        if (free_buffers.empty())
+            return 0; /* Skip this frame */
+        /* Most recently returned first, it's the most likely to be in cache */
+        i = free_buffers.back();
+        free_buffers.pop_back();
+    }
+
+    buffers[i].data = produce(buffers[i].start, userptr);
+    *index = i;
+    *bytesused = settings.size;
+    *timestamp = monotonicMicroseconds();
+    return 1;
+}
+
+int PacedVideoSource::queue_buffer(unsigned int index)
+{
+    if (index >= buffers.size())
+        return -EINVAL;
+    {
+        QMutexLocker lock(&free_lock);
+        free_buffers.push_back(index);
+    }
+    if (!rate)
+    {
+        uint64_t one = 1;
+        if (::write(fd, &one, sizeof(one)) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+int PacedVideoSource::stop()
+{
+    if (fd < 0)
+        return 0;
+    if (rate)
+    {
+        struct itimerspec off;
+        memset(&off, 0, sizeof(off));
+        if (timerfd_settime(fd, 0, &off, NULL) < 0)
+            return -errno;
+    }
+    else
+    {
+        /* Forget about the free buffers, start() counts them again */
+        uint64_t count;
+        while (::read(fd, &count, sizeof(count)) > 0)
+            ;
+    }
+    return 0;
+}
+
+void PacedVideoSource::close()
+{
+    stop();
+    free_buffer_memory();
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef PACEDVIDEOSOURCE_H
+#define PACEDVIDEOSOURCE_H
+
+#include <QMutex>
+#include <vector>
+#include "videosource.h"
+
+/* Base for sources that make up their own frames. A timerfd paces the
+ * frames like a camera would. Without a frame rate, an eventfd counts the
+ * free buffers, so a frame is produced as soon as the pipeline gives a
+ * buffer back. When no buffer is free at a timer tick, the frame is
+ * skipped, just like a driver does. */
+class PacedVideoSource: public VideoSource
+{
+public:
+    /* A zero width or height follows what setup() asks for, a negative
+     * fps follows the setup() frame rate and zero runs unpaced */
+    PacedVideoSource(unsigned int width, unsigned int height, unsigned int format, int fps);
+    ~PacedVideoSource();
+
+    int negotiate(int width, int height, int fps, const unsigned int *formats, unsigned int count, /* out */ VideoCaptureFormat *result);
+    int setup(int width, int height, int fps, unsigned int pixelformat, /* out */ VideoCaptureSettings *settings);
+    int crop(int width, int height, /* in/out */ VideoCaptureSettings *settings);
+    int init_mmap();
+    int init_userptr(void * const *pointers, unsigned int count, unsigned int length);
+    int start();
+    int dequeue_buffer(unsigned int *index, unsigned int *bytesused, long long *timestamp);
+    int queue_buffer(unsigned int index);
+    const void *buffer_data(unsigned int index) const { return buffers[index].data; }
+    unsigned int buffer_count() const { return buffers.size(); }
+    int stop();
+    void close();
+    int device_handle() const { return fd; }
+
+protected:
+    /* Called after setup() with the final size and format */
+    virtual int prepare() { return 0; }
+    /* Create the next frame. "buffer" holds settings.size bytes. Returns
+     * where the frame is, which may be other memory that stays valid,
+     * unless "in_place" requires the frame to be in "buffer". */
+    virtual const void *produce(void *buffer, bool in_place) = 0;
+
+    struct Buffer {
+        void *start;
+        const void *data;
+    };
+
+    unsigned int width;
+    unsigned int height;
+    unsigned int format;
+    int fps;
+    int rate; /* Frame rate in use, 0 when unpaced */
+    VideoCaptureSettings settings;
+    int fd; /* timerfd, or eventfd when unpaced */
+    bool userptr;
+    std::vector<Buffer> buffers;
+    std::vector<unsigned int> free_buffers;
+    QMutex free_lock;
+
+    void free_buffer_memory();
+};
+
+#endif // PACEDVIDEOSOURCE_H
@@ -13,6 +13,8 @@ TEMPLATE = app
 
 CONFIG += link_pkgconfig
 PKGCONFIG += dyplo
+# shm_open, in librt before glibc 2.17
+LIBS += -lrt
 
 SOURCES +=  main.cpp\
             mainwindow.cpp \
@@ -28,7 +30,26 @@ SOURCES +=  main.cpp\
     colormap.cpp \
     cpu/cpuinfo.cpp \
     sysfile.cpp \
-    dyplonodeinfo.cpp
+    dyplonodeinfo.cpp \
+    fractalkernels.cpp \
+    videokernels.cpp \
+    stripeexecutor.cpp \
+    capturethread.cpp \
+    latencyhistogram.cpp \
+    mjpegdecoder.cpp \
+    videoscaler.cpp \
+    videosource.cpp \
+    pacedvideosource.cpp \
+    videofilesource.cpp \
+    videopatternsource.cpp \
+    videorecorder.cpp \
+    videoresourcepool.cpp \
+    dmafifostats.cpp \
+    framelender.cpp \
+    videopointfilter.cpp \
+    videotee.cpp \
+    videocpustage.cpp \
+    frameringpublisher.cpp
 
 HEADERS  += mainwindow.h \
             mousemonitor.h \
@@ -45,7 +66,27 @@ HEADERS  += mainwindow.h \
     colormap.h \
     cpu/cpuinfo.h \
     sysfile.hpp \
-    dyplonodeinfo.h
+    dyplonodeinfo.h \
+    fractalkernels.h \
+    videokernels.h \
+    stripeexecutor.h \
+    capturethread.h \
+    latencyhistogram.h \
+    mjpegdecoder.h \
+    videoscaler.h \
+    videosource.h \
+    pacedvideosource.h \
+    videofilesource.h \
+    videopatternsource.h \
+    videorecorder.h \
+    videoresourcepool.h \
+    dmafifostats.h \
+    framelender.h \
+    videopointfilter.h \
+    videotee.h \
+    videocpustage.h \
+    framering.h \
+    frameringpublisher.h
 
 FORMS    += mainwindow.ui \
     videoframe.ui \
@@ -0,0 +1,141 @@
+#include "stripeexecutor.h"
+
+#include <QDebug>
+#include <QThread>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+/* Aim for stripes that fit in L2 together with their output, and leave
+ * enough stripes to balance the load across the threads */
+#define STRIPE_TARGET_BYTES (64 * 1024)
+#define STRIPES_PER_THREAD 4
+
+class StripeExecutor::Worker : public QThread
+{
+public:
+    Worker(StripeExecutor *e, int c): executor(e), cpu(c) {}
+protected:
+    StripeExecutor *executor;
+    int cpu;
+    void run() { executor->workerLoop(cpu); }
+};
+
+StripeExecutor::StripeExecutor():
+    job(NULL),
+    rows(0),
+    rows_per_stripe(1),
+    stripes(0),
+    busy_workers(0),
+    generation(0),
+    stopping(false)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 1; cpu < cores; ++cpu)
+    {
+        Worker *worker = new Worker(this, cpu);
+        workers.push_back(worker);
+        worker->start();
+    }
+}
+
+StripeExecutor::~StripeExecutor()
+{
+    mutex.lock();
+    stopping = true;
+    workAvailable.wakeAll();
+    mutex.unlock();
+    for (std::vector<Worker *>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        (*it)->wait();
+        delete *it;
+    }
+}
+
+unsigned int StripeExecutor::rowsPerStripe(unsigned int rows, unsigned int bytes_per_row) const
+{
+    unsigned int result = bytes_per_row ? STRIPE_TARGET_BYTES / bytes_per_row : rows;
+    unsigned int balanced = rows / (threadCount() * STRIPES_PER_THREAD);
+    if (result > balanced)
+        result = balanced;
+    if (result < 1)
+        result = 1;
+    return result;
+}
+
+void StripeExecutor::run(Job *j, unsigned int r, unsigned int r_per_stripe)
+{
+    if (!r)
+        return;
+    if (!r_per_stripe)
+        r_per_stripe = r;
+
+    if (workers.empty())
+    {
+        j->processStripe(0, r);
+        return;
+    }
+
+    mutex.lock();
+    job = j;
+    rows = r;
+    rows_per_stripe = r_per_stripe;
+    stripes = (r + r_per_stripe - 1) / r_per_stripe;
+    next_stripe = 0;
+    busy_workers = workers.size();
+    ++generation;
+    workAvailable.wakeAll();
+    mutex.unlock();
+
+    processStripes();
+
+    /* Barrier: wait for the workers to finish their last stripe */
+    mutex.lock();
+    while (busy_workers)
+        workDone.wait(&mutex);
+    job = NULL;
+    mutex.unlock();
+}
+
+void StripeExecutor::processStripes()
+{
+    for (;;)
+    {
+        unsigned int stripe = next_stripe.fetchAndAddOrdered(1);
+        if (stripe >= stripes)
+            break;
+        unsigned int first = stripe * rows_per_stripe;
+        unsigned int last = first + rows_per_stripe;
+        if (last > rows)
+            last = rows;
+        job->processStripe(first, last);
+    }
+}
+
+void StripeExecutor::workerLoop(int cpu)
+{
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        qWarning() << "Failed to pin stripe worker to CPU" << cpu;
+
+    unsigned int seen_generation = 0;
+    mutex.lock();
+    for (;;)
+    {
+        while (!stopping && generation == seen_generation)
+            workAvailable.wait(&mutex);
+        if (stopping)
+            break;
+        seen_generation = generation;
+        mutex.unlock();
+
+        processStripes();
+
+        mutex.lock();
+        if (--busy_workers == 0)
+            workDone.wakeAll();
+    }
+    mutex.unlock();
+}
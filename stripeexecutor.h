@@ -0,0 +1,61 @@
+#ifndef STRIPEEXECUTOR_H
+#define STRIPEEXECUTOR_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+#include <vector>
+
+/* Persistent pool of worker threads that process an image in horizontal
+ * stripes. Each worker is pinned to its own CPU core, core 0 is left for
+ * the GUI thread. The calling thread also processes stripes, so on a
+ * single core system this just runs the job in place. */
+class StripeExecutor
+{
+public:
+    class Job
+    {
+    public:
+        virtual ~Job() {}
+        /* Process rows first..last-1. Called from multiple threads. */
+        virtual void processStripe(unsigned int first, unsigned int last) = 0;
+    };
+
+    StripeExecutor();
+    ~StripeExecutor();
+
+    /* Run "job" on all rows, returns when all stripes are done */
+    void run(Job *job, unsigned int rows, unsigned int rows_per_stripe);
+
+    /* Number of threads that process stripes, including the caller */
+    unsigned int threadCount() const { return workers.size() + 1; }
+
+    /* Stripe height that keeps the working set of a stripe in cache */
+    unsigned int rowsPerStripe(unsigned int rows, unsigned int bytes_per_row) const;
+
+protected:
+    class Worker;
+    friend class Worker;
+
+    std::vector<Worker *> workers;
+    QMutex mutex;
+    QWaitCondition workAvailable;
+    QWaitCondition workDone;
+    Job *job;
+    unsigned int rows;
+    unsigned int rows_per_stripe;
+    unsigned int stripes;
+    QAtomicInt next_stripe;
+    unsigned int busy_workers;
+    unsigned int generation;
+    bool stopping;
+
+    void workerLoop(int cpu);
+    void processStripes();
+
+private:
+    StripeExecutor(StripeExecutor const&);  // Don't Implement
+    void operator=(StripeExecutor const&);  // Don't implement
+};
+
+#endif // STRIPEEXECUTOR_H
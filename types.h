@@ -19,7 +19,11 @@ enum EFilters {
     FilterAudioLowpass,
     FilterAudioHighpass,
     FilterAudioFFT,
-    FilterMandelbrot
+    FilterMandelbrot,
+    FilterJulia,
+    FilterBurningShip,
+    FilterMultibrot3,
+    FilterMultibrot4
 };
 
 enum EDemo
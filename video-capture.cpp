@@ -15,6 +15,7 @@
 #include <linux/videodev2.h>
 
 #include <qdebug.h>
+#include "latencyhistogram.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
@@ -34,7 +35,9 @@ VideoCapture::VideoCapture():
       buffers(NULL),
       n_buffers(0),
       current_buf(new struct v4l2_buffer),
-      current_planes(new struct v4l2_plane)
+      current_planes(new struct v4l2_plane),
+      memory(V4L2_MEMORY_MMAP),
+      framerate(0)
 {
 }
 
@@ -95,15 +98,142 @@ static int set_framerate(int fd, enum v4l2_buf_type type, int fps)
     return xioctl(fd, VIDIOC_S_PARM, &parm);
 }
 
-int VideoCapture::setup(int width, int height, int fps, VideoCaptureSettings *settings)
+/* Highest frame rate for a format and size, "fps" if the driver cannot tell */
+static unsigned int max_framerate(int fd, unsigned int pixelformat, unsigned int width, unsigned int height, unsigned int fps)
 {
+    struct v4l2_frmivalenum frmival;
+    unsigned int best = 0;
+
+    CLEAR(frmival);
+    frmival.pixel_format = pixelformat;
+    frmival.width = width;
+    frmival.height = height;
+    while (xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0)
+    {
+        /* For stepwise, the minimum interval is the highest rate */
+        const struct v4l2_fract &interval = (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) ?
+                    frmival.discrete : frmival.stepwise.min;
+        if (interval.numerator) {
+            unsigned int rate = interval.denominator / interval.numerator;
+            if (rate > best)
+                best = rate;
+        }
+        if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            break;
+        frmival.index++;
+    }
+    return best ? best : fps;
+}
+
+std::vector<VideoCaptureFormat> VideoCapture::enum_formats(unsigned int fps)
+{
+    std::vector<VideoCaptureFormat> result;
+    struct v4l2_fmtdesc fmtdesc;
+
+    CLEAR(fmtdesc);
+    fmtdesc.type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (xioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+    {
+        struct v4l2_frmsizeenum frmsize;
+        CLEAR(frmsize);
+        frmsize.pixel_format = fmtdesc.pixelformat;
+        while (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0)
+        {
+            VideoCaptureFormat f;
+            f.format = fmtdesc.pixelformat;
+            if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                f.width = frmsize.discrete.width;
+                f.height = frmsize.discrete.height;
+                f.fps = max_framerate(fd, f.format, f.width, f.height, fps);
+                f.scalable = false;
+                result.push_back(f);
+                frmsize.index++;
+            } else {
+                /* Any size in the range, report the largest. S_FMT will
+                 * adjust it to what we ask for. */
+                f.width = frmsize.stepwise.max_width;
+                f.height = frmsize.stepwise.max_height;
+                f.fps = max_framerate(fd, f.format, f.width, f.height, fps);
+                f.scalable = true;
+                result.push_back(f);
+                break;
+            }
+        }
+        fmtdesc.index++;
+    }
+    return result;
+}
+
+/* Preference: reach the frame rate we need, then the cheapest format, then
+ * the smallest frame that covers the requested size. */
+int VideoCapture::negotiate(int width, int height, int fps, const unsigned int *formats, unsigned int count, VideoCaptureFormat *result)
+{
+    std::vector<VideoCaptureFormat> available = enum_formats(fps);
+    int best_cost = -1;
+    unsigned int best_fps = 0;
+    bool best_covers = false;
+    unsigned int best_area = 0;
+
+    for (std::vector<VideoCaptureFormat>::const_iterator it = available.begin(); it != available.end(); ++it)
+    {
+        int cost;
+        for (cost = 0; cost < (int)count; ++cost)
+            if (formats[cost] == it->format)
+                break;
+        if (cost == (int)count)
+            continue;
+        /* More frames than we display don't help */
+        unsigned int rate = it->fps < (unsigned int)fps ? it->fps : fps;
+        bool covers = ((int)it->width >= width) && ((int)it->height >= height);
+        unsigned int area = it->width * it->height;
+
+        bool better;
+        if (best_cost < 0)
+            better = true;
+        else if (rate != best_fps)
+            better = rate > best_fps;
+        else if (covers != best_covers)
+            better = covers;
+        else if (cost != best_cost)
+            better = cost < best_cost;
+        else
+            better = covers ? (area < best_area) : (area > best_area);
+        if (better) {
+            *result = *it;
+            best_cost = cost;
+            best_fps = rate;
+            best_covers = covers;
+            best_area = area;
+        }
+    }
+    if (best_cost < 0)
+        return -1;
+    /* Ask for the exact size when the device can scale */
+    if (best_covers && result->scalable) {
+        result->width = width;
+        result->height = height;
+    }
+    return 0;
+}
+
+/* Capture the full sensor view again */
+static void reset_crop(int fd, enum v4l2_buf_type type)
+{
+    struct v4l2_selection sel;
+
+    /* The selection API wants the single plane type for multiplanar devices too */
+    CLEAR(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+    if (0 == xioctl(fd, VIDIOC_G_SELECTION, &sel)) {
+            sel.target = V4L2_SEL_TGT_CROP;
+            if (0 == xioctl(fd, VIDIOC_S_SELECTION, &sel))
+                    return;
+    }
+
+    /* Older drivers only know the crop API */
     struct v4l2_cropcap cropcap;
     struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    enum v4l2_buf_type type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    unsigned int min;
-
-    /* Select video input, video standard and tune here. */
 
     CLEAR(cropcap);
 
@@ -126,19 +256,123 @@ int VideoCapture::setup(int width, int height, int fps, VideoCaptureSettings *se
     } else {
             /* Errors ignored. */
     }
+}
+
+int VideoCapture::setup(int width, int height, int fps, unsigned int pixelformat, VideoCaptureSettings *settings)
+{
+    enum v4l2_buf_type type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int r;
+
+    /* Select video input, video standard and tune here. */
+
+    reset_crop(fd, type);
+
+    r = set_format(width, height, pixelformat, settings);
+    if (r < 0)
+        return r;
+
+    framerate = fps;
+    if (set_framerate(fd, type, fps) < 0) {
+        qWarning() << "Failed to set" << fps << "FPS mode. Camera supports these:";
+        /* Obtain possible settings for framerate... */
+        struct v4l2_frmivalenum frmival;
+        memset(&frmival, 0, sizeof(frmival));
+        frmival.type = type;
+        frmival.pixel_format = settings->format;
+        frmival.width = settings->width;
+        frmival.height = settings->height;
+        while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0)
+        {
+            if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+                qDebug() << "Discrete:"
+                         << frmival.discrete.denominator << "/" << frmival.discrete.numerator;
+            else
+                qDebug() << "Stepwise:"
+                            << frmival.stepwise.min.denominator << "/" << frmival.stepwise.min.numerator << ".."
+                            << frmival.stepwise.max.denominator << "/" << frmival.stepwise.max.numerator;
+            frmival.index++;
+        }
+    }
+
+    return 0;
+}
+
+int VideoCapture::crop(int width, int height, VideoCaptureSettings *settings)
+{
+    struct v4l2_selection sel;
+    struct v4l2_rect full;
+    VideoCaptureSettings cropped;
+    enum v4l2_buf_type type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int r;
+
+    if (width > (int)settings->width || height > (int)settings->height)
+        return -EINVAL;
+
+    CLEAR(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+    if (-1 == xioctl(fd, VIDIOC_G_SELECTION, &sel))
+        return -errno;
+    full = sel.r;
+
+    /* Keep the sensor pixels per output pixel of the full frame, so the
+     * result looks the same as cropping in software */
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.flags = V4L2_SEL_FLAG_GE; /* Rather too large than too small */
+    sel.r.width = (unsigned long long)full.width * width / settings->width;
+    sel.r.height = (unsigned long long)full.height * height / settings->height;
+    sel.r.left = full.left + (((full.width - sel.r.width) / 2) & ~1);
+    sel.r.top = full.top + (((full.height - sel.r.height) / 2) & ~1);
+    if (-1 == xioctl(fd, VIDIOC_S_SELECTION, &sel))
+        return -errno;
+
+    r = set_format(width, height, settings->format, &cropped);
+    if (r == 0 && (cropped.format != settings->format ||
+                   (int)cropped.width < width || (int)cropped.height < height))
+        r = -ERANGE;
+    if (r < 0) {
+        /* Back to the full frame */
+        reset_crop(fd, type);
+        set_format(settings->width, settings->height, settings->format, settings);
+        set_framerate(fd, type, framerate);
+        return r;
+    }
+
+    /* Let a bridge that can scale fill the whole buffer, for others the
+     * compose rectangle already follows the format. Errors ignored. */
+    sel.target = V4L2_SEL_TGT_COMPOSE;
+    sel.flags = 0;
+    sel.r.left = 0;
+    sel.r.top = 0;
+    sel.r.width = cropped.width;
+    sel.r.height = cropped.height;
+    xioctl(fd, VIDIOC_S_SELECTION, &sel);
+
+    /* Changing the format may have reset the frame rate */
+    set_framerate(fd, type, framerate);
+
+    *settings = cropped;
+    return 0;
+}
+
+int VideoCapture::set_format(int width, int height, unsigned int pixelformat, VideoCaptureSettings *settings)
+{
+    struct v4l2_format fmt;
+    enum v4l2_buf_type type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int min;
 
     CLEAR(fmt);
     fmt.type = type;
     if (multiplanar) {
             fmt.fmt.pix_mp.width       = width;
             fmt.fmt.pix_mp.height      = height;
-            fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUYV;
+            fmt.fmt.pix_mp.pixelformat = pixelformat;
             fmt.fmt.pix_mp.field       = V4L2_FIELD_INTERLACED;
             fmt.fmt.pix_mp.num_planes  = 1;
     } else {
             fmt.fmt.pix.width       = width;
             fmt.fmt.pix.height      = height;
-            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+            fmt.fmt.pix.pixelformat = pixelformat;
             fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
     }
     if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
@@ -161,13 +395,17 @@ int VideoCapture::setup(int width, int height, int fps, VideoCaptureSettings *se
         settings->size   = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
         settings->format = fmt.fmt.pix_mp.pixelformat;
     } else {
-        /* Buggy driver paranoia. */
-        min = fmt.fmt.pix.width * 2;
-        if (fmt.fmt.pix.bytesperline < min)
-                fmt.fmt.pix.bytesperline = min;
-        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-        if (fmt.fmt.pix.sizeimage < min)
-                fmt.fmt.pix.sizeimage = min;
+        /* Buggy driver paranoia. Compressed formats have no lines. */
+        if (pixelformat != V4L2_PIX_FMT_MJPEG) {
+            min = (pixelformat == V4L2_PIX_FMT_NV12) ? fmt.fmt.pix.width : fmt.fmt.pix.width * 2;
+            if (fmt.fmt.pix.bytesperline < min)
+                    fmt.fmt.pix.bytesperline = min;
+            min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+            if (pixelformat == V4L2_PIX_FMT_NV12)
+                    min += min >> 1;
+            if (fmt.fmt.pix.sizeimage < min)
+                    fmt.fmt.pix.sizeimage = min;
+        }
 
         settings->width  = fmt.fmt.pix.width;
         settings->height = fmt.fmt.pix.height;
@@ -176,29 +414,7 @@ int VideoCapture::setup(int width, int height, int fps, VideoCaptureSettings *se
         settings->format = fmt.fmt.pix.pixelformat;
     }
 
-    if (set_framerate(fd, type, fps) < 0) {
-        qWarning() << "Failed to set" << fps << "FPS mode. Camera supports these:";
-        /* Obtain possible settings for framerate... */
-        struct v4l2_frmivalenum frmival;
-        memset(&frmival, 0, sizeof(frmival));
-        frmival.type = type;
-        frmival.pixel_format = fmt.fmt.pix.pixelformat;
-        frmival.width = fmt.fmt.pix.width;
-        frmival.height = fmt.fmt.pix.height;
-        while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0)
-        {
-            if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
-                qDebug() << "Discrete:"
-                         << frmival.discrete.denominator << "/" << frmival.discrete.numerator;
-            else
-                qDebug() << "Stepwise:"
-                            << frmival.stepwise.min.denominator << "/" << frmival.stepwise.min.numerator << ".."
-                            << frmival.stepwise.max.denominator << "/" << frmival.stepwise.max.numerator;
-            frmival.index++;
-        }
-    }
-
-    return init_mmap();
+    return 0;
 }
 
 int VideoCapture::start()
@@ -207,18 +423,10 @@ int VideoCapture::start()
 
     for (unsigned int i = 0; i < n_buffers; ++i)
     {
-            struct v4l2_buffer buf;
-            CLEAR(buf);
-            buf.type = type;
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.index = i;
-            if (multiplanar) {
-                buf.m.planes = current_planes;
-                buf.length = 1;
-            }
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-                qDebug() << "VIDIOC_QBUF:" << errno;
-                return -errno;
+            int r = queue_buffer(i);
+            if (r < 0) {
+                qDebug() << "VIDIOC_QBUF:" << -r;
+                return r;
             }
     }
 
@@ -234,7 +442,7 @@ int VideoCapture::begin_grab(const void **data, unsigned int *bytesused)
 {
     CLEAR(*current_buf);
     current_buf->type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    current_buf->memory = V4L2_MEMORY_MMAP;
+    current_buf->memory = memory;
     if (multiplanar) {
         current_buf->m.planes = current_planes;
         current_buf->length = 1;
@@ -268,6 +476,67 @@ int VideoCapture::end_grab()
     return 0;
 }
 
+int VideoCapture::dequeue_buffer(unsigned int *index, unsigned int *bytesused, long long *timestamp)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[1];
+
+    CLEAR(buf);
+    buf.type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = memory;
+    if (multiplanar) {
+        buf.m.planes = planes;
+        buf.length = 1;
+    }
+
+    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+            if (errno == EAGAIN)
+                    return 0;
+            return -errno;
+    }
+
+    if (buf.index >= n_buffers)
+        return -EFAULT;
+
+    *index = buf.index;
+    *bytesused = multiplanar ? planes[0].bytesused : buf.bytesused;
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        *timestamp = (long long)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    else
+        *timestamp = monotonicMicroseconds(); /* No usable timestamp, dequeue time is the best we have */
+    return 1;
+}
+
+int VideoCapture::queue_buffer(unsigned int index)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[1];
+
+    if (index >= n_buffers)
+        return -EINVAL;
+
+    CLEAR(buf);
+    buf.type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = memory;
+    buf.index = index;
+    if (multiplanar) {
+        CLEAR(planes);
+        buf.m.planes = planes;
+        buf.length = 1;
+        if (memory == V4L2_MEMORY_USERPTR) {
+            planes[0].m.userptr = (unsigned long)buffers[index].start;
+            planes[0].length = buffers[index].length;
+        }
+    } else if (memory == V4L2_MEMORY_USERPTR) {
+        buf.m.userptr = (unsigned long)buffers[index].start;
+        buf.length = buffers[index].length;
+    }
+
+    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+        return -errno;
+    return 0;
+}
+
 
 int VideoCapture::stop()
 {
@@ -282,8 +551,10 @@ void VideoCapture::teardown()
     if (buffers)
     {
         stop(); /* In case the user forgot to cal it */
-        for (unsigned int i = 0; i < n_buffers; ++i)
-                munmap(buffers[i].start, buffers[i].length);
+        if (memory == V4L2_MEMORY_MMAP) {
+            for (unsigned int i = 0; i < n_buffers; ++i)
+                    munmap(buffers[i].start, buffers[i].length);
+        }
         delete [] buffers;
         n_buffers = 0;
         buffers = NULL;
@@ -305,13 +576,14 @@ int VideoCapture::init_mmap()
     struct v4l2_requestbuffers req;
 
     CLEAR(req);
-    req.count = 4;
+    req.count = requested_buffers;
     req.type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
 
     if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
         return -errno;
     }
+    memory = V4L2_MEMORY_MMAP;
 
     if (req.count < 2)
         return -ENOMEM;
@@ -364,3 +636,36 @@ int VideoCapture::init_mmap()
 
     return 0;
 }
+
+/* Capture into memory provided by the caller, which must stay valid until
+ * teardown. Fails if the driver cannot do USERPTR or wants a different
+ * number of buffers, the caller can then use init_mmap() instead. */
+int VideoCapture::init_userptr(void * const *pointers, unsigned int count, unsigned int length)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+    req.count = count;
+    req.type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        return -errno;
+    }
+
+    if (req.count != count) {
+        req.count = 0;
+        xioctl(fd, VIDIOC_REQBUFS, &req);
+        return -ENOMEM;
+    }
+    memory = V4L2_MEMORY_USERPTR;
+
+    buffers = new buffer[count];
+    for (n_buffers = 0; n_buffers < count; ++n_buffers)
+    {
+        buffers[n_buffers].start = pointers[n_buffers];
+        buffers[n_buffers].length = length;
+    }
+
+    return 0;
+}
@@ -1,22 +1,32 @@
-struct VideoCaptureSettings {
-  unsigned int width;
-  unsigned int height;
-  unsigned int stride; /* Bytes per line */
-  unsigned int size;   /* Bytes per image */
-  unsigned int format; /* FOURCC code */
-};
+#include <vector>
+
+#include "videosource.h"
 
-class VideoCapture
+class VideoCapture: public VideoSource
 {
 public:
 	VideoCapture();
 	~VideoCapture();
 
     int open(const char* filename); /* returns -1 on error */
-    int setup(int width, int height, int fps, /* out */ VideoCaptureSettings *settings);
+    /* List what the device supports, empty if it cannot enumerate */
+    std::vector<VideoCaptureFormat> enum_formats(unsigned int fps);
+    int negotiate(int width, int height, int fps, const unsigned int *formats, unsigned int count, /* out */ VideoCaptureFormat *result);
+    int setup(int width, int height, int fps, unsigned int pixelformat, /* out */ VideoCaptureSettings *settings);
+    /* Uses the V4L2 selection API, so fewer pixels are transferred */
+    int crop(int width, int height, /* in/out */ VideoCaptureSettings *settings);
+    int init_mmap();
+    int init_userptr(void * const *pointers, unsigned int count, unsigned int length);
     int start();
     int begin_grab(const void **data, unsigned int *bytesused);
     int end_grab();
+    /* Alternative to begin_grab/end_grab where the caller keeps track of
+     * the buffer index, so several buffers can be held at the same time and
+     * they can be dequeued and queued from different threads. */
+    int dequeue_buffer(unsigned int *index, unsigned int *bytesused, long long *timestamp);
+    int queue_buffer(unsigned int index);
+    const void *buffer_data(unsigned int index) const { return buffers[index].start; }
+    unsigned int buffer_count() const { return n_buffers; }
     int stop();
     void teardown();
     void close();
@@ -29,12 +39,14 @@ protected:
         void *start;
         unsigned int length;
     };
+    int set_format(int width, int height, unsigned int pixelformat, VideoCaptureSettings *settings);
+
     int fd;
     buffer* buffers;
     unsigned int n_buffers;
     struct v4l2_buffer *current_buf;
     struct v4l2_plane *current_planes;
     bool multiplanar;
-
-    int init_mmap();
+    unsigned int memory; /* V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR */
+    int framerate;
 };
@@ -0,0 +1,124 @@
+#include "videocpustage.h"
+#include "dyplocontext.h"
+
+#include <QDebug>
+#include <dyplo/hardware.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+/* Bytes taken from the FIFO at once, small enough to stay in L1/L2
+ * between the filter and the write */
+#define CPU_STAGE_CHUNK_SIZE (32 * 1024)
+
+VideoCpuStage::VideoCpuStage(DyploContext *dyplo, unsigned int flags):
+    from_logic(new dyplo::HardwareFifo(dyplo->GetHardwareContext().openAvailableReadFifo())),
+    to_logic(NULL),
+    filter(video_filter_kernel(flags))
+{
+    try
+    {
+        to_logic = new dyplo::HardwareFifo(dyplo->GetHardwareContext().openAvailableWriteFifo());
+    }
+    catch (const std::exception&)
+    {
+        delete from_logic;
+        throw;
+    }
+    node_index = from_logic->getNodeAndFifoIndex() & 0xFF;
+    from_logic->fcntl_set_flag(O_NONBLOCK);
+    to_logic->fcntl_set_flag(O_NONBLOCK);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+VideoCpuStage::~VideoCpuStage()
+{
+    stop();
+    ::close(stop_fd);
+    from_logic->deleteRoutes();
+    to_logic->deleteRoutes();
+    delete to_logic;
+    delete from_logic;
+}
+
+void VideoCpuStage::stop()
+{
+    uint64_t one = 1;
+    if (::write(stop_fd, &one, sizeof(one)) < 0)
+        qWarning() << "Failed to signal CPU node stage";
+    wait();
+}
+
+int VideoCpuStage::route(int tailnode)
+{
+    from_logic->addRouteFrom(tailnode);
+    return to_logic->getNodeAndFifoIndex();
+}
+
+/* Returns false when the stage must stop */
+bool VideoCpuStage::waitFor(int fd, short events)
+{
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+    while (::poll(fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+    return !fds[1].revents;
+}
+
+void VideoCpuStage::run()
+{
+    std::vector<unsigned char> buffer(CPU_STAGE_CHUNK_SIZE);
+    /* Bytes of a pixel pair that is not complete yet */
+    unsigned int pending = 0;
+
+    while (waitFor(from_logic->handle, POLLIN))
+    {
+        ssize_t bytes = ::read(from_logic->handle, &buffer[pending], buffer.size() - pending);
+        if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            qWarning() << "CPU node stage failed to read:" << errno;
+            return;
+        }
+        pending += bytes;
+        unsigned int size = pending & ~3;
+        filter(&buffer[0], size, &buffer[0]);
+
+        for (unsigned int done = 0; done < size; )
+        {
+            ssize_t written = ::write(to_logic->handle, &buffer[done], size - done);
+            if (written >= 0)
+            {
+                done += written;
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                /* The next stage hasn't taken the previous data yet */
+                if (!waitFor(to_logic->handle, POLLOUT))
+                    return;
+            }
+            else if (errno != EINTR)
+            {
+                qWarning() << "CPU node stage failed to write:" << errno;
+                return;
+            }
+        }
+
+        pending -= size;
+        memmove(&buffer[0], &buffer[size], pending);
+    }
+}
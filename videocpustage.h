@@ -0,0 +1,46 @@
+#ifndef VIDEOCPUSTAGE_H
+#define VIDEOCPUSTAGE_H
+
+#include <QThread>
+#include "videokernels.h"
+
+class DyploContext;
+
+namespace dyplo {
+class HardwareFifo;
+}
+
+/* Software filters on a Dyplo CPU node, in between two stages in logic.
+ * A worker thread reads the YUYV stream from a CPU read FIFO, runs the
+ * filter kernel over it and writes the result into a CPU write FIFO, so
+ * the frames stay in the logic chain when a bitstream is missing for one
+ * of its stages. The point filters handle each pixel pair on its own, so
+ * the stream is processed in whatever chunks arrive, regardless of rows
+ * or frames. */
+class VideoCpuStage : public QThread
+{
+public:
+    /* Opens a free CPU read and write FIFO, throws when there are none */
+    VideoCpuStage(DyploContext *dyplo, unsigned int flags);
+    ~VideoCpuStage();
+
+    /* Route "tailnode" into the stage, returns the node and FIFO to route
+     * the output of the stage from */
+    int route(int tailnode);
+    /* The CPU node the FIFOs belong to */
+    int getNodeIndex() const { return node_index; }
+
+    void stop();
+
+protected:
+    dyplo::HardwareFifo *from_logic;
+    dyplo::HardwareFifo *to_logic;
+    VideoRowFunc filter;
+    int node_index;
+    int stop_fd;
+
+    void run();
+    bool waitFor(int fd, short events);
+};
+
+#endif // VIDEOCPUSTAGE_H
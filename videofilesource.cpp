@@ -0,0 +1,70 @@
+#include "videofilesource.h"
+
+#include <QDebug>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+VideoFileSource::VideoFileSource(unsigned int width, unsigned int height, unsigned int format, int fps):
+    PacedVideoSource(width, height, format, fps),
+    clip(NULL),
+    clip_size(0),
+    frames(0),
+    next_frame(0)
+{
+}
+
+VideoFileSource::~VideoFileSource()
+{
+    if (clip)
+        munmap((void *)clip, clip_size);
+}
+
+int VideoFileSource::open(const char *filename)
+{
+    int file = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+        return -errno;
+
+    struct stat st;
+    if (fstat(file, &st) < 0 || st.st_size == 0) {
+        ::close(file);
+        return -EINVAL;
+    }
+    /* Load the whole clip up front, reading from disk would be part of
+     * the measurement otherwise */
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file, 0);
+    ::close(file);
+    if (data == MAP_FAILED)
+        return -errno;
+
+    clip = (const unsigned char *)data;
+    clip_size = st.st_size;
+    return 0;
+}
+
+int VideoFileSource::prepare()
+{
+    /* Size of the frames is known now */
+    frames = clip_size / settings.size;
+    next_frame = 0;
+    if (!frames) {
+        qWarning() << "Video file is smaller than a" << settings.width << "x" << settings.height << "frame";
+        return -EINVAL;
+    }
+    return 0;
+}
+
+const void *VideoFileSource::produce(void *buffer, bool in_place)
+{
+    const unsigned char *frame = clip + next_frame * settings.size;
+    if (++next_frame == frames)
+        next_frame = 0;
+    if (!in_place)
+        return frame;
+    memcpy(buffer, frame, settings.size);
+    return buffer;
+}
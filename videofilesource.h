@@ -0,0 +1,27 @@
+#ifndef VIDEOFILESOURCE_H
+#define VIDEOFILESOURCE_H
+
+#include "pacedvideosource.h"
+
+/* Plays a file with raw frames in a loop. The file is mapped into memory
+ * and the frames are handed out from there without copying, except when
+ * the buffers are supplied by the caller. */
+class VideoFileSource: public PacedVideoSource
+{
+public:
+    VideoFileSource(unsigned int width, unsigned int height, unsigned int format, int fps);
+    ~VideoFileSource();
+
+    int open(const char *filename);
+
+protected:
+    int prepare();
+    const void *produce(void *buffer, bool in_place);
+
+    const unsigned char *clip;
+    unsigned int clip_size;
+    unsigned int frames;
+    unsigned int next_frame;
+};
+
+#endif // VIDEOFILESOURCE_H
@@ -0,0 +1,1179 @@
+#include "videokernels.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define VIDEO_KERNELS_X86
+#   include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   define VIDEO_KERNELS_NEON
+#   include <arm_neon.h>
+#endif
+
+/*
+ * C reference implementations
+ */
+
+static inline unsigned char thd_process(unsigned char y)
+{
+    if (y < (64 - 32))
+        return 0;
+    if (y < (128 - 32))
+        return 63;
+    if (y < (192 - 32))
+        return 127;
+    if (y < (256 - 32))
+        return 191;
+    return 255;
+}
+
+static inline unsigned char thd_processc(unsigned char uv)
+{
+    if (uv < 0x60)
+        return 0x00;
+    if (uv > 0xA0)
+        return 0xFF;
+    return 0x80;
+}
+
+static inline unsigned char stretch(unsigned char y)
+{
+    if (y <= 64)
+        return 0;
+    if (y >= 192)
+        return 255;
+    return (y - 64) << 1;
+}
+
+static inline unsigned char clamp(short v)
+{
+        if (v > 255)
+                return 255;
+        if (v < 0)
+                return 0;
+        return v;
+}
+
+/* Bytes per pixel of a VideoOutputFormat, constant in the templates */
+static inline unsigned int pixel_bytes(unsigned int format)
+{
+        switch (format) {
+        case VIDEO_OUTPUT_RGB32:
+                return 4;
+        case VIDEO_OUTPUT_RGB565:
+                return 2;
+        case VIDEO_OUTPUT_GRAY8:
+                return 1;
+        default:
+                return 3;
+        }
+}
+
+/* Store one pixel. RGB32 is the 32-bit word 0xffRRGGBB and RGB565 a 16-bit
+ * word, in little endian memory order like QImage has them on our CPUs. */
+template <unsigned int Format>
+static inline void store_pixel(unsigned char r, unsigned char g, unsigned char b, unsigned char *output)
+{
+        switch (Format) {
+        case VIDEO_OUTPUT_RGB32:
+                output[0] = b;
+                output[1] = g;
+                output[2] = r;
+                output[3] = 0xFF;
+                break;
+        case VIDEO_OUTPUT_RGB565:
+                output[0] = ((g << 3) & 0xE0) | (b >> 3);
+                output[1] = (r & 0xF8) | (g >> 5);
+                break;
+        case VIDEO_OUTPUT_GRAY8:
+                output[0] = g;
+                break;
+        default:
+                output[0] = r;
+                output[1] = g;
+                output[2] = b;
+                break;
+        }
+}
+
+template <unsigned int Format>
+static inline void store_gray(unsigned char y, unsigned char *output)
+{
+        if (Format == VIDEO_OUTPUT_GRAY8)
+                output[0] = y;
+        else
+                store_pixel<Format>(y, y, y, output);
+}
+
+/* Convert one YUYV pixel pair into two output pixels. Gray output is the
+ * Y as it is. */
+template <unsigned int Format>
+static inline void torgb_pair(short y0, short u, short y1, short v, unsigned char *rgb_buffer)
+{
+        if (Format == VIDEO_OUTPUT_GRAY8) {
+                rgb_buffer[0] = y0;
+                rgb_buffer[1] = y1;
+                return;
+        }
+
+        u -= 0x80;
+        v -= 0x80;
+
+        short rr = (45 * v) >> 5;
+        short gg = - (((45 * v) + (22 * u)) >> 6);
+        short bb = (111 * u) >> 6;
+
+        store_pixel<Format>(clamp(y0 + rr), clamp(y0 + gg), clamp(y0 + bb), rgb_buffer);
+        store_pixel<Format>(clamp(y1 + rr), clamp(y1 + gg), clamp(y1 + bb), rgb_buffer + pixel_bytes(Format));
+}
+
+/* The whole chain in one pass. Flags and Format are compile time
+ * constants, so the compiler removes the unused filters from each instance. */
+template <unsigned int Flags, unsigned int Format>
+static inline void fused_pair(unsigned char y0, unsigned char u, unsigned char y1, unsigned char v, unsigned char *rgb_buffer)
+{
+        if (Flags & SOFTWARE_FLAG_CONTRAST) {
+                y0 = stretch(y0);
+                y1 = stretch(y1);
+        }
+        if (Flags & SOFTWARE_FLAG_THD) {
+                y0 = thd_process(y0);
+                u = thd_processc(u);
+                y1 = thd_process(y1);
+                v = thd_processc(v);
+        }
+        if (Flags & SOFTWARE_FLAG_GRAY) {
+                store_gray<Format>(y0, rgb_buffer);
+                store_gray<Format>(y1, rgb_buffer + pixel_bytes(Format));
+        } else {
+                torgb_pair<Format>(y0, u, y1, v, rgb_buffer);
+        }
+}
+
+template <unsigned int Flags, unsigned int Format>
+static void fused_row(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+        for (unsigned int s = 0; s < size; s += 4) {
+                fused_pair<Flags, Format>(p[s], p[s+1], p[s+2], p[s+3], rgb_buffer);
+                rgb_buffer += 2 * pixel_bytes(Format);
+        }
+}
+
+/* NV12 has a row of Y, and a row of interleaved UV that is shared by two
+ * rows of Y */
+template <unsigned int Flags, unsigned int Format>
+static void fused_row_nv12(const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+        for (unsigned int x = 0; x < width; x += 2) {
+                fused_pair<Flags, Format>(y[x], uv[x], y[x+1], uv[x+1], rgb_buffer);
+                rgb_buffer += 2 * pixel_bytes(Format);
+        }
+}
+
+/* The filters without the conversion, YUYV in and out. For stages that
+ * run on the CPU in front of hardware that does the rest. */
+template <unsigned int Flags>
+static void filter_row(const unsigned char *p, unsigned int size, unsigned char *output)
+{
+        for (unsigned int s = 0; s < size; s += 4) {
+                unsigned char y0 = p[s];
+                unsigned char u = p[s+1];
+                unsigned char y1 = p[s+2];
+                unsigned char v = p[s+3];
+                if (Flags & SOFTWARE_FLAG_CONTRAST) {
+                        y0 = stretch(y0);
+                        y1 = stretch(y1);
+                }
+                if (Flags & SOFTWARE_FLAG_THD) {
+                        y0 = thd_process(y0);
+                        u = thd_processc(u);
+                        y1 = thd_process(y1);
+                        v = thd_processc(v);
+                }
+                if (Flags & SOFTWARE_FLAG_GRAY) {
+                        u = 0x80;
+                        v = 0x80;
+                }
+                output[s] = y0;
+                output[s+1] = u;
+                output[s+2] = y1;
+                output[s+3] = v;
+        }
+}
+
+/* 3x3 Laplacian on Y, 8 times the center minus the 8 around it, the
+ * absolute value is the edge strength. The outer pixels repeat at the
+ * borders. Does the bytes from "first" to "last" of a row of "size". */
+static void laplacian_part(const unsigned char *above, const unsigned char *row, const unsigned char *below,
+                           unsigned int first, unsigned int last, unsigned int size, unsigned char *output)
+{
+        for (unsigned int s = first; s < last; s += 2) {
+                unsigned int l = s ? s - 2 : s;
+                unsigned int r = s + 2 < size ? s + 2 : s;
+                int sum = above[l] + above[s] + above[r] + row[l] + row[r] + below[l] + below[s] + below[r];
+                int v = 8 * row[s] - sum;
+                if (v < 0)
+                        v = -v;
+                output[s] = v > 255 ? 255 : v;
+                output[s+1] = 0x80;
+        }
+}
+
+static void laplacian_row(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned int size, unsigned char *output)
+{
+        laplacian_part(above, row, below, 0, size, size, output);
+}
+
+/* Through the lookup tables of a compiled chain of point operations */
+template <unsigned int Format>
+static void lookup_row(const VideoLookupTables *tables, const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+        for (unsigned int s = 0; s < size; s += 4) {
+                torgb_pair<Format>(tables->y[p[s]], tables->uv[p[s+1]], tables->y[p[s+2]], tables->uv[p[s+3]], rgb_buffer);
+                rgb_buffer += 2 * pixel_bytes(Format);
+        }
+}
+
+template <unsigned int Format>
+static void lookup_row_nv12(const VideoLookupTables *tables, const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+        for (unsigned int x = 0; x < width; x += 2) {
+                torgb_pair<Format>(tables->y[y[x]], tables->uv[uv[x]], tables->y[y[x+1]], tables->uv[uv[x+1]], rgb_buffer);
+                rgb_buffer += 2 * pixel_bytes(Format);
+        }
+}
+
+static void lookup_filter_row(const VideoLookupTables *tables, const unsigned char *p, unsigned int size, unsigned char *output)
+{
+        for (unsigned int s = 0; s < size; s += 4) {
+                output[s] = tables->y[p[s]];
+                output[s+1] = tables->uv[p[s+1]];
+                output[s+2] = tables->y[p[s+2]];
+                output[s+3] = tables->uv[p[s+3]];
+        }
+}
+
+/*
+ * The SIMD versions process blocks of 16 or 32 pixels and leave the
+ * remainder to the C code. The RGB calculation is done in 16-bit lanes
+ * with the same shifts as above, and the saturating pack does the clamp.
+ */
+
+#ifdef VIDEO_KERNELS_X86
+
+#define SSE_TARGET __attribute__((target("sse4.1")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+/* pshufb masks to interleave 16 R, G and B bytes into 48 bytes RGB888 */
+#define RGB_MASK_R0 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5
+#define RGB_MASK_R1 -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1
+#define RGB_MASK_R2 -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1
+#define RGB_MASK_G0 -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1
+#define RGB_MASK_G1 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10
+#define RGB_MASK_G2 -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1
+#define RGB_MASK_B0 -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1
+#define RGB_MASK_B1 -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1
+#define RGB_MASK_B2 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15
+#define GRAY_MASK_0 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5
+#define GRAY_MASK_1 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10
+#define GRAY_MASK_2 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15
+/* Gather Y in the low 8 bytes, U and V in the upper 8 */
+#define YUYV_SPLIT_MASK 0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15
+/* Gather U in the low 8 bytes and V in the upper 8 */
+#define NV12_SPLIT_MASK 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15
+
+/* Thresholds and output levels for "thd", index 0 for Y, 1 for UV. The
+ * result is the highest level whose threshold was reached. */
+enum { THD_Y = 0, THD_UV = 1 };
+static const unsigned char thd_thresholds[2][4] = { { 32, 96, 160, 224 }, { 0x60, 0xA1, 0xA1, 0xA1 } };
+static const unsigned char thd_levels[2][4] = { { 63, 127, 191, 255 }, { 0x80, 0xFF, 0xFF, 0xFF } };
+
+/* Repeat a pair of bytes, for even and odd byte constants */
+SSE_TARGET static inline __m128i sse_pair(unsigned char even, unsigned char odd)
+{
+    return _mm_set1_epi16((short)((odd << 8) | even));
+}
+
+/* The contrast stretch on all bytes */
+SSE_TARGET static inline __m128i sse_stretch(__m128i x)
+{
+    __m128i t = _mm_subs_epu8(x, _mm_set1_epi8(64));
+    return _mm_adds_epu8(t, t);
+}
+
+/* The contrast stretch on Y only, for YUYV */
+SSE_TARGET static inline __m128i sse_contrast(__m128i x)
+{
+    const __m128i ymask = _mm_set1_epi16(0x00FF);
+    return _mm_or_si128(_mm_and_si128(sse_stretch(x), ymask), _mm_andnot_si128(ymask, x));
+}
+
+SSE_TARGET static inline __m128i sse_ge_level(__m128i x, __m128i threshold, __m128i level)
+{
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(x, threshold), x);
+    return _mm_and_si128(ge, level);
+}
+
+/* Even and Odd select the THD_Y or THD_UV levels for the even and odd bytes */
+template <int Even, int Odd>
+SSE_TARGET static inline __m128i sse_thd(__m128i x)
+{
+    __m128i r = _mm_setzero_si128();
+    for (int i = 0; i < 4; ++i)
+        r = _mm_max_epu8(r, sse_ge_level(x,
+                sse_pair(thd_thresholds[Even][i], thd_thresholds[Odd][i]),
+                sse_pair(thd_levels[Even][i], thd_levels[Odd][i])));
+    return r;
+}
+
+/* Store 16 pixels from their R, G and B. Gray output takes G, which is
+ * only used for the gray levels. */
+template <unsigned int Format>
+SSE_TARGET static inline void sse_store_rgb(__m128i r, __m128i g, __m128i b, unsigned char *rgb)
+{
+    if (Format == VIDEO_OUTPUT_RGB32)
+    {
+        /* B G R 0xFF for each pixel */
+        const __m128i alpha = _mm_set1_epi8((char)0xFF);
+        __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+        __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+        __m128i ra_lo = _mm_unpacklo_epi8(r, alpha);
+        __m128i ra_hi = _mm_unpackhi_epi8(r, alpha);
+        _mm_storeu_si128((__m128i*)rgb, _mm_unpacklo_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128((__m128i*)(rgb + 16), _mm_unpackhi_epi16(bg_lo, ra_lo));
+        _mm_storeu_si128((__m128i*)(rgb + 32), _mm_unpacklo_epi16(bg_hi, ra_hi));
+        _mm_storeu_si128((__m128i*)(rgb + 48), _mm_unpackhi_epi16(bg_hi, ra_hi));
+    }
+    else if (Format == VIDEO_OUTPUT_RGB565)
+    {
+        /* The 16-bit shifts leak bits into the neighbour byte, the masks
+         * drop them again */
+        __m128i lo = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), _mm_set1_epi8((char)0xE0)),
+                                  _mm_and_si128(_mm_srli_epi16(b, 3), _mm_set1_epi8(0x1F)));
+        __m128i hi = _mm_or_si128(_mm_and_si128(r, _mm_set1_epi8((char)0xF8)),
+                                  _mm_and_si128(_mm_srli_epi16(g, 5), _mm_set1_epi8(0x07)));
+        _mm_storeu_si128((__m128i*)rgb, _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i*)(rgb + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    else if (Format == VIDEO_OUTPUT_GRAY8)
+    {
+        _mm_storeu_si128((__m128i*)rgb, g);
+    }
+    else
+    {
+        _mm_storeu_si128((__m128i*)rgb, _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(r, _mm_setr_epi8(RGB_MASK_R0)),
+                _mm_shuffle_epi8(g, _mm_setr_epi8(RGB_MASK_G0))),
+                _mm_shuffle_epi8(b, _mm_setr_epi8(RGB_MASK_B0))));
+        _mm_storeu_si128((__m128i*)(rgb + 16), _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(r, _mm_setr_epi8(RGB_MASK_R1)),
+                _mm_shuffle_epi8(g, _mm_setr_epi8(RGB_MASK_G1))),
+                _mm_shuffle_epi8(b, _mm_setr_epi8(RGB_MASK_B1))));
+        _mm_storeu_si128((__m128i*)(rgb + 32), _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(r, _mm_setr_epi8(RGB_MASK_R2)),
+                _mm_shuffle_epi8(g, _mm_setr_epi8(RGB_MASK_G2))),
+                _mm_shuffle_epi8(b, _mm_setr_epi8(RGB_MASK_B2))));
+    }
+}
+
+/* Convert 16 pixels, 16 Y and u0..u7 v0..v7, into the output format */
+template <unsigned int Format>
+SSE_TARGET static inline void sse_yuv_torgb(__m128i y, __m128i uv, unsigned char *rgb)
+{
+    if (Format == VIDEO_OUTPUT_GRAY8)
+    {
+        _mm_storeu_si128((__m128i*)rgb, y);
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(0x80);
+    __m128i u = _mm_sub_epi16(_mm_unpacklo_epi8(uv, zero), bias);
+    __m128i v = _mm_sub_epi16(_mm_unpackhi_epi8(uv, zero), bias);
+
+    __m128i v45 = _mm_mullo_epi16(v, _mm_set1_epi16(45));
+    __m128i rr = _mm_srai_epi16(v45, 5);
+    __m128i gg = _mm_sub_epi16(zero, _mm_srai_epi16(_mm_add_epi16(v45, _mm_mullo_epi16(u, _mm_set1_epi16(22))), 6));
+    __m128i bb = _mm_srai_epi16(_mm_mullo_epi16(u, _mm_set1_epi16(111)), 6);
+
+    __m128i ylo = _mm_unpacklo_epi8(y, zero);
+    __m128i yhi = _mm_unpackhi_epi8(y, zero);
+    __m128i r = _mm_packus_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(rr, rr)), _mm_add_epi16(yhi, _mm_unpackhi_epi16(rr, rr)));
+    __m128i g = _mm_packus_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(gg, gg)), _mm_add_epi16(yhi, _mm_unpackhi_epi16(gg, gg)));
+    __m128i bl = _mm_packus_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(bb, bb)), _mm_add_epi16(yhi, _mm_unpackhi_epi16(bb, bb)));
+
+    sse_store_rgb<Format>(r, g, bl, rgb);
+}
+
+/* Split 16 YUYV pixels in a (first 8) and b (last 8) into 16 Y and
+ * u0..u7 v0..v7 */
+SSE_TARGET static inline void sse_split(__m128i a, __m128i b, __m128i *y, __m128i *uv)
+{
+    const __m128i split = _mm_setr_epi8(YUYV_SPLIT_MASK);
+    a = _mm_shuffle_epi8(a, split);
+    b = _mm_shuffle_epi8(b, split);
+    *y = _mm_unpacklo_epi64(a, b);
+    *uv = _mm_unpackhi_epi64(a, b); /* u0..u3 v0..v3 u4..u7 v4..v7 */
+    *uv = _mm_shuffle_epi32(*uv, _MM_SHUFFLE(3, 1, 2, 0)); /* u0..u7 v0..v7 */
+}
+
+/* Convert 16 pixels in a (first 8) and b (last 8) into the output format */
+template <unsigned int Format>
+SSE_TARGET static inline void sse_torgb(__m128i a, __m128i b, unsigned char *rgb)
+{
+    __m128i y, uv;
+    sse_split(a, b, &y, &uv);
+    sse_yuv_torgb<Format>(y, uv, rgb);
+}
+
+/* Write 16 Y values as gray pixels */
+template <unsigned int Format>
+SSE_TARGET static inline void sse_store_gray(__m128i y, unsigned char *rgb)
+{
+    if (Format != VIDEO_OUTPUT_RGB888)
+    {
+        sse_store_rgb<Format>(y, y, y, rgb);
+        return;
+    }
+    _mm_storeu_si128((__m128i*)rgb, _mm_shuffle_epi8(y, _mm_setr_epi8(GRAY_MASK_0)));
+    _mm_storeu_si128((__m128i*)(rgb + 16), _mm_shuffle_epi8(y, _mm_setr_epi8(GRAY_MASK_1)));
+    _mm_storeu_si128((__m128i*)(rgb + 32), _mm_shuffle_epi8(y, _mm_setr_epi8(GRAY_MASK_2)));
+}
+
+template <unsigned int Format>
+SSE_TARGET static inline void sse_torgb_gray(__m128i a, __m128i b, unsigned char *rgb)
+{
+    const __m128i split = _mm_setr_epi8(YUYV_SPLIT_MASK);
+    sse_store_gray<Format>(_mm_unpacklo_epi64(_mm_shuffle_epi8(a, split), _mm_shuffle_epi8(b, split)), rgb);
+}
+
+template <unsigned int Flags, unsigned int Format>
+SSE_TARGET static void fused_row_sse(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 5;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+        if (Flags & SOFTWARE_FLAG_CONTRAST) {
+            a = sse_contrast(a);
+            b = sse_contrast(b);
+        }
+        if (Flags & SOFTWARE_FLAG_THD) {
+            a = sse_thd<THD_Y, THD_UV>(a);
+            b = sse_thd<THD_Y, THD_UV>(b);
+        }
+        if (Flags & SOFTWARE_FLAG_GRAY)
+            sse_torgb_gray<Format>(a, b, rgb_buffer);
+        else
+            sse_torgb<Format>(a, b, rgb_buffer);
+        p += 32;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    fused_row<Flags, Format>(p, size - (blocks << 5), rgb_buffer);
+}
+
+template <unsigned int Flags, unsigned int Format>
+SSE_TARGET static void fused_row_nv12_sse(const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+    const __m128i split = _mm_setr_epi8(NV12_SPLIT_MASK);
+    unsigned int blocks = width >> 4;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m128i luma = _mm_loadu_si128((const __m128i*)y);
+        __m128i chroma = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)uv), split);
+        if (Flags & SOFTWARE_FLAG_CONTRAST)
+            luma = sse_stretch(luma);
+        if (Flags & SOFTWARE_FLAG_THD) {
+            luma = sse_thd<THD_Y, THD_Y>(luma);
+            chroma = sse_thd<THD_UV, THD_UV>(chroma);
+        }
+        if (Flags & SOFTWARE_FLAG_GRAY)
+            sse_store_gray<Format>(luma, rgb_buffer);
+        else
+            sse_yuv_torgb<Format>(luma, chroma, rgb_buffer);
+        y += 16;
+        uv += 16;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    fused_row_nv12<Flags, Format>(y, uv, width - (blocks << 4), rgb_buffer);
+}
+
+/* Look up 16 bytes in a 256 byte table, one row of 16 entries at a time.
+ * Flipping the high nibble of the row and adding 0x70 with saturation
+ * leaves 0..15 in bits 0-3 for the bytes in that row and sets bit 7 for
+ * all others, for which pshufb then returns zero. */
+SSE_TARGET static inline __m128i sse_lookup(const unsigned char *table, __m128i x)
+{
+    const __m128i offset = _mm_set1_epi8(0x70);
+    __m128i r = _mm_setzero_si128();
+    for (int row = 0; row < 16; ++row)
+    {
+        __m128i index = _mm_adds_epu8(_mm_xor_si128(x, _mm_set1_epi8((char)(row << 4))), offset);
+        r = _mm_or_si128(r, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(table + (row << 4))), index));
+    }
+    return r;
+}
+
+template <unsigned int Format>
+SSE_TARGET static void lookup_row_sse(const VideoLookupTables *tables, const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 5;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m128i y, uv;
+        sse_split(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16)), &y, &uv);
+        /* Gray output has no use for the chroma */
+        sse_yuv_torgb<Format>(sse_lookup(tables->y, y), Format == VIDEO_OUTPUT_GRAY8 ? uv : sse_lookup(tables->uv, uv), rgb_buffer);
+        p += 32;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    lookup_row<Format>(tables, p, size - (blocks << 5), rgb_buffer);
+}
+
+template <unsigned int Format>
+SSE_TARGET static void lookup_row_nv12_sse(const VideoLookupTables *tables, const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+    const __m128i split = _mm_setr_epi8(NV12_SPLIT_MASK);
+    unsigned int blocks = width >> 4;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m128i luma = _mm_loadu_si128((const __m128i*)y);
+        __m128i chroma = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)uv), split);
+        sse_yuv_torgb<Format>(sse_lookup(tables->y, luma), Format == VIDEO_OUTPUT_GRAY8 ? chroma : sse_lookup(tables->uv, chroma), rgb_buffer);
+        y += 16;
+        uv += 16;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    lookup_row_nv12<Format>(tables, y, uv, width - (blocks << 4), rgb_buffer);
+}
+
+/* Y of the 8 pixels at p, in 16-bit lanes */
+SSE_TARGET static inline __m128i sse_load_y(const unsigned char *p)
+{
+    return _mm_and_si128(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi16(0x00FF));
+}
+
+/* 8 pixels per block, the neighbours are 2 bytes to either side. The
+ * first pixel and the remainder have a border, the C code does those. */
+SSE_TARGET static void laplacian_row_sse(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned int size, unsigned char *output)
+{
+    const __m128i chroma = _mm_set1_epi16((short)0x8000);
+    const __m128i max = _mm_set1_epi16(255);
+    unsigned int s = 2;
+    laplacian_part(above, row, below, 0, s, size, output);
+    for (; s + 18 <= size; s += 16)
+    {
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(sse_load_y(above + s - 2), sse_load_y(above + s)),
+                                    _mm_add_epi16(sse_load_y(above + s + 2), sse_load_y(row + s - 2)));
+        sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_add_epi16(sse_load_y(row + s + 2), sse_load_y(below + s - 2)),
+                                               _mm_add_epi16(sse_load_y(below + s), sse_load_y(below + s + 2))));
+        __m128i v = _mm_abs_epi16(_mm_sub_epi16(_mm_slli_epi16(sse_load_y(row + s), 3), sum));
+        _mm_storeu_si128((__m128i*)(output + s), _mm_or_si128(_mm_min_epi16(v, max), chroma));
+    }
+    laplacian_part(above, row, below, s, size, size, output);
+}
+
+/* Regular stores up to the first 16 byte boundary and for the remainder,
+ * non-temporal stores for all the aligned blocks in between */
+SSE_TARGET static void stream_row_sse(unsigned char *output, const unsigned char *row, unsigned int size)
+{
+    unsigned int s = (16 - ((uintptr_t)output & 15)) & 15;
+    if (s > size)
+        s = size;
+    memcpy(output, row, s);
+    for (; s + 16 <= size; s += 16)
+        _mm_stream_si128((__m128i*)(output + s), _mm_loadu_si128((const __m128i*)(row + s)));
+    memcpy(output + s, row + s, size - s);
+    _mm_sfence();
+}
+
+/* The AVX2 versions run the SSE algorithm in both 128-bit lanes, each lane
+ * handles its own block of 16 pixels. */
+
+AVX2_TARGET static inline __m256i avx2_broadcast(__m128i v)
+{
+    return _mm256_broadcastsi128_si256(v);
+}
+
+/* Load 64 bytes, such that each lane gets a consecutive 32 byte block */
+AVX2_TARGET static inline void avx2_load_blocks(const unsigned char *p, __m256i *a, __m256i *b)
+{
+    *a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                 _mm_loadu_si128((const __m128i*)(p + 32)), 1);
+    *b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 16))),
+                                 _mm_loadu_si128((const __m128i*)(p + 48)), 1);
+}
+
+/* Store the 3 registers of each lane as 48 consecutive bytes */
+AVX2_TARGET static inline void avx2_store_rgb(unsigned char *rgb, __m256i o0, __m256i o1, __m256i o2)
+{
+    _mm_storeu_si128((__m128i*)rgb, _mm256_castsi256_si128(o0));
+    _mm_storeu_si128((__m128i*)(rgb + 16), _mm256_castsi256_si128(o1));
+    _mm_storeu_si128((__m128i*)(rgb + 32), _mm256_castsi256_si128(o2));
+    _mm_storeu_si128((__m128i*)(rgb + 48), _mm256_extracti128_si256(o0, 1));
+    _mm_storeu_si128((__m128i*)(rgb + 64), _mm256_extracti128_si256(o1, 1));
+    _mm_storeu_si128((__m128i*)(rgb + 80), _mm256_extracti128_si256(o2, 1));
+}
+
+AVX2_TARGET static inline __m256i avx2_contrast(__m256i x)
+{
+    const __m256i ymask = _mm256_set1_epi16(0x00FF);
+    __m256i t = _mm256_subs_epu8(x, _mm256_set1_epi8(64));
+    t = _mm256_adds_epu8(t, t);
+    return _mm256_or_si256(_mm256_and_si256(t, ymask), _mm256_andnot_si256(ymask, x));
+}
+
+AVX2_TARGET static inline __m256i avx2_ge_level(__m256i x, __m128i threshold, __m128i level)
+{
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(x, avx2_broadcast(threshold)), x);
+    return _mm256_and_si256(ge, avx2_broadcast(level));
+}
+
+AVX2_TARGET static inline __m256i avx2_thd(__m256i x)
+{
+    __m256i r = _mm256_setzero_si256();
+    for (int i = 0; i < 4; ++i)
+        r = _mm256_max_epu8(r, avx2_ge_level(x,
+                sse_pair(thd_thresholds[THD_Y][i], thd_thresholds[THD_UV][i]),
+                sse_pair(thd_levels[THD_Y][i], thd_levels[THD_UV][i])));
+    return r;
+}
+
+/* 32 pixels, see avx2_load_blocks for the layout of a and b */
+AVX2_TARGET static inline void avx2_split(__m256i a, __m256i b, __m256i *y, __m256i *uv)
+{
+    const __m256i split = avx2_broadcast(_mm_setr_epi8(YUYV_SPLIT_MASK));
+    a = _mm256_shuffle_epi8(a, split);
+    b = _mm256_shuffle_epi8(b, split);
+    *y = _mm256_unpacklo_epi64(a, b);
+    *uv = _mm256_unpackhi_epi64(a, b);
+    *uv = _mm256_shuffle_epi32(*uv, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/* Each lane through sse_store_rgb, for the formats other than RGB888 */
+template <unsigned int Format>
+AVX2_TARGET static inline void avx2_store_lanes(__m256i r, __m256i g, __m256i b, unsigned char *rgb)
+{
+    sse_store_rgb<Format>(_mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b), rgb);
+    sse_store_rgb<Format>(_mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1),
+                          rgb + 16 * pixel_bytes(Format));
+}
+
+template <unsigned int Format>
+AVX2_TARGET static inline void avx2_yuv_torgb(__m256i y, __m256i uv, unsigned char *rgb)
+{
+    if (Format == VIDEO_OUTPUT_GRAY8)
+    {
+        avx2_store_lanes<Format>(y, y, y, rgb);
+        return;
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bias = _mm256_set1_epi16(0x80);
+    __m256i u = _mm256_sub_epi16(_mm256_unpacklo_epi8(uv, zero), bias);
+    __m256i v = _mm256_sub_epi16(_mm256_unpackhi_epi8(uv, zero), bias);
+
+    __m256i v45 = _mm256_mullo_epi16(v, _mm256_set1_epi16(45));
+    __m256i rr = _mm256_srai_epi16(v45, 5);
+    __m256i gg = _mm256_sub_epi16(zero, _mm256_srai_epi16(_mm256_add_epi16(v45, _mm256_mullo_epi16(u, _mm256_set1_epi16(22))), 6));
+    __m256i bb = _mm256_srai_epi16(_mm256_mullo_epi16(u, _mm256_set1_epi16(111)), 6);
+
+    __m256i ylo = _mm256_unpacklo_epi8(y, zero);
+    __m256i yhi = _mm256_unpackhi_epi8(y, zero);
+    __m256i r = _mm256_packus_epi16(_mm256_add_epi16(ylo, _mm256_unpacklo_epi16(rr, rr)), _mm256_add_epi16(yhi, _mm256_unpackhi_epi16(rr, rr)));
+    __m256i g = _mm256_packus_epi16(_mm256_add_epi16(ylo, _mm256_unpacklo_epi16(gg, gg)), _mm256_add_epi16(yhi, _mm256_unpackhi_epi16(gg, gg)));
+    __m256i bl = _mm256_packus_epi16(_mm256_add_epi16(ylo, _mm256_unpacklo_epi16(bb, bb)), _mm256_add_epi16(yhi, _mm256_unpackhi_epi16(bb, bb)));
+
+    if (Format != VIDEO_OUTPUT_RGB888)
+    {
+        avx2_store_lanes<Format>(r, g, bl, rgb);
+        return;
+    }
+    avx2_store_rgb(rgb,
+        _mm256_or_si256(_mm256_or_si256(
+            _mm256_shuffle_epi8(r, avx2_broadcast(_mm_setr_epi8(RGB_MASK_R0))),
+            _mm256_shuffle_epi8(g, avx2_broadcast(_mm_setr_epi8(RGB_MASK_G0)))),
+            _mm256_shuffle_epi8(bl, avx2_broadcast(_mm_setr_epi8(RGB_MASK_B0)))),
+        _mm256_or_si256(_mm256_or_si256(
+            _mm256_shuffle_epi8(r, avx2_broadcast(_mm_setr_epi8(RGB_MASK_R1))),
+            _mm256_shuffle_epi8(g, avx2_broadcast(_mm_setr_epi8(RGB_MASK_G1)))),
+            _mm256_shuffle_epi8(bl, avx2_broadcast(_mm_setr_epi8(RGB_MASK_B1)))),
+        _mm256_or_si256(_mm256_or_si256(
+            _mm256_shuffle_epi8(r, avx2_broadcast(_mm_setr_epi8(RGB_MASK_R2))),
+            _mm256_shuffle_epi8(g, avx2_broadcast(_mm_setr_epi8(RGB_MASK_G2)))),
+            _mm256_shuffle_epi8(bl, avx2_broadcast(_mm_setr_epi8(RGB_MASK_B2)))));
+}
+
+template <unsigned int Format>
+AVX2_TARGET static inline void avx2_torgb(__m256i a, __m256i b, unsigned char *rgb)
+{
+    __m256i y, uv;
+    avx2_split(a, b, &y, &uv);
+    avx2_yuv_torgb<Format>(y, uv, rgb);
+}
+
+template <unsigned int Format>
+AVX2_TARGET static inline void avx2_torgb_gray(__m256i a, __m256i b, unsigned char *rgb)
+{
+    const __m256i split = avx2_broadcast(_mm_setr_epi8(YUYV_SPLIT_MASK));
+    __m256i y = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(a, split), _mm256_shuffle_epi8(b, split));
+    if (Format != VIDEO_OUTPUT_RGB888)
+    {
+        avx2_store_lanes<Format>(y, y, y, rgb);
+        return;
+    }
+    avx2_store_rgb(rgb,
+        _mm256_shuffle_epi8(y, avx2_broadcast(_mm_setr_epi8(GRAY_MASK_0))),
+        _mm256_shuffle_epi8(y, avx2_broadcast(_mm_setr_epi8(GRAY_MASK_1))),
+        _mm256_shuffle_epi8(y, avx2_broadcast(_mm_setr_epi8(GRAY_MASK_2))));
+}
+
+template <unsigned int Flags, unsigned int Format>
+AVX2_TARGET static void fused_row_avx2(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 6;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m256i a, b;
+        avx2_load_blocks(p, &a, &b);
+        if (Flags & SOFTWARE_FLAG_CONTRAST) {
+            a = avx2_contrast(a);
+            b = avx2_contrast(b);
+        }
+        if (Flags & SOFTWARE_FLAG_THD) {
+            a = avx2_thd(a);
+            b = avx2_thd(b);
+        }
+        if (Flags & SOFTWARE_FLAG_GRAY)
+            avx2_torgb_gray<Format>(a, b, rgb_buffer);
+        else
+            avx2_torgb<Format>(a, b, rgb_buffer);
+        p += 64;
+        rgb_buffer += 32 * pixel_bytes(Format);
+    }
+    fused_row_sse<Flags, Format>(p, size - (blocks << 6), rgb_buffer);
+}
+
+/* See sse_lookup, the table rows are the same for both lanes */
+AVX2_TARGET static inline __m256i avx2_lookup(const unsigned char *table, __m256i x)
+{
+    const __m256i offset = _mm256_set1_epi8(0x70);
+    __m256i r = _mm256_setzero_si256();
+    for (int row = 0; row < 16; ++row)
+    {
+        __m256i index = _mm256_adds_epu8(_mm256_xor_si256(x, _mm256_set1_epi8((char)(row << 4))), offset);
+        r = _mm256_or_si256(r, _mm256_shuffle_epi8(avx2_broadcast(_mm_loadu_si128((const __m128i*)(table + (row << 4)))), index));
+    }
+    return r;
+}
+
+template <unsigned int Format>
+AVX2_TARGET static void lookup_row_avx2(const VideoLookupTables *tables, const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 6;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        __m256i a, b, y, uv;
+        avx2_load_blocks(p, &a, &b);
+        avx2_split(a, b, &y, &uv);
+        avx2_yuv_torgb<Format>(avx2_lookup(tables->y, y), Format == VIDEO_OUTPUT_GRAY8 ? uv : avx2_lookup(tables->uv, uv), rgb_buffer);
+        p += 64;
+        rgb_buffer += 32 * pixel_bytes(Format);
+    }
+    lookup_row_sse<Format>(tables, p, size - (blocks << 6), rgb_buffer);
+}
+
+#endif /* VIDEO_KERNELS_X86 */
+
+#ifdef VIDEO_KERNELS_NEON
+
+/* NEON loads the pixels de-interleaved into Y-even, U, Y-odd and V, so the
+ * filters can use the same constants for all lanes. */
+
+static inline uint8x8_t neon_contrast(uint8x8_t y)
+{
+    uint8x8_t t = vqsub_u8(y, vdup_n_u8(64));
+    return vqadd_u8(t, t);
+}
+
+static inline uint8x8_t neon_level(uint8x8_t x, unsigned char threshold, unsigned char level)
+{
+    return vand_u8(vcge_u8(x, vdup_n_u8(threshold)), vdup_n_u8(level));
+}
+
+static inline uint8x8_t neon_thd(uint8x8_t y)
+{
+    uint8x8_t r = neon_level(y, 32, 63);
+    r = vmax_u8(r, neon_level(y, 96, 127));
+    r = vmax_u8(r, neon_level(y, 160, 191));
+    r = vmax_u8(r, neon_level(y, 224, 255));
+    return r;
+}
+
+static inline uint8x8_t neon_thdc(uint8x8_t uv)
+{
+    return vmax_u8(neon_level(uv, 0x60, 0x80), neon_level(uv, 0xA1, 0xFF));
+}
+
+/* Interleave even and odd pixels again */
+static inline uint8x16_t neon_zip(uint8x8_t even, uint8x8_t odd)
+{
+    uint8x8x2_t z = vzip_u8(even, odd);
+    return vcombine_u8(z.val[0], z.val[1]);
+}
+
+/* Add the chroma term to the even and odd Y and interleave them */
+static inline uint8x16_t neon_rgb_channel(int16x8_t y_even, int16x8_t y_odd, int16x8_t c)
+{
+    return neon_zip(vqmovun_s16(vaddq_s16(y_even, c)), vqmovun_s16(vaddq_s16(y_odd, c)));
+}
+
+/* Store 16 pixels, R G B in rgb.val[0..2]. Gray output takes G. */
+template <unsigned int Format>
+static inline void neon_store_rgb(const uint8x16x3_t &rgb, unsigned char *output)
+{
+    if (Format == VIDEO_OUTPUT_RGB32)
+    {
+        uint8x16x4_t bgra;
+        bgra.val[0] = rgb.val[2];
+        bgra.val[1] = rgb.val[1];
+        bgra.val[2] = rgb.val[0];
+        bgra.val[3] = vdupq_n_u8(0xFF);
+        vst4q_u8(output, bgra);
+    }
+    else if (Format == VIDEO_OUTPUT_RGB565)
+    {
+        /* Shift each channel into the top of a 16-bit lane, and insert
+         * the next one right behind it */
+        uint16x8_t lo = vshll_n_u8(vget_low_u8(rgb.val[0]), 8);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(rgb.val[1]), 8), 5);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(rgb.val[2]), 8), 11);
+        uint16x8_t hi = vshll_n_u8(vget_high_u8(rgb.val[0]), 8);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(rgb.val[1]), 8), 5);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(rgb.val[2]), 8), 11);
+        vst1q_u16((uint16_t*)output, lo);
+        vst1q_u16((uint16_t*)(output + 16), hi);
+    }
+    else if (Format == VIDEO_OUTPUT_GRAY8)
+    {
+        vst1q_u8(output, rgb.val[1]);
+    }
+    else
+    {
+        vst3q_u8(output, rgb);
+    }
+}
+
+/* Convert 16 pixels into the output format */
+template <unsigned int Format>
+static inline void neon_torgb(const uint8x8x4_t &yuyv, unsigned char *rgb)
+{
+    if (Format == VIDEO_OUTPUT_GRAY8)
+    {
+        vst1q_u8(rgb, neon_zip(yuyv.val[0], yuyv.val[2]));
+        return;
+    }
+
+    const uint8x8_t bias = vdup_n_u8(0x80);
+    int16x8_t y_even = vreinterpretq_s16_u16(vmovl_u8(yuyv.val[0]));
+    int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(yuyv.val[1], bias));
+    int16x8_t y_odd = vreinterpretq_s16_u16(vmovl_u8(yuyv.val[2]));
+    int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(yuyv.val[3], bias));
+
+    int16x8_t v45 = vmulq_n_s16(v, 45);
+    int16x8_t rr = vshrq_n_s16(v45, 5);
+    int16x8_t gg = vnegq_s16(vshrq_n_s16(vaddq_s16(v45, vmulq_n_s16(u, 22)), 6));
+    int16x8_t bb = vshrq_n_s16(vmulq_n_s16(u, 111), 6);
+
+    uint8x16x3_t out;
+    out.val[0] = neon_rgb_channel(y_even, y_odd, rr);
+    out.val[1] = neon_rgb_channel(y_even, y_odd, gg);
+    out.val[2] = neon_rgb_channel(y_even, y_odd, bb);
+    neon_store_rgb<Format>(out, rgb);
+}
+
+template <unsigned int Format>
+static inline void neon_torgb_gray(const uint8x8x4_t &yuyv, unsigned char *rgb)
+{
+    uint8x16x3_t out;
+    out.val[0] = neon_zip(yuyv.val[0], yuyv.val[2]);
+    out.val[1] = out.val[0];
+    out.val[2] = out.val[0];
+    neon_store_rgb<Format>(out, rgb);
+}
+
+template <unsigned int Flags, unsigned int Format>
+static inline void neon_fused_block(uint8x8x4_t yuyv, unsigned char *rgb_buffer)
+{
+    if (Flags & SOFTWARE_FLAG_CONTRAST) {
+        yuyv.val[0] = neon_contrast(yuyv.val[0]);
+        yuyv.val[2] = neon_contrast(yuyv.val[2]);
+    }
+    if (Flags & SOFTWARE_FLAG_THD) {
+        yuyv.val[0] = neon_thd(yuyv.val[0]);
+        yuyv.val[1] = neon_thdc(yuyv.val[1]);
+        yuyv.val[2] = neon_thd(yuyv.val[2]);
+        yuyv.val[3] = neon_thdc(yuyv.val[3]);
+    }
+    if (Flags & SOFTWARE_FLAG_GRAY)
+        neon_torgb_gray<Format>(yuyv, rgb_buffer);
+    else
+        neon_torgb<Format>(yuyv, rgb_buffer);
+}
+
+template <unsigned int Flags, unsigned int Format>
+static void fused_row_neon(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 5;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        neon_fused_block<Flags, Format>(vld4_u8(p), rgb_buffer);
+        p += 32;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    fused_row<Flags, Format>(p, size - (blocks << 5), rgb_buffer);
+}
+
+template <unsigned int Flags, unsigned int Format>
+static void fused_row_nv12_neon(const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = width >> 4;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        uint8x8x2_t luma = vld2_u8(y);
+        uint8x8x2_t chroma = vld2_u8(uv);
+        uint8x8x4_t yuyv;
+        yuyv.val[0] = luma.val[0];
+        yuyv.val[1] = chroma.val[0];
+        yuyv.val[2] = luma.val[1];
+        yuyv.val[3] = chroma.val[1];
+        neon_fused_block<Flags, Format>(yuyv, rgb_buffer);
+        y += 16;
+        uv += 16;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    fused_row_nv12<Flags, Format>(y, uv, width - (blocks << 4), rgb_buffer);
+}
+
+/* See laplacian_row_sse, vld2 puts the Y of 8 pixels in val[0] */
+static void laplacian_row_neon(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned int size, unsigned char *output)
+{
+    unsigned int s = 2;
+    laplacian_part(above, row, below, 0, s, size, output);
+    for (; s + 18 <= size; s += 16)
+    {
+        uint16x8_t sum = vaddl_u8(vld2_u8(above + s - 2).val[0], vld2_u8(above + s).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(above + s + 2).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(row + s - 2).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(row + s + 2).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(below + s - 2).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(below + s).val[0]);
+        sum = vaddw_u8(sum, vld2_u8(below + s + 2).val[0]);
+        int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vld2_u8(row + s).val[0], 3)), vreinterpretq_s16_u16(sum));
+        uint8x8x2_t out;
+        out.val[0] = vqmovun_s16(vabsq_s16(v));
+        out.val[1] = vdup_n_u8(0x80);
+        vst2_u8(output + s, out);
+    }
+    laplacian_part(above, row, below, s, size, size, output);
+}
+
+/* Look up 8 bytes in a 256 byte table, 32 entries per vtbx. Subtracting 32
+ * brings the next part of the table in range, lanes that are out of range
+ * keep the value they already found. */
+static inline uint8x8_t neon_lookup(const unsigned char *table, uint8x8_t x)
+{
+    uint8x8_t r = vdup_n_u8(0);
+    for (int part = 0; part < 8; ++part)
+    {
+        uint8x8x4_t t;
+        t.val[0] = vld1_u8(table);
+        t.val[1] = vld1_u8(table + 8);
+        t.val[2] = vld1_u8(table + 16);
+        t.val[3] = vld1_u8(table + 24);
+        r = vtbx4_u8(r, t, x);
+        x = vsub_u8(x, vdup_n_u8(32));
+        table += 32;
+    }
+    return r;
+}
+
+template <unsigned int Format>
+static inline void neon_lookup_block(const VideoLookupTables *tables, uint8x8x4_t yuyv, unsigned char *rgb_buffer)
+{
+    yuyv.val[0] = neon_lookup(tables->y, yuyv.val[0]);
+    yuyv.val[2] = neon_lookup(tables->y, yuyv.val[2]);
+    /* Gray output has no use for the chroma */
+    if (Format != VIDEO_OUTPUT_GRAY8) {
+        yuyv.val[1] = neon_lookup(tables->uv, yuyv.val[1]);
+        yuyv.val[3] = neon_lookup(tables->uv, yuyv.val[3]);
+    }
+    neon_torgb<Format>(yuyv, rgb_buffer);
+}
+
+template <unsigned int Format>
+static void lookup_row_neon(const VideoLookupTables *tables, const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = size >> 5;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        neon_lookup_block<Format>(tables, vld4_u8(p), rgb_buffer);
+        p += 32;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    lookup_row<Format>(tables, p, size - (blocks << 5), rgb_buffer);
+}
+
+template <unsigned int Format>
+static void lookup_row_nv12_neon(const VideoLookupTables *tables, const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer)
+{
+    unsigned int blocks = width >> 4;
+    for (unsigned int i = 0; i < blocks; ++i)
+    {
+        uint8x8x2_t luma = vld2_u8(y);
+        uint8x8x2_t chroma = vld2_u8(uv);
+        uint8x8x4_t yuyv;
+        yuyv.val[0] = luma.val[0];
+        yuyv.val[1] = chroma.val[0];
+        yuyv.val[2] = luma.val[1];
+        yuyv.val[3] = chroma.val[1];
+        neon_lookup_block<Format>(tables, yuyv, rgb_buffer);
+        y += 16;
+        uv += 16;
+        rgb_buffer += 16 * pixel_bytes(Format);
+    }
+    lookup_row_nv12<Format>(tables, y, uv, width - (blocks << 4), rgb_buffer);
+}
+
+#endif /* VIDEO_KERNELS_NEON */
+
+/*
+ * Runtime selection
+ */
+
+/* One instance of "name" for each combination of SOFTWARE_FLAG_* */
+#define FUSED_ROW_INSTANCES(name) \
+    { name<0>, name<1>, name<2>, name<3>, name<4>, name<5>, name<6>, name<7> }
+#define FORMAT_ROW_INSTANCES(name, format) \
+    { name<0, format>, name<1, format>, name<2, format>, name<3, format>, \
+      name<4, format>, name<5, format>, name<6, format>, name<7, format> }
+/* And for each VideoOutputFormat */
+#define OUTPUT_ROW_INSTANCES(name) \
+    { FORMAT_ROW_INSTANCES(name, VIDEO_OUTPUT_RGB888), FORMAT_ROW_INSTANCES(name, VIDEO_OUTPUT_RGB32), \
+      FORMAT_ROW_INSTANCES(name, VIDEO_OUTPUT_RGB565), FORMAT_ROW_INSTANCES(name, VIDEO_OUTPUT_GRAY8) }
+#define OUTPUT_INSTANCES(name) \
+    { name<VIDEO_OUTPUT_RGB888>, name<VIDEO_OUTPUT_RGB32>, name<VIDEO_OUTPUT_RGB565>, name<VIDEO_OUTPUT_GRAY8> }
+
+struct VideoKernelSet
+{
+    const char *name;
+    VideoRowFunc row[VIDEO_OUTPUT_FORMATS][SOFTWARE_FLAG_COMBINATIONS];
+    VideoNV12RowFunc nv12_row[VIDEO_OUTPUT_FORMATS][SOFTWARE_FLAG_COMBINATIONS];
+    VideoLookupRowFunc lookup_row[VIDEO_OUTPUT_FORMATS];
+    VideoLookupNV12RowFunc lookup_nv12_row[VIDEO_OUTPUT_FORMATS];
+    VideoLaplacianRowFunc laplacian_row;
+    VideoStreamRowFunc stream_row;
+};
+
+static const VideoKernelSet kernels_c =
+    { "C", OUTPUT_ROW_INSTANCES(fused_row), OUTPUT_ROW_INSTANCES(fused_row_nv12),
+      OUTPUT_INSTANCES(lookup_row), OUTPUT_INSTANCES(lookup_row_nv12), laplacian_row, NULL };
+#ifdef VIDEO_KERNELS_X86
+static const VideoKernelSet kernels_sse =
+    { "SSE4.1", OUTPUT_ROW_INSTANCES(fused_row_sse), OUTPUT_ROW_INSTANCES(fused_row_nv12_sse),
+      OUTPUT_INSTANCES(lookup_row_sse), OUTPUT_INSTANCES(lookup_row_nv12_sse), laplacian_row_sse, stream_row_sse };
+/* NV12 already runs at memory speed with SSE */
+static const VideoKernelSet kernels_avx2 =
+    { "AVX2", OUTPUT_ROW_INSTANCES(fused_row_avx2), OUTPUT_ROW_INSTANCES(fused_row_nv12_sse),
+      OUTPUT_INSTANCES(lookup_row_avx2), OUTPUT_INSTANCES(lookup_row_nv12_sse), laplacian_row_sse, stream_row_sse };
+#endif
+#ifdef VIDEO_KERNELS_NEON
+static const VideoKernelSet kernels_neon =
+    { "NEON", OUTPUT_ROW_INSTANCES(fused_row_neon), OUTPUT_ROW_INSTANCES(fused_row_nv12_neon),
+      OUTPUT_INSTANCES(lookup_row_neon), OUTPUT_INSTANCES(lookup_row_nv12_neon), laplacian_row_neon, NULL };
+#endif
+
+static const VideoKernelSet *select_kernels()
+{
+    const char *forced = getenv("VIDEO_KERNELS");
+    if (forced && !strcmp(forced, "c"))
+        return &kernels_c;
+#ifdef VIDEO_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &kernels_avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return &kernels_sse;
+#endif
+#ifdef VIDEO_KERNELS_NEON
+    return &kernels_neon;
+#endif
+    return &kernels_c;
+}
+
+static const VideoKernelSet &kernels()
+{
+    static const VideoKernelSet *selected = select_kernels();
+    return *selected;
+}
+
+unsigned int video_output_bytes(VideoOutputFormat format)
+{
+    return pixel_bytes(format);
+}
+
+VideoRowFunc video_row_kernel(unsigned int flags, VideoOutputFormat format)
+{
+    return kernels().row[format][flags & (SOFTWARE_FLAG_COMBINATIONS - 1)];
+}
+
+VideoNV12RowFunc video_nv12_row_kernel(unsigned int flags, VideoOutputFormat format)
+{
+    return kernels().nv12_row[format][flags & (SOFTWARE_FLAG_COMBINATIONS - 1)];
+}
+
+VideoRowFunc video_filter_kernel(unsigned int flags)
+{
+    static const VideoRowFunc filters[SOFTWARE_FLAG_COMBINATIONS] = FUSED_ROW_INSTANCES(filter_row);
+    return filters[flags & (SOFTWARE_FLAG_COMBINATIONS - 1)];
+}
+
+VideoLaplacianRowFunc video_laplacian_row_kernel()
+{
+    return kernels().laplacian_row;
+}
+
+VideoLookupRowFunc video_lookup_row_kernel(VideoOutputFormat format)
+{
+    return kernels().lookup_row[format];
+}
+
+VideoLookupNV12RowFunc video_lookup_nv12_row_kernel(VideoOutputFormat format)
+{
+    return kernels().lookup_nv12_row[format];
+}
+
+VideoLookupRowFunc video_lookup_filter_kernel()
+{
+    return lookup_filter_row;
+}
+
+VideoStreamRowFunc video_stream_row_kernel()
+{
+    return kernels().stream_row;
+}
+
+/* 64 byte cache lines on both the Cortex-A53 and x86 */
+void video_prefetch_row(const unsigned char *row, unsigned int size)
+{
+    for (unsigned int s = 0; s < size; s += 64)
+        __builtin_prefetch(row + s);
+}
+
+const char *video_kernels_name()
+{
+    return kernels().name;
+}
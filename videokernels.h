@@ -0,0 +1,96 @@
+#ifndef VIDEOKERNELS_H
+#define VIDEOKERNELS_H
+
+/* Pixel processing for the software video path. Input is packed YUYV (two
+ * pixels in 4 bytes) or NV12, output is one of the VideoOutputFormat.
+ *
+ * The filters and the conversion run in a single pass over the row, there
+ * is one specialized kernel for each combination of SOFTWARE_FLAG_* bits.
+ * Each has a plain C reference implementation and SIMD versions (SSE4.1/AVX2
+ * on x86, NEON on ARM). The fastest one the CPU supports is selected at
+ * runtime, all of them produce bit-exact the same output.
+ * Set VIDEO_KERNELS=c in the environment to force the C versions. */
+
+#define SOFTWARE_FLAG_CONTRAST 1
+#define SOFTWARE_FLAG_GRAY 2
+#define SOFTWARE_FLAG_THD 4
+#define SOFTWARE_FLAG_COMBINATIONS 8
+/* The 3x3 Laplacian needs the rows around the pixel, so it runs in a pass
+ * of its own. The flags of the point filters that come after it in the
+ * chain are shifted up by SOFTWARE_FLAG_AFTER_SHIFT. */
+#define SOFTWARE_FLAG_LAPLACIAN 8
+#define SOFTWARE_FLAG_AFTER_SHIFT 4
+#define SOFTWARE_FLAGS_AFTER_LAPLACIAN(flags) (((flags) >> SOFTWARE_FLAG_AFTER_SHIFT) & (SOFTWARE_FLAG_COMBINATIONS - 1))
+
+/* Output pixels, in the memory layout of the QImage format with the same
+ * name on a little endian CPU. GRAY8 is the Y after the filters, for when
+ * the output has no color anyway. */
+enum VideoOutputFormat
+{
+    VIDEO_OUTPUT_RGB888,
+    VIDEO_OUTPUT_RGB32,
+    VIDEO_OUTPUT_RGB565,
+    VIDEO_OUTPUT_GRAY8
+};
+#define VIDEO_OUTPUT_FORMATS 4
+
+unsigned int video_output_bytes(VideoOutputFormat format);
+
+/* Process "size" bytes of YUYV input into the output format */
+typedef void (*VideoRowFunc)(const unsigned char *input, unsigned int size, unsigned char *rgb_buffer);
+
+VideoRowFunc video_row_kernel(unsigned int flags, VideoOutputFormat format = VIDEO_OUTPUT_RGB888);
+
+/* Process "width" NV12 pixels into the output format. "uv" is the
+ * interleaved chroma row that belongs to this row of Y. */
+typedef void (*VideoNV12RowFunc)(const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer);
+
+VideoNV12RowFunc video_nv12_row_kernel(unsigned int flags, VideoOutputFormat format = VIDEO_OUTPUT_RGB888);
+
+/* Only the filters, YUYV to YUYV, to feed hardware that does the
+ * conversion. There's only a C implementation of these. */
+VideoRowFunc video_filter_kernel(unsigned int flags);
+
+/* Edges of the Y in the middle row of three YUYV rows, as YUYV with
+ * neutral chroma. Output must not overlap the input. */
+typedef void (*VideoLaplacianRowFunc)(const unsigned char *above, const unsigned char *row, const unsigned char *below, unsigned int size, unsigned char *output);
+
+VideoLaplacianRowFunc video_laplacian_row_kernel();
+
+/* A chain of point operations compiled into lookup tables, one for Y and
+ * one for U and V, see videopointfilter.h */
+struct VideoLookupTables
+{
+    unsigned char y[256];
+    unsigned char uv[256];
+};
+
+/* Look up YUYV through the tables and convert into the output format in
+ * one pass. The SIMD versions do the lookups with byte shuffles. */
+typedef void (*VideoLookupRowFunc)(const VideoLookupTables *tables, const unsigned char *input, unsigned int size, unsigned char *rgb_buffer);
+typedef void (*VideoLookupNV12RowFunc)(const VideoLookupTables *tables, const unsigned char *y, const unsigned char *uv, unsigned int width, unsigned char *rgb_buffer);
+
+VideoLookupRowFunc video_lookup_row_kernel(VideoOutputFormat format = VIDEO_OUTPUT_RGB888);
+VideoLookupNV12RowFunc video_lookup_nv12_row_kernel(VideoOutputFormat format = VIDEO_OUTPUT_RGB888);
+
+/* The lookup only, YUYV to YUYV, C only like video_filter_kernel */
+VideoLookupRowFunc video_lookup_filter_kernel();
+
+/* Copy a finished output row past the cache, with non-temporal stores.
+ * For frames too big to stay in cache until they are used, the kernels
+ * write a row into a scratch buffer in L1 and this streams it out, which
+ * saves reading the destination into the cache first. NULL when the CPU
+ * has no such stores, or, like the Cortex-A53, switches to streaming by
+ * itself for sequential writes. The row is visible to other threads when
+ * it returns. */
+typedef void (*VideoStreamRowFunc)(unsigned char *output, const unsigned char *row, unsigned int size);
+
+VideoStreamRowFunc video_stream_row_kernel();
+
+/* Start loading "size" bytes at "row" into the cache */
+void video_prefetch_row(const unsigned char *row, unsigned int size);
+
+/* Name of the selected implementation, for diagnostics */
+const char *video_kernels_name();
+
+#endif // VIDEOKERNELS_H
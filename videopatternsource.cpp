@@ -0,0 +1,106 @@
+#include "videopatternsource.h"
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+/* 75% colour bars, BT.601 limited range */
+static const unsigned char bar_colors[8][3] = {
+    {180, 128, 128}, /* White */
+    {162,  44, 142}, /* Yellow */
+    {131, 156,  44}, /* Cyan */
+    {112,  72,  58}, /* Green */
+    { 84, 184, 198}, /* Magenta */
+    { 65, 100, 212}, /* Red */
+    { 35, 212, 114}, /* Blue */
+    { 16, 128, 128}, /* Black */
+};
+
+VideoPatternSource::VideoPatternSource(unsigned int width, unsigned int height, unsigned int format, int fps):
+    PacedVideoSource(width, height, format, fps),
+    frame_count(0)
+{
+}
+
+static void pattern_color(unsigned int kind, unsigned int x, unsigned int width, unsigned char yuv[3])
+{
+    if (kind & 1) /* LINE_RAMP */
+    {
+        yuv[0] = 16 + 219 * x / (width - 1);
+        yuv[1] = 128;
+        yuv[2] = 128;
+    }
+    else
+    {
+        memcpy(yuv, bar_colors[x * 8 / width], 3);
+    }
+    if (kind & 2) /* LINE_INVERTED, stays within 16..235 */
+        yuv[0] = 251 - yuv[0];
+}
+
+int VideoPatternSource::prepare()
+{
+    const unsigned int width = settings.width;
+    const bool nv12 = settings.format == V4L2_PIX_FMT_NV12;
+
+    frame_count = 0;
+    for (unsigned int kind = 0; kind < LINE_KINDS; ++kind)
+    {
+        lines[kind].resize(nv12 ? 2 * width : 4 * width);
+        chroma_lines[kind].resize(nv12 ? 2 * width : 0);
+        for (unsigned int x = 0; x < 2 * width; ++x)
+        {
+            unsigned char yuv[3];
+            unsigned char pair[3];
+            pattern_color(kind, x % width, width, yuv);
+            /* Chroma is shared by a pixel pair */
+            pattern_color(kind, (x & ~1) % width, width, pair);
+            if (nv12)
+            {
+                lines[kind][x] = yuv[0];
+                chroma_lines[kind][x] = pair[(x & 1) ? 2 : 1];
+            }
+            else
+            {
+                lines[kind][2 * x] = yuv[0];
+                lines[kind][2 * x + 1] = pair[(x & 1) ? 2 : 1];
+            }
+        }
+    }
+    return 0;
+}
+
+const void *VideoPatternSource::produce(void *buffer, bool)
+{
+    const unsigned int width = settings.width;
+    const unsigned int height = settings.height;
+    const unsigned int stride = settings.stride;
+    const bool nv12 = settings.format == V4L2_PIX_FMT_NV12;
+    const unsigned int pixel_bytes = nv12 ? 1 : 2;
+    unsigned char *frame = (unsigned char *)buffer;
+
+    /* Moves 4 pixels sideways and 2 lines down per frame */
+    const unsigned int shift = (frame_count * 4) % width;
+    const unsigned int band_height = height / 16 + 1;
+    const unsigned int band_top = (frame_count * 2) % height;
+    ++frame_count;
+
+    for (unsigned int y = 0; y < height; ++y)
+    {
+        unsigned int kind = (y >= height * 3 / 4) ? LINE_RAMP : LINE_BARS;
+        if (y - band_top < band_height)
+            kind |= LINE_INVERTED;
+        memcpy(frame + y * stride, &lines[kind][shift * pixel_bytes], width * pixel_bytes);
+    }
+    if (nv12)
+    {
+        unsigned char *chroma = frame + stride * height;
+        for (unsigned int y = 0; y < height; y += 2)
+        {
+            unsigned int kind = (y >= height * 3 / 4) ? LINE_RAMP : LINE_BARS;
+            if (y - band_top < band_height)
+                kind |= LINE_INVERTED;
+            memcpy(chroma + (y >> 1) * stride, &chroma_lines[kind][shift], width);
+        }
+    }
+    return buffer;
+}
@@ -0,0 +1,27 @@
+#ifndef VIDEOPATTERNSOURCE_H
+#define VIDEOPATTERNSOURCE_H
+
+#include <vector>
+#include "pacedvideosource.h"
+
+/* Colour bars and a grey ramp that scroll sideways, with a band of
+ * inverted luma moving down. Every line is one of a few precomputed
+ * lines, so a frame costs no more than a memcpy per line, even at 4K. */
+class VideoPatternSource: public PacedVideoSource
+{
+public:
+    VideoPatternSource(unsigned int width, unsigned int height, unsigned int format, int fps);
+
+protected:
+    int prepare();
+    const void *produce(void *buffer, bool in_place);
+
+    enum { LINE_BARS = 0, LINE_RAMP = 1, LINE_INVERTED = 2, LINE_KINDS = 4 };
+
+    /* Twice the frame width, so any scroll position is one contiguous copy */
+    std::vector<unsigned char> lines[LINE_KINDS]; /* YUYV, or NV12 luma */
+    std::vector<unsigned char> chroma_lines[LINE_KINDS]; /* NV12 only */
+    unsigned int frame_count;
+};
+
+#endif // VIDEOPATTERNSOURCE_H
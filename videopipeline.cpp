@@ -2,47 +2,140 @@
 
 #include <QDebug>
 #include <QSocketNotifier>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+#include <QGuiApplication>
+#include <QScreen>
+#else
+#include <QApplication>
+#include <QDesktopWidget>
+#endif
+#include <linux/videodev2.h>
+#include <algorithm>
+#include <stdexcept>
 
 #include <dyplo/hardware.hpp>
 #include "dyplocontext.h"
+#include "videokernels.h"
+#include "stripeexecutor.h"
+#include "capturethread.h"
+#include "latencyhistogram.h"
+#include "mjpegdecoder.h"
+#include "videorecorder.h"
+#include "videoresourcepool.h"
+#include "framelender.h"
+#include "videotee.h"
+#include "videocpustage.h"
+#include <vector>
 
 #define VIDEO_FRAMERATE 25
+#define VIDEO_MAX_BUFFERS 32 /* VIDEO_MAX_FRAME in the kernel */
+/* Output frames larger than this won't stay in the cache until they are
+ * painted, so the conversion streams them past it */
+#define VIDEO_STREAM_OUTPUT_SIZE (4 * 1024 * 1024)
 
 static const char BITSTREAM_CAMERA_XRGB[] = "camera_xrgb";
 static const char BITSTREAM_YUVTORGB[] = "yuvtorgb";
 static const char BITSTREAM_FILTER_YUV_GRAY[] = "grayscale";
 static const char BITSTREAM_FILTER_YUV_CONTRAST[] = "contrast";
 static const char BITSTREAM_FILTER_YUV_TRESHOLD[] = "treshold";
+static const char BITSTREAM_FILTER_YUV_LAPLACIAN[] = "laplacian";
 static const char BITSTREAM_FILTER_RGB32_GRAY[] = "rgb_grayscale";
 static const char BITSTREAM_FILTER_RGB32_CONTRAST[] = "rgb_contrast";
 static const char BITSTREAM_FILTER_RGB32_TRESHOLD[] = "rgb_treshold";
 static const char BITSTREAM_FILTER_RGB32_SCALER[] = "halve_resolution";
 
-#define SOFTWARE_FLAG_CONTRAST 1
-#define SOFTWARE_FLAG_GRAY 2
-#define SOFTWARE_FLAG_THD 4
+/* Lends out the blocks of the DMA FIFO from the logic, a block goes back
+ * into the ring when the image on it is gone. Owns the FIFO, so its
+ * memory stays mapped for as long as an image uses it. */
+class DmaFrameLender: public FrameLender
+{
+public:
+    DmaFrameLender(dyplo::HardwareDMAFifo *_fifo):
+        fifo(_fifo)
+    {}
+
+protected:
+    dyplo::HardwareDMAFifo *fifo;
+
+    ~DmaFrameLender()
+    {
+        delete fifo;
+    }
+
+    void giveBack(void *buffer)
+    {
+        if (retired)
+            return;
+        dyplo::HardwareDMAFifo::Block *block = (dyplo::HardwareDMAFifo::Block *)buffer;
+        block->bytes_used = block->size;
+        try
+        {
+            fifo->enqueue(block);
+        }
+        catch (const std::exception& ex)
+        {
+            qWarning() << "Failed to return DMA block:" << ex.what();
+        }
+    }
+};
+
+/* VIDEO_TEE=N gives the software path a second output for the full
+ * resolution frames, N of them can wait for the consumer. When that is
+ * full, VIDEO_TEE_DROP_POLICY=newest keeps the waiting frames, default is
+ * to keep the freshest. */
+static VideoTeeBranch *createTee(QObject *parent)
+{
+    const char *env = getenv("VIDEO_TEE");
+    if (!env || !*env)
+        return NULL;
+    int depth = atoi(env);
+    if (depth < 1)
+        depth = 1;
+    const char *policy = getenv("VIDEO_TEE_DROP_POLICY");
+    if (policy && !strcmp(policy, "newest"))
+        return new VideoTeeBranch(depth, VideoTeeBranch::DropNewest, parent);
+    return new VideoTeeBranch(depth, VideoTeeBranch::DropOldest, parent);
+}
 
-VideoPipeline::VideoPipeline():
+VideoPipeline::VideoPipeline(VideoResourcePool *_pool, unsigned int _index):
+    pool(_pool),
+    index(_index),
+    captureThread(NULL),
     captureNotifier(NULL),
     fromLogicNotifier(NULL),
-    rgb_buffer(NULL),
+    toLogicNotifier(NULL),
+    source(NULL),
+    rgb_lender(NULL),
+    tee(NULL),
     to_logic(NULL),
     from_logic(NULL),
-    yuv2rgb(NULL),
-    filterScaler(NULL),
-    filterContrast(NULL),
-    filterTreshold(NULL),
-    filterGrayscale(NULL),
-    ioCamera(NULL),
+    from_lender(NULL),
+    dyplo(NULL),
     software_flags(0),
-    yuv_buffer(NULL),
-    outputformat(QImage::Format_RGB888)
+    use_lookup(false),
+    relinking(false),
+    relink_flags(0),
+    relink_skipped(0),
+    recrop_skipped(0),
+    to_logic_blocks(2),
+    from_logic_blocks(3),
+    zero_copy(false),
+    fit_viewport(false),
+    outputformat(QImage::Format_RGB888),
+    executor(NULL),
+    mjpeg(NULL),
+    recorder(NULL)
 {
+    pool->join(this);
+    look.parse(getenv("VIDEO_LOOK"));
+    tee = createTee(this);
 }
 
 VideoPipeline::~VideoPipeline()
 {
     deactivate_impl();
+    delete executor;
+    pool->leave(this);
 }
 
 static void startCameraStream()
@@ -63,45 +156,179 @@ static void startCameraStream()
 
 static const bool always_use_scaler = true;
 
-int VideoPipeline::openIOCamera(DyploContext *dyplo, int width, int height, bool filterContr, bool filterGray, bool filterThd)
+/* The stages a video pipeline is built from. Each has a bitstream for the
+ * YUYV stream from a V4L2 camera, one for the RGB32 stream of the IO
+ * camera, and a software kernel flag. */
+struct VideoStage
+{
+    const char *name;
+    const char *yuv_bitstream;
+    const char *rgb_bitstream;
+    unsigned int software_flag;
+};
+
+enum { STAGE_CONTRAST, STAGE_GRAY, STAGE_THD, STAGE_LAPLACIAN, STAGE_SCALE, STAGE_YUV2RGB, STAGE_COUNT };
+
+static const VideoStage video_stages[STAGE_COUNT] = {
+    { "contrast", BITSTREAM_FILTER_YUV_CONTRAST, BITSTREAM_FILTER_RGB32_CONTRAST, SOFTWARE_FLAG_CONTRAST },
+    { "gray", BITSTREAM_FILTER_YUV_GRAY, BITSTREAM_FILTER_RGB32_GRAY, SOFTWARE_FLAG_GRAY },
+    { "thd", BITSTREAM_FILTER_YUV_TRESHOLD, BITSTREAM_FILTER_RGB32_TRESHOLD, SOFTWARE_FLAG_THD },
+    { "laplacian", BITSTREAM_FILTER_YUV_LAPLACIAN, NULL, SOFTWARE_FLAG_LAPLACIAN },
+    { "scale", NULL, BITSTREAM_FILTER_RGB32_SCALER, 0 },
+    { "yuv2rgb", BITSTREAM_YUVTORGB, NULL, 0 },
+};
+
+/* Put the filters selected in the GUI in front, unless "stages" already
+ * has them */
+static void addSelectedFilters(bool filterContr, bool filterGray, bool filterThd, VideoStageList *stages)
+{
+    const bool selected[] = { filterContr, filterGray, filterThd };
+    const unsigned int filters[] = { STAGE_CONTRAST, STAGE_GRAY, STAGE_THD };
+    VideoStageList::iterator position = stages->begin();
+    for (unsigned int i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i)
+    {
+        const VideoStage *stage = &video_stages[filters[i]];
+        if (selected[i] && std::find(stages->begin(), stages->end(), stage) == stages->end())
+            position = stages->insert(position, stage) + 1;
+    }
+}
+
+/* The stages from VIDEO_PIPELINE, e.g. "contrast|laplacian|yuv2rgb", with
+ * the filters selected in the GUI in front of them. The GUI cannot remove
+ * the stages that VIDEO_PIPELINE has, so toggling a filter while the video
+ * runs keeps them. The output must be RGB, so the conversion is always the
+ * last stage. */
+static bool videoStages(bool filterContr, bool filterGray, bool filterThd, VideoStageList *stages)
+{
+    const VideoStage *yuv2rgb = &video_stages[STAGE_YUV2RGB];
+    const char *description = getenv("VIDEO_PIPELINE");
+
+    stages->clear();
+
+    for (const char *p = description; p && *p; )
+    {
+        size_t length = strcspn(p, "|");
+        const VideoStage *stage = NULL;
+        for (unsigned int i = 0; i < STAGE_COUNT; ++i)
+        {
+            if (strlen(video_stages[i].name) == length && !strncmp(video_stages[i].name, p, length))
+                stage = &video_stages[i];
+        }
+        if (!stage || (stage == yuv2rgb && p[length]))
+        {
+            qWarning() << "Invalid VIDEO_PIPELINE" << description;
+            return false;
+        }
+        stages->push_back(stage);
+        p += length;
+        if (*p)
+            ++p;
+    }
+    if (stages->empty() || stages->back() != yuv2rgb)
+        stages->push_back(yuv2rgb);
+    addSelectedFilters(filterContr, filterGray, filterThd, stages);
+    return true;
+}
+
+/* Load a bitstream into a free PR region, throws when there is none */
+dyplo::HardwareConfig *VideoPipeline::createNode(DyploContext *dyplo, const char *bitstream)
+{
+    dyplo::HardwareConfig *node = dyplo->createConfig(bitstream);
+    nodes.push_back(VideoNode(node, bitstream));
+    return node;
+}
+
+/* Route the output of "tailnode" into "node", which becomes the new tail */
+static int routeNode(DyploContext *dyplo, int tailnode, dyplo::HardwareConfig *node)
+{
+    int id = node->getNodeIndex();
+    dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
+    return id;
+}
+
+/* Route "tailnode" through all nodes in the list, returns the new tail */
+static int routeNodes(DyploContext *dyplo, int tailnode, const VideoNodeList &list)
+{
+    for (VideoNodeList::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        if (it->cpu)
+            tailnode = it->cpu->route(tailnode);
+        else
+            tailnode = routeNode(dyplo, tailnode, it->config);
+    }
+    return tailnode;
+}
+
+/* The number of PR regions in the list */
+static unsigned int regionCount(const VideoNodeList &list)
+{
+    unsigned int count = 0;
+    for (VideoNodeList::const_iterator it = list.begin(); it != list.end(); ++it)
+        if (it->config)
+            ++count;
+    return count;
+}
+
+/* Enable from the tail back to the head, so no node receives data before
+ * the next one is ready for it */
+void VideoPipeline::enableNodes()
 {
+    for (VideoNodeList::reverse_iterator it = nodes.rbegin(); it != nodes.rend(); ++it)
+    {
+        if (it->cpu)
+            it->cpu->start(QThread::HighPriority);
+        else
+            it->config->enableNode();
+    }
+}
+
+int VideoPipeline::openIOCamera(DyploContext *dyplo, int width, int height, const VideoStageList &stages)
+{
+    /* There's no CPU pass for a look, the V4L2 camera takes it */
+    if (!look.isEmpty())
+        return -1;
+
+    /* The camera, a node per filter and a DMA channel */
+    unsigned int regions = 1;
+    for (VideoStageList::const_iterator it = stages.begin(); it != stages.end(); ++it)
+    {
+        if ((*it)->rgb_bitstream && *it != &video_stages[STAGE_SCALE])
+            ++regions;
+        else if (!(*it)->rgb_bitstream && *it != &video_stages[STAGE_YUV2RGB])
+            return -1; /* No RGB32 version of this stage */
+    }
+    if (regions > pool->quota(this, VideoResourcePool::PR_REGION) ||
+        pool->quota(this, VideoResourcePool::DMA_CHANNEL) < 1)
+        return -1;
+    if (!pool->claimDevice(this, BITSTREAM_CAMERA_XRGB))
+        return -1;
+
     try
     {
-        ioCamera = dyplo->createConfig(BITSTREAM_CAMERA_XRGB);
+        dyplo::HardwareConfig *camera = createNode(dyplo, BITSTREAM_CAMERA_XRGB);
 
         /* Hardcoded settings */
         update_rgb_settings(1920, 1080);
 
-        int tailnode = ioCamera->getNodeIndex();
-        ioCamera->disableNode();
-        ioCamera->resetWriteFifos(0xf);
+        int tailnode = camera->getNodeIndex();
+        camera->disableNode();
+        camera->resetWriteFifos(0xf);
 
-        if (filterContr) {
-            filterContrast = dyplo->createConfig(BITSTREAM_FILTER_RGB32_CONTRAST);
-            int id = filterContrast->getNodeIndex();
-            dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-            tailnode = id;
-        }
-        if (filterGray) {
-            filterGrayscale = dyplo->createConfig(BITSTREAM_FILTER_RGB32_GRAY);
-            int id = filterGrayscale->getNodeIndex();
-            dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-            tailnode = id;
-        }
-        if (filterThd) {
-            filterTreshold = dyplo->createConfig(BITSTREAM_FILTER_RGB32_TRESHOLD);
-            int id = filterTreshold->getNodeIndex();
-            dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-            tailnode = id;
+        /* The frames only reach the CPU at the end, so all stages must
+         * run in logic. The camera delivers RGB, no conversion needed. */
+        bool scale = always_use_scaler || (width <= 1000 && height <= 600);
+        for (VideoStageList::const_iterator it = stages.begin(); it != stages.end(); ++it)
+        {
+            if (*it == &video_stages[STAGE_SCALE])
+                scale = true;
+            else if ((*it)->rgb_bitstream)
+                tailnode = routeNode(dyplo, tailnode, createNode(dyplo, (*it)->rgb_bitstream));
         }
         /* Apply scaler if convenient for the target size, a few pixels border is acceptable to us */
-        if (always_use_scaler || (width <= 1000 && height <= 600))
+        if (scale)
         {
             try {
-                filterScaler = dyplo->createConfig(BITSTREAM_FILTER_RGB32_SCALER);
-                int id = filterScaler->getNodeIndex();
-                dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-                tailnode = id;
+                tailnode = routeNode(dyplo, tailnode, createNode(dyplo, BITSTREAM_FILTER_RGB32_SCALER));
                 update_rgb_settings(settings.width / 2, settings.height / 2);
             }
             catch (const std::exception& ex)
@@ -111,7 +338,9 @@ int VideoPipeline::openIOCamera(DyploContext *dyplo, int width, int height, bool
         }
 
         from_logic = dyplo->createDMAFifo(O_RDONLY);
+        from_lender = new DmaFrameLender(from_logic);
         from_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, rgb_size, 3, true);
+        from_logic_stats.reset(from_logic->count());
         from_logic->addRouteFrom(tailnode);
         /* Prime reader */
         for (unsigned int i = 0; i < from_logic->count(); ++i)
@@ -125,15 +354,9 @@ int VideoPipeline::openIOCamera(DyploContext *dyplo, int width, int height, bool
         connect(fromLogicNotifier, SIGNAL(activated(int)), this, SLOT(frameAvailableDyplo(int)));
         fromLogicNotifier->setEnabled(true);
 
-        if (filterTreshold)
-            filterTreshold->enableNode();
-        if (filterGrayscale)
-            filterGrayscale->enableNode();
-        if (filterContr)
-            filterContrast->enableNode();
-        if (filterScaler)
-            filterScaler->enableNode();
-        ioCamera->enableNode();
+        enableNodes();
+        pool->setUsed(this, VideoResourcePool::PR_REGION, nodes.size());
+        pool->setUsed(this, VideoResourcePool::DMA_CHANNEL, 1);
     }
     catch (const std::exception& ex)
     {
@@ -147,64 +370,389 @@ int VideoPipeline::openIOCamera(DyploContext *dyplo, int width, int height, bool
     return 0;
 }
 
+static dyplo::HardwareConfig *findNode(const VideoNodeList &list, const char *name)
+{
+    for (VideoNodeList::const_iterator it = list.begin(); it != list.end(); ++it)
+        if (it->name == name)
+            return it->config;
+    return NULL;
+}
 
-int VideoPipeline::openCaptureDevice(int width, int height)
+static bool containsNode(const VideoNodeList &list, dyplo::HardwareConfig *node)
 {
-    int r;
-    char dev[16];
+    for (VideoNodeList::const_iterator it = list.begin(); it != list.end(); ++it)
+        if (it->config == node)
+            return true;
+    return false;
+}
 
-    /* Walk downwards so we prefer the last addition to the system */
-    for (int index = 9; index >= 0; --index)
+/* Delete the nodes in "list" that "in_use" doesn't have. The CPU node
+ * stages are never shared. */
+static void deleteUnusedNodes(const VideoNodeList &list, const VideoNodeList &in_use)
+{
+    for (VideoNodeList::const_iterator it = list.begin(); it != list.end(); ++it)
     {
-        snprintf(dev, sizeof(dev), "/dev/video%d", index);
-        r = capture.open(dev);
-        if (r < 0)
-            continue;
+        if (it->cpu)
+            delete it->cpu;
+        else if (!containsNode(in_use, it->config))
+            delete it->config;
+    }
+}
 
-        r = capture.setup(width, height, VIDEO_FRAMERATE, &settings);
-        if (r < 0) {
-            qDebug() << "Failed to configure video capture device" << dev;
+/* Stages that a CPU node can run in between stages in logic. The
+ * Laplacian needs whole rows and frames, which the FIFO stream has no
+ * notion of. */
+static bool cpuNodeStage(const VideoStage *stage)
+{
+    return stage->software_flag && stage->software_flag != SOFTWARE_FLAG_LAPLACIAN;
+}
+
+/* Load the stages for the V4L2 camera into PR regions where possible,
+ * nodes that are already in use are taken over. Only the stages after the
+ * last one that must run on the CPU go into logic. A second trip from the
+ * CPU through the logic would cost more than it saves, and all stages in
+ * front of the logic run in a single software pass anyway. Point filters
+ * without a bitstream in between stages in logic are the exception, they
+ * run on a CPU node that the logic routes through, see VideoCpuStage.
+ * Returns the index of the first stage that runs in logic, "placed"
+ * receives the nodes for the stages from there on. The pool limits the
+ * number of nodes, so only the last stages are tried. */
+unsigned int VideoPipeline::placeStages(const VideoStageList &stages, VideoNodeList *placed)
+{
+    placed->clear();
+
+    /* The software scaler only feeds the software conversion */
+    for (unsigned int i = 0; i < stages.size(); ++i)
+        if (stages[i] == &video_stages[STAGE_SCALE])
+            return stages.size();
+
+    unsigned int quota = pool->quota(this, VideoResourcePool::PR_REGION);
+    unsigned int start = stages.size() > quota ? stages.size() - quota : 0;
+
+    /* Create filters in the order they'll be used. This improves backplane usage */
+    std::vector<dyplo::HardwareConfig *> configs(stages.size(), (dyplo::HardwareConfig *)NULL);
+    for (unsigned int i = start; i < stages.size(); ++i)
+    {
+        configs[i] = findNode(nodes, stages[i]->yuv_bitstream);
+        if (configs[i])
             continue;
+        try
+        {
+            configs[i] = dyplo->createConfig(stages[i]->yuv_bitstream);
         }
-        if ((int)settings.height > height)
+        catch (const std::exception& ex)
         {
-            crop_top = (settings.height - height) / 2;
-            crop_height = height;
+            qDebug() << "No logic for" << stages[i]->name << ex.what();
         }
-        else
+    }
+
+    unsigned int first = stages.size();
+    while (first > 0 && configs[first - 1])
+        --first;
+
+    /* A run of missing stages with logic on both sides goes on a CPU node,
+     * keyed by the first stage of the run */
+    std::vector<VideoCpuStage *> hosts(stages.size(), (VideoCpuStage *)NULL);
+    while (first < stages.size())
+    {
+        unsigned int gap = first;
+        while (gap > 0 && !configs[gap - 1] && cpuNodeStage(stages[gap - 1]))
+            --gap;
+        if (gap == first || gap == 0 || !configs[gap - 1])
+            break;
+        unsigned int flags = 0;
+        for (unsigned int i = gap; i < first; ++i)
+            flags |= stages[i]->software_flag;
+        try
         {
-            crop_top = 0;
-            crop_height = settings.height;
+            hosts[gap] = new VideoCpuStage(dyplo, flags);
         }
-        if ((int)settings.width > width + 32) /* Only when worth the effort */
+        catch (const std::exception& ex)
+        {
+            qDebug() << "No CPU node for" << stages[gap]->name << ex.what();
+            break;
+        }
+        first = gap - 1;
+        while (first > 0 && configs[first - 1])
+            --first;
+    }
+
+    for (unsigned int i = 0; i < stages.size(); ++i)
+    {
+        if (hosts[i])
+            placed->push_back(VideoNode(hosts[i], stages[i]->name));
+        else if (i >= first && configs[i])
+            placed->push_back(VideoNode(configs[i], stages[i]->yuv_bitstream));
+        else if (configs[i] && !containsNode(nodes, configs[i]))
+            delete configs[i];
+    }
+    return first;
+}
+
+/* Software kernel flags for the stages that run on the CPU. The point
+ * filters are fused into one pass, except for the ones after the
+ * Laplacian. */
+static unsigned int softwareStageFlags(const VideoStageList &stages, unsigned int first_hardware)
+{
+    unsigned int flags = 0;
+    unsigned int shift = 0;
+    for (unsigned int i = 0; i < first_hardware; ++i)
+    {
+        if (stages[i]->software_flag == SOFTWARE_FLAG_LAPLACIAN)
         {
-            crop_left = (settings.width - width) / 2;
-            /* Align on multiple of 4 pixels */
-            crop_left &= ~3;
-            crop_width = ((unsigned int)(width + 3) >> 2) << 2;
+            flags |= SOFTWARE_FLAG_LAPLACIAN;
+            shift = SOFTWARE_FLAG_AFTER_SHIFT;
         }
         else
         {
-            crop_left = 0;
-            crop_width = settings.width;
+            flags |= stages[i]->software_flag << shift;
         }
-        update_buffer_sizes();
+    }
+    return flags;
+}
 
-        r = capture.start();
-        if (r < 0) {
-            qDebug() << "Failed to start video capture device" << dev;
-            continue;
-        }
+static void logStages(const VideoStageList &stages, unsigned int first_hardware, const VideoNodeList &placed)
+{
+    QString plan;
+    for (unsigned int i = 0; i < stages.size(); ++i)
+    {
+        const char *where = "cpu";
+        if (i >= first_hardware)
+            where = findNode(placed, stages[i]->yuv_bitstream) ? "logic" : "cpu node";
+        plan += QString(" %1(%2)").arg(stages[i]->name).arg(where);
+    }
+    qDebug() << "Video stages:" << plan;
+}
+
+/* VIDEO_CAPTURE_BUFFERS sets the number of driver buffers, default 4 */
+static unsigned int captureBufferCount()
+{
+    const char *env = getenv("VIDEO_CAPTURE_BUFFERS");
+    if (!env)
+        return 4;
+    unsigned int count = strtoul(env, NULL, 0);
+    if (count < 2)
+        count = 2;
+    if (count > VIDEO_MAX_BUFFERS)
+        count = VIDEO_MAX_BUFFERS;
+    return count;
+}
+
+/* Capture formats each path can handle, cheapest first. The logic only
+ * takes YUYV. The software filters work on YUV, so MJPEG is only an option
+ * when there's nothing to filter. */
+static const unsigned int formats_hardware[] = { V4L2_PIX_FMT_YUYV };
+static const unsigned int formats_software[] = { V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV };
+static const unsigned int formats_software_unfiltered[] = { V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG };
+static const unsigned int MAX_DMA_BLOCKS = 8;
+
+/* VIDEO_DMA_BLOCKS fixes the number of blocks in the DMA FIFOs to and
+ * from the logic. Without it, the count is tuned from one run to the next. */
+static unsigned int dmaBlockCount()
+{
+    const char *env = getenv("VIDEO_DMA_BLOCKS");
+    if (!env || !*env)
+        return 0;
+    int count = atoi(env);
+    if (count < 2)
+        return 2;
+    if (count > (int)MAX_DMA_BLOCKS)
+        return MAX_DMA_BLOCKS;
+    return count;
+}
+
+/* The software scaler and the Laplacian read YUYV */
+static const unsigned int formats_scaled[] = { V4L2_PIX_FMT_YUYV };
+
+/* Negotiate a format with the source and work out how to crop it, "name"
+ * is for the log. Returns 0 when the source can feed the pipeline. */
+int VideoPipeline::configureSource(const char *name, int width, int height, const unsigned int *formats, unsigned int count)
+{
+    int r;
 
-        /* Found one that works */
+    source->set_buffer_count(captureBufferCount());
+
+    VideoCaptureFormat format;
+    if (source->negotiate(width, height, VIDEO_FRAMERATE, formats, count, &format) < 0)
+    {
+        /* Cannot enumerate, all paths handle YUYV */
+        format.format = V4L2_PIX_FMT_YUYV;
+        format.width = width;
+        format.height = height;
+    }
+    r = source->setup(format.width, format.height, VIDEO_FRAMERATE, format.format, &settings);
+    if (r < 0) {
+        qDebug() << "Failed to configure video capture device" << name;
+        return -1;
+    }
+    if (settings.format != format.format) {
+        qDebug() << "Video capture device" << name << "does not support the format";
+        return -1;
+    }
+    if (fit_viewport && scaler.setup(settings.width, settings.height, width, height))
+    {
+        /* The scaler takes the whole frame */
+        centerCrop(settings.width, settings.height);
+        if (scaler.boxFactor())
+            qDebug() << "Software scaler" << scaler.boxFactor() << "x box to" << scaler.width() << "x" << scaler.height();
+        else
+            qDebug() << "Software scaler bilinear to" << scaler.width() << "x" << scaler.height();
         return 0;
     }
+    /* Prefer the driver to crop, it saves transferring pixels that
+     * would be thrown away. What remains is cropped in software. */
+    {
+        unsigned int want_width = ((unsigned int)(width + 3) >> 2) << 2;
+        unsigned int want_height = height;
+        if (want_width > settings.width)
+            want_width = settings.width;
+        if (want_height > settings.height)
+            want_height = settings.height;
+        if (want_width < settings.width || want_height < settings.height)
+        {
+            r = source->crop(want_width, want_height, &settings);
+            if (r < 0)
+                qDebug() << "Video capture device" << name << "cannot crop:" << -r;
+        }
+    }
+    centerCrop(width, height);
+
+    /* Found one that works, activate() allocates the buffers and starts it */
+    return 0;
+}
+
+/* Crop the center width x height of the captured frame in software, or
+ * all of it when it is smaller */
+void VideoPipeline::centerCrop(int width, int height)
+{
+    if ((int)settings.height > height)
+    {
+        crop_top = (settings.height - height) / 2;
+        /* NV12 chroma rows cover two lines */
+        if (settings.format == V4L2_PIX_FMT_NV12)
+            crop_top &= ~1;
+        crop_height = height;
+    }
+    else
+    {
+        crop_top = 0;
+        crop_height = settings.height;
+    }
+    if ((int)settings.width > width + 32) /* Only when worth the effort */
+    {
+        crop_left = (settings.width - width) / 2;
+        /* Align on multiple of 4 pixels */
+        crop_left &= ~3;
+        crop_width = ((unsigned int)(width + 3) >> 2) << 2;
+    }
+    else
+    {
+        crop_left = 0;
+        crop_width = settings.width;
+    }
+    update_buffer_sizes();
+}
+
+int VideoPipeline::openCaptureDevice(int width, int height, const unsigned int *formats, unsigned int count)
+{
+    int r;
+    char dev[16];
+
+    /* A file or test pattern instead of a camera */
+    source = createVideoSource();
+    if (source)
+    {
+        if (configureSource("VIDEO_SOURCE", width, height, formats, count) == 0)
+            return 0;
+        delete source;
+        source = NULL;
+        return -1;
+    }
+
+    /* Walk downwards so we prefer the last addition to the system */
+    for (int index = 9; index >= 0; --index)
+    {
+        snprintf(dev, sizeof(dev), "/dev/video%d", index);
+        /* Another pipeline may have it */
+        if (!pool->claimDevice(this, dev))
+            continue;
+        r = capture.open(dev);
+        if (r < 0)
+            continue;
+        source = &capture;
+        if (configureSource(dev, width, height, formats, count) == 0)
+            return 0;
+    }
 
     /* Failure */
+    pool->releaseDevice(this);
+    source = NULL;
     return -1;
 }
 
 
+/* VIDEO_SCALE=fit shows the whole camera frame scaled down to the viewport
+ * in the software path, instead of cropping the center */
+static bool softwareScaling()
+{
+    const char *env = getenv("VIDEO_SCALE");
+    return env && !strcmp(env, "fit");
+}
+
+/* VIDEO_DROP_POLICY=newest processes every frame in capture order and
+ * drops newly captured ones when the processing falls behind. Default is
+ * to process the freshest frame and drop the ones older than that. */
+static CaptureThread::DropPolicy captureDropPolicy()
+{
+    const char *env = getenv("VIDEO_DROP_POLICY");
+    if (env && !strcmp(env, "newest"))
+        return CaptureThread::DropNewest;
+    return CaptureThread::DropOldest;
+}
+
+/* VIDEO_OUTPUT=rgb888, rgb32 or rgb565 sets the pixel format of the
+ * software path. Default is the format of the display, so that painting
+ * the frame needs no conversion. */
+static QImage::Format displayFormat()
+{
+    const char *env = getenv("VIDEO_OUTPUT");
+    if (env && !strcmp(env, "rgb888"))
+        return QImage::Format_RGB888;
+    if (env && !strcmp(env, "rgb32"))
+        return QImage::Format_RGB32;
+    if (env && !strcmp(env, "rgb565"))
+        return QImage::Format_RGB16;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+    QScreen *screen = QGuiApplication::primaryScreen();
+    int depth = screen ? screen->depth() : 0;
+#else
+    int depth = QApplication::desktop()->depth();
+#endif
+    if (depth == 16)
+        return QImage::Format_RGB16;
+    /* A 24 bit display uses 32 bits per pixel */
+    if (depth >= 24)
+        return QImage::Format_RGB32;
+    return QImage::Format_RGB888;
+}
+
+static VideoOutputFormat kernelFormat(QImage::Format format)
+{
+    switch (format)
+    {
+    case QImage::Format_RGB32:
+        return VIDEO_OUTPUT_RGB32;
+    case QImage::Format_RGB16:
+        return VIDEO_OUTPUT_RGB565;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    case QImage::Format_Grayscale8:
+        return VIDEO_OUTPUT_GRAY8;
+#endif
+    default:
+        return VIDEO_OUTPUT_RGB888;
+    }
+}
+
 int VideoPipeline::activate(DyploContext *dyplo, int width, int height, bool hardwareYUV, bool filterContr, bool filterGray, bool filterThd)
 {
     int r;
@@ -212,65 +760,95 @@ int VideoPipeline::activate(DyploContext *dyplo, int width, int height, bool har
     /* Make sure width is a multiple of 4 */
     width &= ~3;
 
-    r = openIOCamera(dyplo, width, height, filterContr, filterGray, filterThd);
+    VideoStageList stages;
+    if (!videoStages(filterContr, filterGray, filterThd, &stages))
+        return -1;
+
+    r = openIOCamera(dyplo, width, height, stages);
     if (r == 0)
     {
         /* We're done */
+        startRecording();
         emit setActive(true);
         return 0;
     }
 
-    r = openCaptureDevice(width, height);
+    unsigned int dma_blocks = dmaBlockCount();
+    if (dma_blocks)
+    {
+        to_logic_blocks = dma_blocks;
+        from_logic_blocks = dma_blocks;
+    }
+
+    /* Stages that didn't fit in logic run on the CPU */
+    this->dyplo = dyplo;
+    unsigned int first_hardware = stages.size();
+    /* One DMA channel to the logic and one back */
+    if (hardwareYUV && pool->quota(this, VideoResourcePool::DMA_CHANNEL) >= 2)
+    {
+        VideoNodeList placed;
+        first_hardware = placeStages(stages, &placed);
+        nodes.swap(placed);
+    }
+    const bool hardware = first_hardware < stages.size();
+    bool scale = false;
+    for (unsigned int i = 0; i < first_hardware; ++i)
+        if (stages[i] == &video_stages[STAGE_SCALE])
+            scale = true;
+    software_flags = softwareStageFlags(stages, first_hardware);
+    compileLookup();
+    logStages(stages, first_hardware, nodes);
+
+    fit_viewport = !hardware && (scale || softwareScaling());
+    /* The logic outputs 24 bit color, the CPU what the display wants */
+    outputformat = hardware ? QImage::Format_RGB888 : softwareOutputFormat();
+    if (hardware)
+        r = openCaptureDevice(width, height, formats_hardware, sizeof(formats_hardware) / sizeof(formats_hardware[0]));
+    else if (fit_viewport || (software_flags & SOFTWARE_FLAG_LAPLACIAN))
+        r = openCaptureDevice(width, height, formats_scaled, sizeof(formats_scaled) / sizeof(formats_scaled[0]));
+    else if (cpuFilters())
+        r = openCaptureDevice(width, height, formats_software, sizeof(formats_software) / sizeof(formats_software[0]));
+    else
+        r = openCaptureDevice(width, height, formats_software_unfiltered, sizeof(formats_software_unfiltered) / sizeof(formats_software_unfiltered[0]));
     if (r) {
         qWarning() << "No capture device available";
+        deactivate_impl();
         return r;
     }
 
-    /* Software camera outputs 24 bit color */
-    outputformat = QImage::Format_RGB888;
+    const char *captureSlot;
 
-    if (hardwareYUV)
+    if (hardware)
     {
         try
         {
-            /* Create filters in the order they'll be used. This improves backplane usage */
             to_logic = dyplo->createDMAFifo(O_RDWR);
-            int tailnode = to_logic->getNodeAndFifoIndex();
-
-            if (filterContr) {
-                filterContrast = dyplo->createConfig(BITSTREAM_FILTER_YUV_CONTRAST);
-                int id = filterContrast->getNodeIndex();
-                dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-                tailnode = id;
-            }
-            if (filterGray) {
-                filterGrayscale = dyplo->createConfig(BITSTREAM_FILTER_YUV_GRAY);
-                int id = filterGrayscale->getNodeIndex();
-                dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-                tailnode = id;
+            int tailnode = routeNodes(dyplo, to_logic->getNodeAndFifoIndex(), nodes);
+            /* With stages on the CPU the frame is copied anyway */
+            zero_copy = !cpuFilters() && setupZeroCopy();
+            if (zero_copy)
+            {
+                /* The whole frame goes through the logic */
+                rgb_size = settings.width * settings.height * 3;
+                qDebug() << "Camera captures directly into DMA buffers";
             }
-            if (filterThd) {
-                filterTreshold = dyplo->createConfig(BITSTREAM_FILTER_YUV_TRESHOLD);
-                int id = filterTreshold->getNodeIndex();
-                dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, id, 0);
-                tailnode = id;
+            else
+            {
+                to_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, yuv_size, to_logic_blocks, false);
+                r = source->init_mmap();
+                if (r < 0)
+                    throw std::runtime_error("Failed to allocate capture buffers");
             }
-            yuv2rgb = dyplo->createConfig(BITSTREAM_YUVTORGB);
-            int headnode = yuv2rgb->getNodeIndex();
-            dyplo->GetHardwareControl().routeAddSingle(tailnode & 0xFF, tailnode >> 8, headnode, 0);
-            tailnode = headnode;
             from_logic = dyplo->createDMAFifo(O_RDONLY);
-            from_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, rgb_size, 2, true);
+            from_lender = new DmaFrameLender(from_logic);
+            from_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, rgb_size, from_logic_blocks, true);
+            to_logic_stats.reset(to_logic->count());
+            from_logic_stats.reset(from_logic->count());
             from_logic->addRouteFrom(tailnode);
-            to_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, yuv_size, 2, false);
             to_logic->fcntl_set_flag(O_NONBLOCK);
-            if (filterTreshold)
-                filterTreshold->enableNode();
-            if (filterGrayscale)
-                filterGrayscale->enableNode();
-            if (filterContr)
-                filterContrast->enableNode();
-            yuv2rgb->enableNode();
+            enableNodes();
+            pool->setUsed(this, VideoResourcePool::PR_REGION, regionCount(nodes));
+            pool->setUsed(this, VideoResourcePool::DMA_CHANNEL, 2);
             /* Prime reader */
             for (unsigned int i = 0; i < from_logic->count(); ++i)
             {
@@ -279,9 +857,17 @@ int VideoPipeline::activate(DyploContext *dyplo, int width, int height, bool har
                 from_logic->enqueue(block);
             }
             from_logic->fcntl_set_flag(O_NONBLOCK);
-            captureNotifier = new QSocketNotifier(capture.device_handle(), QSocketNotifier::Read, this);
-            connect(captureNotifier, SIGNAL(activated(int)), this, SLOT(frameAvailableHard(int)));
-            captureNotifier->setEnabled(true);
+            if (zero_copy)
+            {
+                captureSlot = SLOT(frameAvailableZeroCopy(int));
+                toLogicNotifier = new QSocketNotifier(to_logic->handle, QSocketNotifier::Write, this);
+                connect(toLogicNotifier, SIGNAL(activated(int)), this, SLOT(zeroCopyBlockDone(int)));
+                toLogicNotifier->setEnabled(true);
+            }
+            else
+            {
+                captureSlot = SLOT(frameAvailableHard(int));
+            }
             fromLogicNotifier = new QSocketNotifier(from_logic->handle, QSocketNotifier::Read, this);
             connect(fromLogicNotifier, SIGNAL(activated(int)), this, SLOT(frameAvailableDyplo(int)));
             fromLogicNotifier->setEnabled(true);
@@ -295,41 +881,156 @@ int VideoPipeline::activate(DyploContext *dyplo, int width, int height, bool har
     }
     else
     {
-        software_flags = 0;
-        if (filterContr)
-            software_flags |= SOFTWARE_FLAG_CONTRAST;
-        if (filterGray)
-            software_flags |= SOFTWARE_FLAG_GRAY;
-        if (filterThd)
-            software_flags |= SOFTWARE_FLAG_THD;
-        if (software_flags || crop_width != settings.width)
-            allocYUVbuffer();
-        captureNotifier = new QSocketNotifier(capture.device_handle(), QSocketNotifier::Read, this);
-        connect(captureNotifier, SIGNAL(activated(int)), this, SLOT(frameAvailableSoft(int)));
-        captureNotifier->setEnabled(true);
+        r = source->init_mmap();
+        if (r < 0) {
+            qWarning() << "Failed to allocate capture buffers";
+            deactivate_impl();
+            return r;
+        }
+        if (settings.format == V4L2_PIX_FMT_MJPEG)
+        {
+            mjpeg = new MjpegDecoder(this);
+            connect(mjpeg, SIGNAL(decoded(QImage,qint64)), this, SIGNAL(renderedImage(QImage,qint64)));
+            qDebug() << "Software video decoding MJPEG on" << mjpeg->threadCount() << "threads";
+            captureSlot = SLOT(frameAvailableMjpeg(int));
+        }
+        else
+        {
+            if (!executor)
+                executor = new StripeExecutor();
+            qDebug() << "Software video using" << video_kernels_name() << "kernels on" << executor->threadCount() << "threads";
+            captureSlot = SLOT(frameAvailableSoft(int));
+        }
     }
 
+    r = source->start();
+    if (r < 0) {
+        qWarning() << "Failed to start video capture device";
+        deactivate_impl();
+        return r;
+    }
+
+    /* Frames are dequeued in a separate thread, the notifier tells when
+     * there is a frame for the slot to process */
+    captureThread = new CaptureThread(source, captureDropPolicy());
+    captureThread->start(QThread::HighestPriority);
+    captureNotifier = new QSocketNotifier(captureThread->notify_handle(), QSocketNotifier::Read, this);
+    connect(captureNotifier, SIGNAL(activated(int)), this, captureSlot);
+    captureNotifier->setEnabled(true);
+
+    startRecording();
     emit setActive(true);
     return r;
 }
 
-/* Disable, disconnect and delete a node */
-static void dispose_node(dyplo::HardwareConfig **node_p)
+/* VIDEO_RECORD=<file> writes all rendered frames to a raw video file. The
+ * second and further cameras get their number appended to the name, like
+ * VIDEO_SHM does. */
+void VideoPipeline::startRecording()
+{
+    const char *env = getenv("VIDEO_RECORD");
+    if (!env || !*env)
+        return;
+    QByteArray filename = env;
+    if (index)
+        filename += QByteArray::number(index);
+    recorder = new VideoRecorder(this);
+    int r = recorder->open(filename.constData());
+    if (r < 0)
+    {
+        qWarning() << "Cannot record to" << filename << ":" << -r;
+        delete recorder;
+        recorder = NULL;
+        return;
+    }
+    /* With a tee, the recorder is the consumer of the full resolution
+     * branch, it copies the frames as soon as they are there */
+    if (tee && captureNotifier && !to_logic && !mjpeg)
+    {
+        connect(tee, SIGNAL(frameReady()), this, SLOT(recordFullFrames()), Qt::UniqueConnection);
+        return;
+    }
+    /* Lent frames hold DMA blocks or capture buffers, keeping those in the
+     * disk queue would starve the ring, so the recorder copies them */
+    connect(this, SIGNAL(renderedImage(QImage,qint64)), recorder, SLOT(record(QImage,qint64)), Qt::DirectConnection);
+}
+
+void VideoPipeline::recordFullFrames()
+{
+    QImage image;
+    qint64 timestamp;
+    while (recorder && tee->take(&image, &timestamp))
+        recorder->record(image, timestamp);
+}
+
+/* Let the camera write directly into the DMA blocks that go to the logic.
+ * The DMA engine has no stride or offset, so it always transfers complete
+ * frames, and the crop is applied to the output of the logic instead. */
+bool VideoPipeline::setupZeroCopy()
 {
-    dyplo::HardwareConfig *node = *node_p;
-    if (node)
+    const char *env = getenv("VIDEO_ZERO_COPY");
+    if (env && !strcmp(env, "0"))
+        return false;
+    if (settings.stride != settings.width * 2)
+        return false;
+
+    to_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, settings.size, source->requested_buffer_count(), false);
+    unsigned int count = to_logic->count();
+
+    /* All blocks belong to the camera until it has filled them */
+    std::vector<void *> pointers(count);
+    for (unsigned int i = 0; i < count; ++i)
     {
-        *node_p = NULL;
-        node->deleteRoutes();
-        node->disableNode();
-        delete node;
+        dyplo::HardwareDMAFifo::Block *block = to_logic->dequeue();
+        if (!block || block->id >= count)
+            return false;
+        pointers[block->id] = block->data;
     }
+
+    int r = source->init_userptr(&pointers[0], count, settings.size);
+    if (r < 0)
+    {
+        qDebug() << "Capture device does not accept DMA buffers:" << -r;
+        return false;
+    }
+    return true;
+}
+
+/* Log what went through the DMA FIFOs and size them for the next run.
+ * The blocks stay one frame each, the conversion works on whole frames. */
+void VideoPipeline::reportDmaStats()
+{
+    const bool tune = !dmaBlockCount();
+    if (to_logic)
+    {
+        qDebug() << "DMA to logic:" << to_logic_stats.toString();
+        /* With zero copy, the camera decides */
+        if (tune && !zero_copy)
+            to_logic_blocks = tuneBlockCount(to_logic_stats, 2, MAX_DMA_BLOCKS);
+    }
+    if (from_logic)
+    {
+        qDebug() << "DMA from logic:" << from_logic_stats.toString();
+        /* The IO camera path has its own count */
+        if (tune && to_logic)
+            from_logic_blocks = tuneBlockCount(from_logic_stats, 2, MAX_DMA_BLOCKS);
+    }
+    if (to_logic && (to_logic_blocks != to_logic_stats.blockCount() || from_logic_blocks != from_logic_stats.blockCount()))
+        qDebug() << "Next run uses" << to_logic_blocks << "blocks to logic and" << from_logic_blocks << "from logic";
+}
+
+/* Disable, disconnect and delete a node */
+static void dispose_node(dyplo::HardwareConfig *node)
+{
+    node->deleteRoutes();
+    node->disableNode();
+    delete node;
 }
 
 void VideoPipeline::deactivate()
 {
     deactivate_impl();
-    emit renderedImage(QImage()); /* Render an empty image to clear the video screen */
+    emit renderedImage(QImage(), 0); /* Render an empty image to clear the video screen */
     emit setActive(false);
 }
 
@@ -339,244 +1040,575 @@ void VideoPipeline::deactivate_impl()
     captureNotifier = NULL;
     delete fromLogicNotifier;
     fromLogicNotifier = NULL;
+    delete toLogicNotifier;
+    toLogicNotifier = NULL;
+    delete captureThread;
+    captureThread = NULL;
+    delete mjpeg; /* Waits for decodes in progress */
+    mjpeg = NULL;
+    delete recorder; /* Writes what is still queued */
+    recorder = NULL;
+    if (tee)
+    {
+        if (tee->dropped())
+            qDebug() << "Full resolution output dropped" << tee->dropped() << "frames";
+        tee->clear();
+    }
+    logic_timestamps.clear();
+    discardRelink();
+    pending_viewport = QSize();
+    /* Stop the camera first, it may be writing into the DMA blocks */
+    if (source)
+    {
+        source->close();
+        if (source != &capture)
+            delete source;
+        source = NULL;
+    }
+    reportDmaStats();
+    zero_copy = false;
+    scaler.disable();
     delete to_logic;
     to_logic = NULL;
-    delete from_logic;
+    if (from_lender)
+        from_lender->retire(); /* Deletes from_logic once no image uses it */
+    else
+        delete from_logic;
+    from_lender = NULL;
     from_logic = NULL;
-    dispose_node(&yuv2rgb);
-    dispose_node(&filterScaler);
-    dispose_node(&filterContrast);
-    dispose_node(&filterTreshold);
-    dispose_node(&filterGrayscale);
-    dispose_node(&ioCamera);
-    capture.close();
-    free(yuv_buffer);
-    yuv_buffer = NULL;
-    free(rgb_buffer);
-    rgb_buffer = NULL;
+    for (VideoNodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
+    {
+        if (it->cpu)
+            delete it->cpu;
+        else
+            dispose_node(it->config);
+    }
+    nodes.clear();
+    pool->setUsed(this, VideoResourcePool::PR_REGION, 0);
+    pool->setUsed(this, VideoResourcePool::DMA_CHANNEL, 0);
+    pool->releaseDevice(this);
+    if (rgb_lender)
+        rgb_lender->retire();
+    rgb_lender = NULL;
 }
 
 void VideoPipeline::enumDyploResources(DyploNodeResourceList &list)
 {
-    if (yuv2rgb)
-        list.push_back(DyploNodeResource(yuv2rgb->getNodeIndex(), BITSTREAM_YUVTORGB));
-    if (filterScaler)
-        list.push_back(DyploNodeResource(filterScaler->getNodeIndex(), "scaler"));
-    if (filterContrast)
-        list.push_back(DyploNodeResource(filterContrast->getNodeIndex(), BITSTREAM_FILTER_YUV_CONTRAST));
-    if (filterGrayscale)
-        list.push_back(DyploNodeResource(filterGrayscale->getNodeIndex(), BITSTREAM_FILTER_YUV_GRAY));
-    if (filterTreshold)
-        list.push_back(DyploNodeResource(filterTreshold->getNodeIndex(), BITSTREAM_FILTER_YUV_TRESHOLD));
-    if (ioCamera)
-        list.push_back(DyploNodeResource(ioCamera->getNodeIndex(), BITSTREAM_CAMERA_XRGB));
+    for (VideoNodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
+        list.push_back(DyploNodeResource(it->cpu ? it->cpu->getNodeIndex() : it->config->getNodeIndex(), it->name));
 }
 
-static inline unsigned char thd_process(unsigned char y)
+/* Where the kernels write an output row. With "stream" set they write
+ * into a scratch row that stays in L1, and done() streams it to the frame
+ * with non-temporal stores. */
+class OutputRow
 {
-    if (y < (64 - 32))
-        return 0;
-    if (y < (128 - 32))
-        return 63;
-    if (y < (192 - 32))
-        return 127;
-    if (y < (256 - 32))
-        return 191;
-    return 255;
-}
+public:
+    OutputRow(VideoStreamRowFunc _stream, unsigned int _size):
+        stream(_stream), size(_size), scratch(_stream ? _size : 0)
+    {}
+
+    unsigned char *target(unsigned char *dest) { return stream ? &scratch[0] : dest; }
+    void done(unsigned char *dest)
+    {
+        if (stream)
+            stream(dest, &scratch[0], size);
+    }
+
+protected:
+    VideoStreamRowFunc stream;
+    unsigned int size;
+    std::vector<unsigned char> scratch;
+};
 
-static inline unsigned char thd_processc(unsigned char uv)
+/* Crop, filter and convert a range of rows of a captured frame */
+class SoftwareFrameJob : public StripeExecutor::Job
 {
-    if (uv < 0x60)
-        return 0x00;
-    if (uv > 0xA0)
-        return 0xFF;
-    return 0x80;
-}
+public:
+    const unsigned char *source; /* First pixel of the cropped area */
+    unsigned int source_stride;
+    unsigned int row_bytes; /* YUYV bytes in a cropped row */
+    unsigned char *rgb_buffer;
+    unsigned int output_bytes; /* Per output pixel */
+    VideoRowFunc convert;
+    const VideoLookupTables *tables; /* Replaces "convert" when set */
+    VideoLookupRowFunc lookup;
+    VideoStreamRowFunc stream; /* NULL to write the output in place */
+
+    void processStripe(unsigned int first, unsigned int last)
+    {
+        const unsigned int rgb_stride = (row_bytes >> 1) * output_bytes;
+        OutputRow out(stream, rgb_stride);
+        for (unsigned int y = first; y < last; ++y)
+        {
+            const unsigned char *row = source + y * source_stride;
+            unsigned char *dest = rgb_buffer + y * rgb_stride;
+            if (y + 1 < last)
+                video_prefetch_row(row + source_stride, row_bytes);
+            if (tables)
+                lookup(tables, row, row_bytes, out.target(dest));
+            else
+                convert(row, row_bytes, out.target(dest));
+            out.done(dest);
+        }
+    }
+};
 
-static void thd(const unsigned int *input, unsigned int size, unsigned int *output)
+/* Downscale and convert a range of output rows */
+class ScaledFrameJob : public StripeExecutor::Job
 {
-    size >>= 2;
-    while(size)
+public:
+    const unsigned char *source;
+    unsigned int source_stride;
+    const VideoScaler *scaler;
+    unsigned char *rgb_buffer;
+    unsigned int output_bytes; /* Per output pixel */
+    VideoRowFunc convert;
+    const VideoLookupTables *tables; /* Replaces "convert" when set */
+    VideoLookupRowFunc lookup;
+    VideoStreamRowFunc stream; /* NULL to write the output in place */
+
+    void processStripe(unsigned int first, unsigned int last)
     {
-        const unsigned int yuyv = *input;
-        const unsigned char y0 = (unsigned char) (yuyv & 0x000000FF);
-        const unsigned char u = (unsigned char) ((yuyv & 0x0000FF00) >> 8);
-        const unsigned char y1 = (unsigned char) ((yuyv & 0x00FF0000) >> 16);
-        const unsigned char v = (unsigned char) ((yuyv & 0xFF000000) >> 24);
+        const unsigned int width = scaler->width();
+        const unsigned int rgb_stride = width * output_bytes;
+        /* Small enough to stay in cache between scaling and conversion */
+        std::vector<unsigned char> row(width * 2);
+        OutputRow out(stream, rgb_stride);
+        for (unsigned int y = first; y < last; ++y)
+        {
+            unsigned char *dest = rgb_buffer + y * rgb_stride;
+            if (y + 1 < last)
+                scaler->prefetchRow(source, source_stride, y + 1);
+            scaler->scaleRow(source, source_stride, y, &row[0]);
+            if (tables)
+                lookup(tables, &row[0], width * 2, out.target(dest));
+            else
+                convert(&row[0], width * 2, out.target(dest));
+            out.done(dest);
+        }
+    }
+};
+
+/* Edges in a range of rows, with the point filters before and after. The
+ * Laplacian needs the rows above and below, so the filtered rows go
+ * through a ring of three. Rows come from the crop or the scaler, and come
+ * out in the output format, or as YUYV without "convert". */
+class LaplacianFrameJob : public StripeExecutor::Job
+{
+public:
+    const unsigned char *source; /* First pixel of the cropped area */
+    unsigned int source_stride;
+    const VideoScaler *scaler; /* NULL to crop */
+    unsigned int width;
+    unsigned int height;
+    unsigned char *output;
+    unsigned int output_stride;
+    VideoRowFunc filter;
+    const VideoLookupTables *tables; /* Replaces "filter" when set */
+    VideoLookupRowFunc lookup;
+    VideoLaplacianRowFunc laplacian;
+    VideoRowFunc filter_after; /* Point filters after the edges, in place */
+    VideoRowFunc convert;
+    VideoStreamRowFunc stream; /* NULL to write the output in place */
+
+    void setKernels(unsigned int flags, const VideoLookupTables *lookup_tables, bool rgb, VideoOutputFormat format = VIDEO_OUTPUT_RGB888)
+    {
+        const unsigned int after = SOFTWARE_FLAGS_AFTER_LAPLACIAN(flags);
+        filter = video_filter_kernel(flags);
+        tables = lookup_tables;
+        lookup = video_lookup_filter_kernel();
+        laplacian = video_laplacian_row_kernel();
+        /* The edges have no color, so the gray conversion will do */
+        filter_after = !rgb && after ? video_filter_kernel(after) : NULL;
+        convert = rgb ? video_row_kernel(after | SOFTWARE_FLAG_GRAY, format) : NULL;
+        stream = NULL;
+    }
+
+    void processStripe(unsigned int first, unsigned int last)
+    {
+        const unsigned int row_bytes = width * 2;
+        std::vector<unsigned char> ring(row_bytes * 4);
+        unsigned char *rows[3] = { &ring[0], &ring[row_bytes], &ring[row_bytes * 2] };
+        unsigned char *edges = &ring[row_bytes * 3];
+        OutputRow out(convert ? stream : NULL, output_stride);
+
+        /* The borders repeat the outer rows */
+        loadRow(first ? first - 1 : first, rows[0]);
+        loadRow(first, rows[1]);
+        for (unsigned int y = first; y < last; ++y)
+        {
+            if (y + 2 < height)
+                prefetchRow(y + 2);
+            loadRow(y + 1 < height ? y + 1 : y, rows[2]);
+            unsigned char *dest = convert ? edges : output + y * output_stride;
+            laplacian(rows[0], rows[1], rows[2], row_bytes, dest);
+            if (filter_after)
+                filter_after(dest, row_bytes, dest);
+            if (convert)
+            {
+                convert(dest, row_bytes, out.target(output + y * output_stride));
+                out.done(output + y * output_stride);
+            }
+            unsigned char *oldest = rows[0];
+            rows[0] = rows[1];
+            rows[1] = rows[2];
+            rows[2] = oldest;
+        }
+    }
 
-        *output = thd_process(y0) |
-            (((unsigned int)thd_processc(u)) << 8) |
-            (((unsigned int)thd_process(y1)) << 16) |
-            (((unsigned int)thd_processc(v)) << 24);
+protected:
+    void prefetchRow(unsigned int y)
+    {
+        if (scaler)
+            scaler->prefetchRow(source, source_stride, y);
+        else
+            video_prefetch_row(source + y * source_stride, width * 2);
+    }
 
-        ++output;
-        ++input;
-        --size;
+    void loadRow(unsigned int y, unsigned char *dest)
+    {
+        const unsigned char *row = source + y * source_stride;
+        if (scaler)
+        {
+            scaler->scaleRow(source, source_stride, y, dest);
+            row = dest;
+        }
+        if (tables)
+            lookup(tables, row, width * 2, dest);
+        else
+            filter(row, width * 2, dest);
     }
-}
+};
 
-static inline unsigned char stretch(unsigned char y)
+/* Convert a range of rows of a cropped NV12 frame */
+class NV12FrameJob : public StripeExecutor::Job
 {
-    if (y <= 64)
-        return 0;
-    if (y >= 192)
-        return 255;
-    return (y - 64) << 1;
-}
+public:
+    const unsigned char *luma; /* First pixel of the cropped area */
+    const unsigned char *chroma; /* UV pair for the first pixel */
+    unsigned int stride;
+    unsigned int width;
+    unsigned char *rgb_buffer;
+    unsigned int output_bytes; /* Per output pixel */
+    VideoNV12RowFunc convert;
+    const VideoLookupTables *tables; /* Replaces "convert" when set */
+    VideoLookupNV12RowFunc lookup;
+    VideoStreamRowFunc stream; /* NULL to write the output in place */
+
+    void processStripe(unsigned int first, unsigned int last)
+    {
+        const unsigned int rgb_stride = width * output_bytes;
+        OutputRow out(stream, rgb_stride);
+        for (unsigned int y = first; y < last; ++y)
+        {
+            const unsigned char *y_row = luma + y * stride;
+            const unsigned char *uv_row = chroma + (y >> 1) * stride;
+            unsigned char *dest = rgb_buffer + y * rgb_stride;
+            if (y + 1 < last)
+            {
+                video_prefetch_row(y_row + stride, width);
+                /* The chroma row changes every other row */
+                if (y & 1)
+                    video_prefetch_row(uv_row + stride, width);
+            }
+            if (tables)
+                lookup(tables, y_row, uv_row, width, out.target(dest));
+            else
+                convert(y_row, uv_row, width, out.target(dest));
+            out.done(dest);
+        }
+    }
+};
 
-static void contrast(const unsigned int *input, unsigned int size, unsigned int *output)
+/* Take the next frame from the capture thread */
+bool VideoPipeline::grabFrame(CapturedFrame *frame)
 {
-    size >>= 2;
-    while(size)
+    if (captureThread->take(frame))
+        return true;
+    if (captureThread->error() < 0)
     {
-        const unsigned int yuyv = *input;
-        const unsigned char y0 = (unsigned char) (yuyv & 0x000000FF);
-        const unsigned char y1 = (unsigned char) ((yuyv & 0x00FF0000) >> 16);
-
-        unsigned int y = stretch(y0) | (((unsigned int)stretch(y1)) << 16);
-        *output = (*input & 0xFF00FF00) | y;
-
-        ++output;
-        ++input;
-        --size;
+        qWarning() << "Video capture failed:" << -captureThread->error();
+        deactivate();
     }
+    return false;
 }
 
-static inline unsigned char clamp(short v)
+void VideoPipeline::releaseFrame(const CapturedFrame &frame)
 {
-        if (v > 255)
-                return 255;
-        if (v < 0)
-                return 0;
-        return v;
+    if (captureThread->release(frame) < 0)
+        deactivate();
 }
 
-static void torgb(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
+unsigned int VideoPipeline::droppedFrames() const
 {
-        unsigned int index = 0;
-        unsigned int s;
-
-        for (s = 0; s < size; s += 4) {
-                short y0 = p[s];
-                short u  = p[s+1] - 0x80;
-                short y1 = p[s+2];
-                short v  = p[s+3] - 0x80;
+    unsigned int result = captureThread ? captureThread->dropped() : 0;
+    if (to_logic)
+        result += to_logic_stats.dropped();
+    if (from_logic)
+        result += from_logic_stats.dropped();
+    if (mjpeg)
+        result += mjpeg->dropped();
+    return result;
+}
 
-                short rr = (45 * v) >> 5;
-                short gg = - (((45 * v) + (22 * u)) >> 6);
-                short bb = (111 * u) >> 6;
+static VideoStreamRowFunc streamKernel(unsigned int output_size)
+{
+    return output_size > VIDEO_STREAM_OUTPUT_SIZE ? video_stream_row_kernel() : NULL;
+}
 
-                rgb_buffer[index+0] = clamp(y0 + rr);
-                rgb_buffer[index+1] = clamp(y0 + gg);
-                rgb_buffer[index+2] = clamp(y0 + bb);
-                rgb_buffer[index+3] = clamp(y1 + rr);
-                rgb_buffer[index+4] = clamp(y1 + gg);
-                rgb_buffer[index+5] = clamp(y1 + bb);
+/* Filter and convert the part "area" of a captured frame, or all of it
+ * through "scaler", into "rgb_buffer" in the output format */
+void VideoPipeline::convertFrame(const CapturedFrame &frame, const QRect &area, const VideoScaler *scaler, unsigned char *rgb_buffer)
+{
+    const unsigned char *data = (const unsigned char*)frame.data;
+    const unsigned int left = area.x();
+    const unsigned int top = area.y();
+    const unsigned int width = area.width();
+    const unsigned int height = area.height();
+    const VideoLookupTables *tables = use_lookup ? &lookup : NULL;
+    const VideoOutputFormat format = kernelFormat(outputformat);
+    const unsigned int output_bytes = video_output_bytes(format);
+
+    if (settings.format == V4L2_PIX_FMT_NV12)
+    {
+        /* Full luma plane followed by a half height interleaved UV plane */
+        NV12FrameJob job;
+        job.luma = data + top * settings.stride + left;
+        job.chroma = data + settings.stride * settings.height + (top >> 1) * settings.stride + left;
+        job.stride = settings.stride;
+        job.width = width;
+        job.rgb_buffer = rgb_buffer;
+        job.output_bytes = output_bytes;
+        job.convert = video_nv12_row_kernel(software_flags, format);
+        job.tables = tables;
+        job.lookup = video_lookup_nv12_row_kernel(format);
+        job.stream = streamKernel(height * width * output_bytes);
+
+        /* Per row: 1.5 bytes input and the output per pixel */
+        executor->run(&job, height, executor->rowsPerStripe(height, width * 3 / 2 + width * output_bytes));
+        return;
+    }
 
-                index += 6;
+    /* Cropping is done by reading only the part of each row we need */
+    const unsigned int source_stride = settings.width * 2;
+    const unsigned int offset = top * source_stride + left * 2;
+    /* Don't read beyond what the driver delivered */
+    unsigned int lines = 0;
+    if (frame.bytesused > offset)
+        lines = (frame.bytesused - offset + source_stride - width * 2) / source_stride;
+    if (lines > height)
+        lines = height;
+
+    if (software_flags & SOFTWARE_FLAG_LAPLACIAN)
+    {
+        LaplacianFrameJob job;
+        job.setKernels(software_flags, tables, true, format);
+        unsigned int input_bytes; /* Per output row */
+        if (scaler)
+        {
+            job.source = data;
+            job.source_stride = settings.stride;
+            job.scaler = scaler;
+            job.width = scaler->width();
+            lines = scaler->height();
+            input_bytes = settings.stride * settings.height / lines;
         }
-}
-static void torgb_gray(const unsigned char *p, unsigned int size, unsigned char *rgb_buffer)
-{
-        unsigned int index = 0;
-        unsigned int s;
+        else
+        {
+            job.source = data + offset;
+            job.source_stride = source_stride;
+            job.scaler = NULL;
+            job.width = width;
+            input_bytes = width * 2;
+        }
+        job.height = lines;
+        job.output = rgb_buffer;
+        job.output_stride = job.width * output_bytes;
+        job.stream = streamKernel(lines * job.output_stride);
 
-        for (s = 0; s < size; s += 4) {
-                unsigned char y0 = p[s];
-                unsigned char y1 = p[s+2];
+        executor->run(&job, lines, executor->rowsPerStripe(lines, input_bytes + job.output_stride));
+        return;
+    }
 
-                rgb_buffer[index+0] = y0;
-                rgb_buffer[index+1] = y0;
-                rgb_buffer[index+2] = y0;
-                rgb_buffer[index+3] = y1;
-                rgb_buffer[index+4] = y1;
-                rgb_buffer[index+5] = y1;
+    if (scaler)
+    {
+        ScaledFrameJob job;
+        job.source = data;
+        job.source_stride = settings.stride;
+        job.scaler = scaler;
+        job.rgb_buffer = rgb_buffer;
+        job.output_bytes = output_bytes;
+        job.convert = video_row_kernel(software_flags, format);
+        job.tables = tables;
+        job.lookup = video_lookup_row_kernel(format);
+        job.stream = streamKernel(scaler->height() * scaler->width() * output_bytes);
+
+        /* Per output row: the input rows it covers and the output */
+        const unsigned int rows = scaler->height();
+        executor->run(&job, rows, executor->rowsPerStripe(rows, settings.stride * settings.height / rows + scaler->width() * output_bytes));
+        return;
+    }
 
-                index += 6;
-        }
+    SoftwareFrameJob job;
+    job.source = data + offset;
+    job.source_stride = source_stride;
+    job.row_bytes = width * 2;
+    job.rgb_buffer = rgb_buffer;
+    job.output_bytes = output_bytes;
+    job.convert = video_row_kernel(software_flags, format);
+    job.tables = tables;
+    job.lookup = video_lookup_row_kernel(format);
+    job.stream = streamKernel(lines * width * output_bytes);
+
+    /* Per row: YUYV input and the output */
+    executor->run(&job, lines, executor->rowsPerStripe(lines, job.row_bytes + width * output_bytes));
 }
 
 void VideoPipeline::frameAvailableSoft(int)
 {
     /* Grab a single frame, convert and display */
-    const void* data;
-    unsigned int size;
-    int r;
+    CapturedFrame frame;
+    if (!grabFrame(&frame))
+        return;
+    if (pending_viewport.isValid())
+        applyViewport();
 
-    r = capture.begin_grab(&data, &size);
-    if ( r <= 0) {
-        if (r < 0)
-            deactivate();
+    /* NV12 and the scaler need the whole frame */
+    if (settings.format == V4L2_PIX_FMT_NV12 ?
+            frame.bytesused < settings.stride * settings.height * 3 / 2 :
+            scaler.active() && frame.bytesused < settings.stride * settings.height)
+    {
+        releaseFrame(frame);
         return;
     }
 
-    /* Vertical cropping is easy, just move the pointer */
-    data = (const char*)data + crop_offset;
-    if (size > yuv_size)
-        size = yuv_size;
-
-    if (crop_width != settings.width)
+    if (!rgb_lender)
+        rgb_lender = new BufferFrameLender(rgb_size);
+    unsigned char *rgb_buffer = rgb_lender->take();
+    const VideoScaler *preview_scaler = scaler.active() ? &scaler : NULL;
+    convertFrame(frame, QRect(crop_left, crop_top, crop_width, crop_height), preview_scaler, rgb_buffer);
+    const unsigned int width = preview_scaler ? scaler.width() : crop_width;
+    const unsigned int height = preview_scaler ? scaler.height() : crop_height;
+    const unsigned int output_bytes = video_output_bytes(kernelFormat(outputformat));
+    const QImage preview = rgb_lender->lend(rgb_buffer, rgb_buffer, width, height, width * output_bytes, outputformat);
+    emit renderedImage(preview, frame.timestamp);
+
+    /* The other branch of the tee gets the whole frame. That is the preview
+     * when it isn't cropped or scaled, else it converts the frame again
+     * from the same capture buffer. */
+    if (tee && tee->acceptFrame())
     {
-        unsigned int src_stride = settings.width * 2;
-        unsigned int dst_stride = crop_width * 2;
-        char *dest = (char*)yuv_buffer;
-        for (unsigned int y = 0; y < crop_height; ++y)
+        if (!preview_scaler && crop_width == settings.width && crop_height == settings.height)
         {
-            memcpy(dest, data, dst_stride);
-            dest += dst_stride;
-            data = (const char*)data + src_stride;
+            tee->push(preview, frame.timestamp);
+        }
+        else
+        {
+            const unsigned int full_stride = settings.width * output_bytes;
+            unsigned char *full_buffer = tee->buffer(full_stride * settings.height);
+            convertFrame(frame, QRect(0, 0, settings.width, settings.height), NULL, full_buffer);
+            tee->push(full_buffer, settings.width, settings.height, full_stride, outputformat, frame.timestamp);
         }
-        data = yuv_buffer;
-    }
-
-    if (!rgb_buffer)
-        rgb_buffer = new unsigned char[rgb_size];
-
-    if (software_flags & SOFTWARE_FLAG_CONTRAST) {
-        contrast((const unsigned int*)data, size, yuv_buffer);
-        data = yuv_buffer;
-    }
-    if (software_flags & SOFTWARE_FLAG_THD) {
-        thd((const unsigned int*)data, size, yuv_buffer);
-        data = yuv_buffer;
     }
-    if (software_flags & SOFTWARE_FLAG_GRAY)
-        torgb_gray((const uchar*)data, size, rgb_buffer);
-    else
-        torgb((const uchar*)data, size, rgb_buffer);
 
-    emit renderedImage(QImage(rgb_buffer, crop_width, crop_height, QImage::Format_RGB888));
+    releaseFrame(frame);
+}
 
-    r = capture.end_grab();
-    if (r < 0)
-        deactivate();
+void VideoPipeline::frameAvailableMjpeg(int)
+{
+    /* Hand the compressed frame to the decoder threads, the decoded signal
+     * delivers the image */
+    CapturedFrame frame;
+    if (!grabFrame(&frame))
+        return;
+    mjpeg->decode(frame.data, frame.bytesused, QRect(crop_left, crop_top, crop_width, crop_height), frame.timestamp);
+    releaseFrame(frame);
 }
 
 void VideoPipeline::frameAvailableHard(int)
 {
     /* Grab a single frame and send to Dyplo */
-    const void* data;
-    unsigned int size;
-    int r;
-
-    r = capture.begin_grab(&data, &size);
-    if ( r <= 0) {
-        if (r < 0)
-            deactivate();
+    CapturedFrame frame;
+    if (!grabFrame(&frame))
+        return;
+    if (relinking)
+    {
+        /* Don't feed the logic while its nodes are being swapped */
+        releaseFrame(frame);
+        relinkWhenDrained(true);
         return;
     }
+    if (pending_viewport.isValid())
+    {
+        /* The frames in the logic have the old size, the new crop goes
+         * in once they are out. A lost frame must not stall it. */
+        if (!logic_timestamps.empty() && ++recrop_skipped <= to_logic->count() + from_logic->count())
+        {
+            releaseFrame(frame);
+            return;
+        }
+        applyViewport();
+    }
+    const void* data = frame.data;
+    unsigned int size = frame.bytesused;
     /* crop image vertically */
     data = (const char*)data + crop_offset;
     if (size > yuv_size)
         size = yuv_size;
 
     dyplo::HardwareDMAFifo::Block *block = to_logic->dequeue();
-    if (block)
+    if (!block)
+    {
+        /* The logic hasn't taken the previous frames yet */
+        to_logic_stats.sample(to_logic->count());
+        to_logic_stats.drop();
+    }
+    else
     {
+        /* Frames that went in and have not come out yet */
+        to_logic_stats.sample(logic_timestamps.size());
         block->bytes_used = size;
 
-        if (crop_width != settings.width)
+        if (cpuFilters())
+        {
+            /* Stages in front of the logic, the filter does the crop and copy */
+            VideoRowFunc filter = video_filter_kernel(software_flags);
+            VideoLookupRowFunc lookup_filter = video_lookup_filter_kernel();
+            unsigned int src_stride = settings.width * 2;
+            unsigned int dst_stride = crop_width * 2;
+            unsigned int lines = 0;
+            if (frame.bytesused > crop_offset)
+                lines = (frame.bytesused - crop_offset + src_stride - dst_stride) / src_stride;
+            if (lines > crop_height)
+                lines = crop_height;
+            unsigned char *dest = (unsigned char*)block->data;
+            if (software_flags & SOFTWARE_FLAG_LAPLACIAN)
+            {
+                LaplacianFrameJob job;
+                job.setKernels(software_flags, use_lookup ? &lookup : NULL, false);
+                job.source = (const unsigned char*)data;
+                job.source_stride = src_stride;
+                job.scaler = NULL;
+                job.width = crop_width;
+                job.height = lines;
+                job.output = dest;
+                job.output_stride = dst_stride;
+                job.processStripe(0, lines);
+            }
+            else
+            {
+                for (unsigned int y = 0; y < lines; ++y)
+                {
+                    if (use_lookup)
+                        lookup_filter(&lookup, (const unsigned char*)data + y * src_stride, dst_stride, dest + y * dst_stride);
+                    else
+                        filter((const unsigned char*)data + y * src_stride, dst_stride, dest + y * dst_stride);
+                }
+            }
+            block->bytes_used = lines * dst_stride;
+        }
+        else if (crop_width != settings.width)
         {
             unsigned int src_stride = settings.width * 2;
             unsigned int dst_stride = crop_width * 2;
@@ -593,38 +1625,387 @@ void VideoPipeline::frameAvailableHard(int)
             memcpy(block->data, data, size);
         }
         to_logic->enqueue(block);
+        to_logic_stats.transferred();
+        pushLogicTimestamp(frame.timestamp);
     }
 
-    r = capture.end_grab();
-    if (r < 0)
-        deactivate();
+    releaseFrame(frame);
 }
 
-void VideoPipeline::frameAvailableDyplo(int)
+void VideoPipeline::frameAvailableZeroCopy(int)
 {
-    dyplo::HardwareDMAFifo::Block *block = from_logic->dequeue();
-    if (!block)
+    /* The camera filled one of the DMA blocks, send it to Dyplo. The
+     * block returns to the camera in zeroCopyBlockDone. */
+    CapturedFrame frame;
+    if (!grabFrame(&frame))
         return;
+    if (relinking)
+    {
+        /* Don't feed the logic while its nodes are being swapped */
+        if (source->queue_buffer(frame.index) < 0)
+            deactivate();
+        else
+            relinkWhenDrained(true);
+        return;
+    }
+    /* The blocks hold whole frames, the crop is on the output */
+    if (pending_viewport.isValid())
+        applyViewport();
+
+    dyplo::HardwareDMAFifo::Block *block = to_logic->at(frame.index);
+    block->bytes_used = frame.bytesused;
+    to_logic_stats.sample(logic_timestamps.size());
+    to_logic->enqueue(block);
+    to_logic_stats.transferred();
+    pushLogicTimestamp(frame.timestamp);
+}
+
+/* The logic processes frames in order, so the timestamps of the frames
+ * that went in come out in the same order */
+void VideoPipeline::pushLogicTimestamp(qint64 timestamp)
+{
+    logic_timestamps.push_back(timestamp);
+    /* A frame that got lost in the logic must not shift all later ones */
+    if (logic_timestamps.size() > to_logic->count() + from_logic->count())
+        logic_timestamps.pop_front();
+}
+
+qint64 VideoPipeline::popLogicTimestamp()
+{
+    /* The camera_xrgb path has no capture time, use the time it arrived */
+    if (logic_timestamps.empty())
+        return monotonicMicroseconds();
+    qint64 result = logic_timestamps.front();
+    logic_timestamps.pop_front();
+    return result;
+}
 
-    unsigned int bytes = block->bytes_used;
-    if (bytes >= rgb_size)
+void VideoPipeline::zeroCopyBlockDone(int)
+{
+    /* Dyplo has transferred the block, return it to the camera */
+    for (;;)
     {
+        dyplo::HardwareDMAFifo::Block *block = to_logic->dequeue();
+        if (!block)
+            break;
+        if (source->queue_buffer(block->id) < 0)
+        {
+            deactivate();
+            return;
+        }
+    }
+}
+
+void VideoPipeline::frameAvailableDyplo(int)
+{
+    /* Handle all blocks that are ready */
+    unsigned int ready = 0;
+    for (;;)
+    {
+        dyplo::HardwareDMAFifo::Block *block = from_logic->dequeue();
+        if (!block)
+            break;
+        ++ready;
+        /* Blocks that are out of the ring, this one included */
+        from_logic_stats.sample(from_lender->outstanding() + 1);
+
+        unsigned int bytes = block->bytes_used;
+        qint64 timestamp = popLogicTimestamp();
+        if (bytes < rgb_size)
+        {
+            from_logic_stats.shortBlock();
+            block->bytes_used = rgb_size;
+            from_logic->enqueue(block);
+            continue;
+        }
+
+        const uchar *start = (const uchar*)block->data;
+        unsigned int stride = crop_width * (outputformat == QImage::Format_RGB32 ? 4 : 3);
         unsigned int lines = bytes / crop_width;
+        if (zero_copy)
+        {
+            /* Crop by pointing into the full frame */
+            stride = settings.width * 3;
+            start += crop_top * stride + crop_left * 3;
+        }
         if (lines > crop_height)
             lines = crop_height;
-        emit renderedImage(QImage((const uchar*)block->data, crop_width, lines, outputformat));
+
+        if (from_lender->outstanding() + 2 > from_logic->count())
+        {
+            /* Images hold on to the other blocks, keep one in the ring */
+            emit renderedImage(QImage(start, crop_width, lines, stride, outputformat).copy(), timestamp);
+            block->bytes_used = rgb_size;
+            from_logic->enqueue(block);
+        }
+        else
+        {
+            /* The block returns to the ring when the image is gone */
+            emit renderedImage(from_lender->lend(block, start, crop_width, lines, stride, outputformat), timestamp);
+        }
+    }
+    if (!ready)
+        return;
+    from_logic_stats.transferred(ready);
+
+    if (relinking)
+        relinkWhenDrained(false);
+}
+
+/* Change the filters while the video runs. The software kernels switch at
+ * the next frame. In logic, the new nodes are loaded right away and the
+ * routes are changed once the frames in flight have come out, the frames
+ * captured until then are skipped. Returns -1 when this pipeline cannot
+ * change the filters live and needs to be restarted. */
+int VideoPipeline::setFilters(bool filterContr, bool filterGray, bool filterThd)
+{
+    VideoStageList stages;
+    if (!videoStages(filterContr, filterGray, filterThd, &stages))
+        return -1;
+
+    if (!to_logic)
+    {
+        /* The IO camera streams continuously, MJPEG has no filters */
+        if (from_logic || (captureThread && settings.format == V4L2_PIX_FMT_MJPEG))
+            return -1;
+        software_flags = softwareStageFlags(stages, stages.size());
+        compileLookup();
+        updateOutputFormat();
+        return 0;
+    }
+
+    /* A new change replaces the one that is still waiting */
+    discardRelink();
+
+    VideoNodeList placed;
+    unsigned int first_hardware = placeStages(stages, &placed);
+    unsigned int flags = softwareStageFlags(stages, first_hardware);
+    /* Without the conversion in logic or with a capture straight into the
+     * DMA blocks, it takes a new pipeline */
+    if (first_hardware == stages.size() || (zero_copy && flags))
+    {
+        deleteUnusedNodes(placed, nodes);
+        return -1;
+    }
+    logStages(stages, first_hardware, placed);
+
+    relink_nodes.swap(placed);
+    relink_flags = flags;
+    relink_skipped = 0;
+    relinking = true;
+    return 0;
+}
+
+/* The viewport changed size while the video runs. The crop or the scaler
+ * follows at the next frame, without reopening the camera. The IO camera
+ * and MJPEG keep the size they have. */
+void VideoPipeline::setViewport(int width, int height)
+{
+    if (!isActive() || mjpeg || (from_logic && !to_logic))
+        return;
+    /* Only the last size counts when several come in between frames */
+    pending_viewport = QSize(width & ~3, height);
+}
+
+/* Crop or scale the same capture for the pending viewport. The crop of
+ * the driver stays, so a larger viewport gets at most what the camera
+ * delivers. */
+void VideoPipeline::applyViewport()
+{
+    const int width = pending_viewport.width();
+    const int height = pending_viewport.height();
+    pending_viewport = QSize();
+    recrop_skipped = 0;
+
+    const unsigned int old_top = crop_top;
+    const unsigned int old_left = crop_left;
+    const unsigned int old_width = crop_width;
+    const unsigned int old_height = crop_height;
+    const unsigned int old_rgb_size = rgb_size;
+    qDebug() << "Viewport" << width << "x" << height;
+    if (fit_viewport && scaler.setup(settings.width, settings.height, width, height))
+        centerCrop(settings.width, settings.height);
+    else
+        centerCrop(width, height);
+    if (zero_copy)
+    {
+        /* The blocks from the logic hold the whole frame */
+        rgb_size = settings.width * settings.height * 3;
+        return;
+    }
+    if (rgb_size == old_rgb_size)
+        return;
+    if (to_logic && !resizeDmaBlocks())
+    {
+        crop_top = old_top;
+        crop_left = old_left;
+        crop_width = old_width;
+        crop_height = old_height;
+        update_buffer_sizes();
+        return;
+    }
+    /* The buffers of the old size go once no image uses them */
+    if (rgb_lender)
+        rgb_lender->retire();
+    rgb_lender = NULL;
+}
+
+/* DMA blocks for the new crop, when the logic is empty. The blocks to the
+ * logic are reallocated only when they are too small, a smaller frame uses
+ * part of a block. The blocks from the logic are queued with the old frame
+ * size and may be on screen, so a new FIFO takes over, the old one goes
+ * away with the last image on it. */
+bool VideoPipeline::resizeDmaBlocks()
+{
+    dyplo::HardwareDMAFifo *fifo = NULL;
+    try
+    {
+        if (to_logic->at(0)->size < yuv_size)
+            to_logic->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, yuv_size, to_logic->count(), false);
+        fifo = dyplo->createDMAFifo(O_RDONLY);
+        fifo->reconfigure(dyplo::HardwareDMAFifo::MODE_COHERENT, rgb_size, from_logic_blocks, true);
+        for (unsigned int i = 0; i < fifo->count(); ++i)
+        {
+            dyplo::HardwareDMAFifo::Block *block = fifo->dequeue();
+            block->bytes_used = rgb_size;
+            fifo->enqueue(block);
+        }
+        fifo->fcntl_set_flag(O_NONBLOCK);
+        fifo->addRouteFrom(nodes.back().config->getNodeIndex());
     }
+    catch (const std::exception& ex)
+    {
+        qWarning() << "Cannot resize the DMA blocks, keeping the crop:" << ex.what();
+        delete fifo;
+        return false;
+    }
+
+    delete fromLogicNotifier;
+    from_lender->retire();
+    from_logic = fifo;
+    from_lender = new DmaFrameLender(from_logic);
+    fromLogicNotifier = new QSocketNotifier(from_logic->handle, QSocketNotifier::Read, this);
+    connect(fromLogicNotifier, SIGNAL(activated(int)), this, SLOT(frameAvailableDyplo(int)));
+    fromLogicNotifier->setEnabled(true);
+    return true;
+}
+
+/* Change the point filters while the video runs, the new lookup tables are
+ * used from the next frame on. Returns -1 when the description is invalid,
+ * or when this pipeline has no CPU pass for it and needs to be restarted. */
+int VideoPipeline::setLook(const char *description)
+{
+    if (!look.parse(description))
+        return -1;
+    compileLookup();
+    updateOutputFormat();
+    if (!use_lookup || !isActive())
+        return 0;
+    /* The IO camera, MJPEG and the capture straight into the DMA blocks
+     * don't pass the frames through the CPU */
+    if (!to_logic && !captureThread)
+        return -1;
+    if (settings.format == V4L2_PIX_FMT_MJPEG || zero_copy)
+        return -1;
+    return 0;
+}
+
+/* With a look, the filters on the CPU and the look go through the lookup
+ * tables, in a single pass */
+void VideoPipeline::compileLookup()
+{
+    use_lookup = !look.isEmpty();
+    if (!use_lookup)
+        return;
+    VideoPointFilter chain;
+    chain.setFlags(software_flags);
+    chain.append(look);
+    chain.compile(&lookup);
+}
+
+/* Without color, 8 bit gray holds all there is in a third of the bytes */
+bool VideoPipeline::grayOutput() const
+{
+    /* The edges have no color */
+    if (software_flags & SOFTWARE_FLAG_LAPLACIAN)
+        return true;
+    if (!use_lookup)
+        return software_flags & SOFTWARE_FLAG_GRAY;
+    for (unsigned int i = 0; i < 256; ++i)
+        if (lookup.uv[i] != 0x80)
+            return false;
+    return true;
+}
+
+QImage::Format VideoPipeline::softwareOutputFormat() const
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    if (grayOutput())
+        return QImage::Format_Grayscale8;
+#endif
+    return displayFormat();
+}
+
+/* A filter change in the software path may change the output format, the
+ * buffers of the old one are released as soon as no image uses them */
+void VideoPipeline::updateOutputFormat()
+{
+    if (!captureThread || to_logic || mjpeg)
+        return;
+    QImage::Format format = softwareOutputFormat();
+    if (format == outputformat)
+        return;
+    outputformat = format;
+    update_buffer_sizes();
+    if (rgb_lender)
+        rgb_lender->retire();
+    rgb_lender = NULL;
+}
 
-    block->bytes_used = rgb_size;
-    from_logic->enqueue(block);
+/* Delete the nodes that a pending change loaded */
+void VideoPipeline::discardRelink()
+{
+    deleteUnusedNodes(relink_nodes, nodes);
+    relink_nodes.clear();
+    relinking = false;
 }
 
-void VideoPipeline::allocYUVbuffer()
+void VideoPipeline::relinkWhenDrained(bool skipped)
 {
-    if (!yuv_buffer)
+    if (skipped)
+        ++relink_skipped;
+    /* A frame that got lost in the logic must not stall the change */
+    if (!logic_timestamps.empty() && relink_skipped <= to_logic->count() + from_logic->count())
+        return;
+
+    for (VideoNodeList::iterator it = nodes.begin(); it != nodes.end(); ++it)
     {
-        yuv_buffer = (unsigned int*)malloc(yuv_size);
+        if (it->cpu)
+        {
+            delete it->cpu;
+        }
+        else if (containsNode(relink_nodes, it->config))
+        {
+            it->config->deleteRoutes();
+            it->config->disableNode();
+        }
+        else
+        {
+            dispose_node(it->config);
+        }
     }
+    nodes.swap(relink_nodes);
+    relink_nodes.clear();
+
+    from_logic->addRouteFrom(routeNodes(dyplo, to_logic->getNodeAndFifoIndex(), nodes));
+    enableNodes();
+    pool->setUsed(this, VideoResourcePool::PR_REGION, regionCount(nodes));
+    software_flags = relink_flags;
+    compileLookup();
+    relinking = false;
+    logic_timestamps.clear();
+
+    emit stagesChanged();
 }
 
 void VideoPipeline::update_buffer_sizes()
@@ -632,12 +2013,16 @@ void VideoPipeline::update_buffer_sizes()
     crop_offset = settings.width * crop_top * 2;
     crop_offset += crop_left * 2;
     yuv_size = crop_width * crop_height * 2;
-    rgb_size = crop_width * crop_height * 3;
+    const unsigned int output_bytes = video_output_bytes(kernelFormat(outputformat));
+    if (scaler.active())
+        rgb_size = scaler.width() * scaler.height() * output_bytes;
+    else
+        rgb_size = crop_width * crop_height * output_bytes;
 
     qDebug() << settings.width << "x" << settings.height <<
                 "crop=" << crop_offset << crop_left << crop_top << crop_width << crop_height <<
                 "yuvsize=" << yuv_size <<
-                "rgbsize=" << rgb_size;
+                "rgbsize=" << rgb_size << "format=" << outputformat;
 }
 
 void VideoPipeline::update_rgb_settings(int width, int height)
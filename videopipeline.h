@@ -3,66 +3,162 @@
 
 #include <QObject>
 #include <QImage>
+#include <deque>
+#include <vector>
 #include "video-capture.h"
+#include "videoscaler.h"
+#include "videokernels.h"
+#include "videopointfilter.h"
+#include "dmafifostats.h"
 #include "dyploresources.h"
 
 class QSocketNotifier;
 class DyploContext;
+class StripeExecutor;
+class CaptureThread;
+class MjpegDecoder;
+class VideoRecorder;
+class VideoResourcePool;
+class VideoTeeBranch;
+class VideoCpuStage;
+class BufferFrameLender;
+class DmaFrameLender;
+struct CapturedFrame;
 
 namespace dyplo {
 class HardwareDMAFifo;
 class HardwareConfig;
 }
 
+struct VideoStage;
+typedef std::vector<const VideoStage *> VideoStageList;
+
+/* A PR region in use by the video pipeline, or the software filters on a
+ * CPU node in between two of them, "config" is NULL then */
+struct VideoNode
+{
+    dyplo::HardwareConfig *config;
+    VideoCpuStage *cpu;
+    const char *name;
+
+    VideoNode(dyplo::HardwareConfig *_config, const char *_name):
+        config(_config), cpu(NULL), name(_name)
+    {}
+    VideoNode(VideoCpuStage *_cpu, const char *_name):
+        config(NULL), cpu(_cpu), name(_name)
+    {}
+};
+typedef std::vector<VideoNode> VideoNodeList;
+
 class VideoPipeline: public QObject
 {
     Q_OBJECT
 
 public:
-    VideoPipeline();
+    /* "index" tells the cameras apart, 0 for the first */
+    VideoPipeline(VideoResourcePool *pool, unsigned int index = 0);
     ~VideoPipeline();
 
     int activate(DyploContext* dyplo, int width, int height, bool hardwareYUV, bool filterContrast, bool filterGray, bool filterThd);
     void deactivate();
+    bool isActive() const { return captureThread || from_logic; }
+    int setFilters(bool filterContrast, bool filterGray, bool filterThd);
+    int setLook(const char *description);
+    void setViewport(int width, int height);
 
     void enumDyploResources(DyploNodeResourceList& list);
 
     QSize getVideoSize() const { return QSize(settings.width, settings.height); }
+    unsigned int droppedFrames() const;
+    /* Full resolution frames next to the preview, with VIDEO_TEE set and
+     * the video running in software. NULL without VIDEO_TEE. */
+    VideoTeeBranch *fullFrames() const { return tee; }
 
 signals:
-    void renderedImage(const QImage &image);
+    /* timestamp is the capture time on CLOCK_MONOTONIC in microseconds */
+    void renderedImage(const QImage &image, qint64 timestamp);
     void setActive(bool active);
+    void stagesChanged(); /* Nodes in use have changed */
 
 private slots:
     void frameAvailableSoft(int socket);
+    void frameAvailableMjpeg(int socket);
     void frameAvailableHard(int socket);
     void frameAvailableDyplo(int socket);
+    void frameAvailableZeroCopy(int socket);
+    void zeroCopyBlockDone(int socket);
+    void recordFullFrames();
 
 protected:
-    int openIOCamera(DyploContext *dyplo, int width, int height, bool filterContrast, bool filterGray, bool filterThd);
-    int openCaptureDevice(int width, int height);
+    int openIOCamera(DyploContext *dyplo, int width, int height, const VideoStageList &stages);
+    unsigned int placeStages(const VideoStageList &stages, VideoNodeList *placed);
+    void discardRelink();
+    void compileLookup();
+    bool grayOutput() const;
+    QImage::Format softwareOutputFormat() const;
+    void updateOutputFormat();
+    /* Frames pass through the CPU filters, in software or before the logic */
+    bool cpuFilters() const { return software_flags || use_lookup; }
+    void relinkWhenDrained(bool skipped);
+    void applyViewport();
+    bool resizeDmaBlocks();
+    void centerCrop(int width, int height);
+    dyplo::HardwareConfig *createNode(DyploContext *dyplo, const char *bitstream);
+    void enableNodes();
+    int openCaptureDevice(int width, int height, const unsigned int *formats, unsigned int count);
+    int configureSource(const char *name, int width, int height, const unsigned int *formats, unsigned int count);
     void deactivate_impl();
-    void allocYUVbuffer();
+    bool setupZeroCopy();
+    void startRecording();
+    bool grabFrame(CapturedFrame *frame);
+    void releaseFrame(const CapturedFrame &frame);
+    void convertFrame(const CapturedFrame &frame, const QRect &area, const VideoScaler *scaler, unsigned char *rgb_buffer);
+    void pushLogicTimestamp(qint64 timestamp);
+    qint64 popLogicTimestamp();
+
+    void reportDmaStats();
 
     void update_buffer_sizes();
     void update_rgb_settings(int width, int height);
 
+    VideoResourcePool *pool;
+    unsigned int index;
     VideoCapture capture;
+    CaptureThread* captureThread;
     QSocketNotifier* captureNotifier;
     QSocketNotifier* fromLogicNotifier;
-    unsigned char* rgb_buffer;
+    QSocketNotifier* toLogicNotifier;
+    VideoSource* source; /* Either "capture" or a file or test pattern */
+    BufferFrameLender *rgb_lender; /* Software output */
+    VideoTeeBranch *tee;
 
     dyplo::HardwareDMAFifo *to_logic;
     dyplo::HardwareDMAFifo *from_logic;
-    dyplo::HardwareConfig *yuv2rgb;
-    dyplo::HardwareConfig *filterScaler;
-    dyplo::HardwareConfig *filterContrast;
-    dyplo::HardwareConfig *filterTreshold;
-    dyplo::HardwareConfig *filterGrayscale;
-    dyplo::HardwareConfig *ioCamera;
+    DmaFrameLender *from_lender; /* Owns from_logic */
+    DyploContext *dyplo;
+    VideoNodeList nodes; /* In the order the data flows through them */
 
     unsigned int software_flags;
-    unsigned int* yuv_buffer;
+    VideoPointFilter look; /* From VIDEO_LOOK or setLook() */
+    VideoLookupTables lookup; /* The software_flags and the look */
+    bool use_lookup;
+    /* Filter change waiting for the frames in the logic to come out */
+    bool relinking;
+    VideoNodeList relink_nodes;
+    unsigned int relink_flags;
+    unsigned int relink_skipped;
+    /* New viewport size for the next frame, invalid when there is none */
+    QSize pending_viewport;
+    unsigned int recrop_skipped;
+
+    unsigned int to_logic_blocks;
+    unsigned int from_logic_blocks;
+    DmaFifoStats to_logic_stats;
+    DmaFifoStats from_logic_stats;
+    bool zero_copy; /* Camera captures into the to_logic blocks */
+    bool fit_viewport; /* Scale the frame down instead of cropping */
+    VideoScaler scaler;
+    std::deque<qint64> logic_timestamps; /* Frames in flight in the logic */
     VideoCaptureSettings settings;
     unsigned int yuv_size;
     unsigned int rgb_size;
@@ -74,6 +170,10 @@ protected:
     unsigned int crop_offset; /* in bytes */
 
     enum QImage::Format outputformat;
+
+    StripeExecutor *executor;
+    MjpegDecoder *mjpeg;
+    VideoRecorder *recorder;
 };
 
 #endif // VIDEOPIPELINE_H
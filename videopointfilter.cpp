@@ -0,0 +1,209 @@
+#include "videopointfilter.h"
+#include "videokernels.h"
+
+#include <QDebug>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+VideoPointFilter::VideoPointFilter()
+{
+}
+
+static unsigned char clamp(int v)
+{
+    if (v > 255)
+        return 255;
+    if (v < 0)
+        return 0;
+    return v;
+}
+
+void VideoPointFilter::add(std::vector<Op> *list, Type type, double a, double b)
+{
+    Op op;
+    op.type = type;
+    op.a = a;
+    op.b = b;
+    list->push_back(op);
+}
+
+struct PointOpName
+{
+    const char *name;
+    unsigned int parameters;
+};
+
+/* In the order of VideoPointFilter::Type */
+static const PointOpName point_op_names[] = {
+    { "contrast", 2 },
+    { "gamma", 1 },
+    { "brightness", 1 },
+    { "invert", 0 },
+    { "posterize", 1 },
+    { "threshold", 1 },
+    { "gray", 0 },
+    { "chroma", 2 },
+};
+
+bool VideoPointFilter::parse(const char *description)
+{
+    std::vector<Op> result;
+
+    for (const char *p = description; p && *p; )
+    {
+        size_t length = strcspn(p, "|");
+        size_t name_length = strcspn(p, ":|");
+        int type = -1;
+        for (unsigned int i = 0; i < sizeof(point_op_names) / sizeof(point_op_names[0]); ++i)
+        {
+            if (strlen(point_op_names[i].name) == name_length && !strncmp(point_op_names[i].name, p, name_length))
+                type = i;
+        }
+        if (type < 0)
+        {
+            qWarning() << "Unknown point filter in" << description;
+            return false;
+        }
+        double parameters[2] = { 0, 0 };
+        unsigned int count = 0;
+        const char *end = p + length;
+        const char *q = p + name_length;
+        while (q < end && count < 2)
+        {
+            char *next;
+            parameters[count] = strtod(q + 1, &next);
+            if (next == q + 1 || (next != end && *next != ':'))
+                break;
+            ++count;
+            q = next;
+        }
+        if (count != point_op_names[type].parameters || q != end)
+        {
+            qWarning() << "Invalid parameters for" << point_op_names[type].name << "in" << description;
+            return false;
+        }
+        bool valid = true;
+        switch (type)
+        {
+        case CONTRAST:
+        case CHROMA:
+            valid = parameters[0] < parameters[1];
+            break;
+        case GAMMA:
+            valid = parameters[0] > 0;
+            break;
+        case POSTERIZE:
+            valid = parameters[0] >= 2 && parameters[0] <= 256;
+            break;
+        }
+        if (!valid)
+        {
+            qWarning() << "Out of range parameters for" << point_op_names[type].name << "in" << description;
+            return false;
+        }
+        add(&result, (Type)type, parameters[0], parameters[1]);
+        p = end;
+        if (*p)
+            ++p;
+    }
+
+    ops.swap(result);
+    return true;
+}
+
+void VideoPointFilter::setFlags(unsigned int flags)
+{
+    /* Same order as the fused kernels, the levels match stretch(),
+     * thd_process() and thd_processc() exactly */
+    ops.clear();
+    if (flags & SOFTWARE_FLAG_CONTRAST)
+        add(&ops, CONTRAST, 64, 192);
+    if (flags & SOFTWARE_FLAG_THD)
+    {
+        add(&ops, POSTERIZE, 5);
+        add(&ops, CHROMA, 0x60, 0xA0);
+    }
+    if (flags & SOFTWARE_FLAG_GRAY)
+        add(&ops, GRAY);
+}
+
+void VideoPointFilter::append(const VideoPointFilter &other)
+{
+    ops.insert(ops.end(), other.ops.begin(), other.ops.end());
+}
+
+unsigned char VideoPointFilter::applyY(unsigned char y) const
+{
+    for (std::vector<Op>::const_iterator op = ops.begin(); op != ops.end(); ++op)
+    {
+        switch (op->type)
+        {
+        case CONTRAST:
+            /* The window maps onto 0..256, so 64..192 doubles */
+            y = clamp((int)floor((y - op->a) * 256 / (op->b - op->a)));
+            break;
+        case GAMMA:
+            y = clamp((int)(255 * pow(y / 255.0, 1 / op->a) + 0.5));
+            break;
+        case BRIGHTNESS:
+            y = clamp(y + (int)floor(op->a + 0.5));
+            break;
+        case INVERT:
+            y = 255 - y;
+            break;
+        case POSTERIZE:
+        {
+            /* Nearest of N evenly spaced levels */
+            int steps = (int)op->a - 1;
+            y = ((y * steps + 127) / 255) * 255 / steps;
+            break;
+        }
+        case THRESHOLD:
+            y = y >= op->a ? 255 : 0;
+            break;
+        case GRAY:
+        case CHROMA:
+            break;
+        }
+    }
+    return y;
+}
+
+unsigned char VideoPointFilter::applyUV(unsigned char uv) const
+{
+    for (std::vector<Op>::const_iterator op = ops.begin(); op != ops.end(); ++op)
+    {
+        switch (op->type)
+        {
+        case INVERT:
+            /* Around 0x80, so gray stays gray */
+            uv = clamp(256 - uv);
+            break;
+        case THRESHOLD:
+        case GRAY:
+            uv = 0x80;
+            break;
+        case CHROMA:
+            if (uv < op->a)
+                uv = 0x00;
+            else if (uv > op->b)
+                uv = 0xFF;
+            else
+                uv = 0x80;
+            break;
+        default:
+            break;
+        }
+    }
+    return uv;
+}
+
+void VideoPointFilter::compile(VideoLookupTables *tables) const
+{
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+        tables->y[i] = applyY(i);
+        tables->uv[i] = applyUV(i);
+    }
+}
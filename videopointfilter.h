@@ -0,0 +1,54 @@
+#ifndef VIDEOPOINTFILTER_H
+#define VIDEOPOINTFILTER_H
+
+#include <vector>
+
+struct VideoLookupTables;
+
+/* A chain of point operations, each output pixel only depends on the same
+ * input pixel. The whole chain compiles into a lookup table for Y and one
+ * for U and V, so it costs the same per pixel no matter how long it is.
+ *
+ * The description is a list of operations separated by "|", e.g.
+ * "contrast:32:224|gamma:1.5|posterize:4":
+ *   contrast:LOW:HIGH   stretch LOW..HIGH to the full range
+ *   gamma:G             raise to the power 1/G, G > 1 brightens
+ *   brightness:D        add D to Y, may be negative
+ *   invert              negative image
+ *   posterize:N         N levels of Y
+ *   threshold:T         black below T, white from T on
+ *   gray                no color
+ *   chroma:LOW:HIGH     full color below LOW or above HIGH, none between
+ */
+class VideoPointFilter
+{
+public:
+    VideoPointFilter();
+
+    /* Replaces the chain, returns false and keeps the old one when the
+     * description is invalid. NULL or empty clears it. */
+    bool parse(const char *description);
+    /* The chain that does the same as these SOFTWARE_FLAG_* filters */
+    void setFlags(unsigned int flags);
+    /* Append the operations of "other" */
+    void append(const VideoPointFilter &other);
+
+    bool isEmpty() const { return ops.empty(); }
+    void compile(VideoLookupTables *tables) const;
+
+protected:
+    enum Type { CONTRAST, GAMMA, BRIGHTNESS, INVERT, POSTERIZE, THRESHOLD, GRAY, CHROMA };
+    struct Op
+    {
+        Type type;
+        double a;
+        double b;
+    };
+    std::vector<Op> ops;
+
+    static void add(std::vector<Op> *list, Type type, double a = 0, double b = 0);
+    unsigned char applyY(unsigned char y) const;
+    unsigned char applyUV(unsigned char uv) const;
+};
+
+#endif // VIDEOPOINTFILTER_H
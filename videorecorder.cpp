@@ -0,0 +1,261 @@
+#include "videorecorder.h"
+
+#include <QDebug>
+#include <QThread>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+class VideoRecorder::Writer : public QThread
+{
+public:
+    Writer(VideoRecorder *r): recorder(r) {}
+protected:
+    VideoRecorder *recorder;
+    void run() { recorder->writeChunks(); }
+};
+
+VideoRecorder::VideoRecorder(QObject *parent):
+    QObject(parent),
+    fd(-1),
+    direct(false),
+    stopping(false),
+    write_error(0),
+    writer(NULL),
+    current(NULL),
+    current_used(0),
+    total_bytes(0),
+    width(0),
+    height(0),
+    format(QImage::Format_Invalid),
+    bytes_per_pixel(0),
+    frames(0),
+    dropped_frames(0)
+{
+}
+
+VideoRecorder::~VideoRecorder()
+{
+    close();
+}
+
+int VideoRecorder::open(const char *name)
+{
+    close();
+
+    /* Not all filesystems (tmpfs for one) support O_DIRECT */
+    direct = true;
+    fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+    {
+        direct = false;
+        fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+        return -errno;
+    filename = name;
+
+    for (unsigned int i = 0; i < CHUNK_COUNT; ++i)
+    {
+        void *data;
+        if (posix_memalign(&data, ALIGNMENT, CHUNK_SIZE) != 0)
+        {
+            close();
+            return -ENOMEM;
+        }
+        chunks.push_back((unsigned char *)data);
+        free_chunks.push_back((unsigned char *)data);
+    }
+
+    stopping = false;
+    write_error = 0;
+    frames = 0;
+    dropped_frames = 0;
+    writer = new Writer(this);
+    writer->start();
+    return 0;
+}
+
+void VideoRecorder::close()
+{
+    if (writer)
+    {
+        /* Last partial chunk, O_DIRECT writes it padded */
+        if (current && current_used)
+            queueChunk(current, current_used);
+        current = NULL;
+        {
+            QMutexLocker locker(&lock);
+            stopping = true;
+            wakeup.wakeOne();
+        }
+        writer->wait();
+        delete writer;
+        writer = NULL;
+    }
+    if (fd >= 0)
+    {
+        /* Cut off the padding of the last write */
+        if (direct && ftruncate(fd, total_bytes) < 0)
+            qWarning() << "Failed to truncate" << filename;
+        ::close(fd);
+        fd = -1;
+        if (width)
+            qDebug() << QString("Recorded %1 frames (%2 dropped) to").arg(frames).arg(dropped_frames) << filename;
+    }
+    for (unsigned int i = 0; i < chunks.size(); ++i)
+        free(chunks[i]);
+    chunks.clear();
+    free_chunks.clear();
+    full_chunks.clear();
+    current = NULL;
+    current_used = 0;
+    total_bytes = 0;
+    width = 0;
+    height = 0;
+}
+
+void VideoRecorder::queueChunk(unsigned char *data, unsigned int size)
+{
+    Chunk chunk;
+    chunk.data = data;
+    chunk.size = size;
+    total_bytes += size;
+    QMutexLocker locker(&lock);
+    full_chunks.push_back(chunk);
+    wakeup.wakeOne();
+}
+
+static const char *raw_format_name(QImage::Format format)
+{
+    switch (format)
+    {
+    case QImage::Format_RGB888:
+        return "rgb24";
+    case QImage::Format_RGB32:
+        return "bgr0";
+    case QImage::Format_RGB16:
+        return "rgb565le";
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    case QImage::Format_Grayscale8:
+        return "gray";
+#endif
+    default:
+        return "unknown";
+    }
+}
+
+void VideoRecorder::record(const QImage &image, qint64)
+{
+    if (image.isNull() || fd < 0)
+        return;
+
+    /* The file has no header, so all frames must be alike */
+    if (!width)
+    {
+        width = image.width();
+        height = image.height();
+        format = image.format();
+        bytes_per_pixel = image.depth() / 8;
+        qDebug() << "Recording to" << filename << "play with: ffplay -f rawvideo -pixel_format"
+                 << raw_format_name(format) << "-video_size" << QString("%1x%2").arg(width).arg(height) << filename;
+    }
+    if (image.width() != width || image.height() != height || image.format() != format)
+    {
+        ++dropped_frames;
+        return;
+    }
+
+    const unsigned int row_bytes = width * bytes_per_pixel;
+    const unsigned int frame_bytes = row_bytes * height;
+    {
+        QMutexLocker locker(&lock);
+        if (write_error)
+            return;
+        /* Drop the frame rather than wait for the disk */
+        unsigned long long room = (unsigned long long)free_chunks.size() * CHUNK_SIZE;
+        if (current)
+            room += CHUNK_SIZE - current_used;
+        if (room < frame_bytes)
+        {
+            ++dropped_frames;
+            return;
+        }
+    }
+
+    /* One copy, straight into the buffers that go to disk */
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char *line = image.constScanLine(y);
+        unsigned int remaining = row_bytes;
+        while (remaining)
+        {
+            if (!current)
+            {
+                QMutexLocker locker(&lock);
+                current = free_chunks.front();
+                free_chunks.pop_front();
+                current_used = 0;
+            }
+            unsigned int n = CHUNK_SIZE - current_used;
+            if (n > remaining)
+                n = remaining;
+            memcpy(current + current_used, line, n);
+            current_used += n;
+            line += n;
+            remaining -= n;
+            if (current_used == CHUNK_SIZE)
+            {
+                queueChunk(current, CHUNK_SIZE);
+                current = NULL;
+            }
+        }
+    }
+    ++frames;
+}
+
+/* Runs in the writer thread */
+void VideoRecorder::writeChunks()
+{
+    for (;;)
+    {
+        Chunk chunk;
+        {
+            QMutexLocker locker(&lock);
+            while (full_chunks.empty() && !stopping)
+                wakeup.wait(&lock);
+            if (full_chunks.empty())
+                return;
+            chunk = full_chunks.front();
+            full_chunks.pop_front();
+        }
+
+        unsigned int size = chunk.size;
+        if (direct)
+            size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        unsigned int done = 0;
+        int error = 0;
+        while (done < size)
+        {
+            ssize_t r = ::write(fd, chunk.data + done, size - done);
+            if (r < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                error = errno;
+                break;
+            }
+            done += r;
+        }
+
+        QMutexLocker locker(&lock);
+        free_chunks.push_back(chunk.data);
+        if (error && !write_error)
+        {
+            write_error = error;
+            qWarning() << "Recording to" << filename << "failed:" << error;
+        }
+    }
+}
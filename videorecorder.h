@@ -0,0 +1,77 @@
+#ifndef VIDEORECORDER_H
+#define VIDEORECORDER_H
+
+#include <QObject>
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+#include <deque>
+#include <vector>
+
+/* Writes the rendered frames to a raw video file. The frames are copied
+ * into a few large aligned chunks, a writer thread writes full chunks to
+ * disk with O_DIRECT, so recording doesn't fill the page cache either.
+ * When the disk cannot keep up and no chunk is free, incoming frames are
+ * dropped as a whole. record() never waits for the disk. */
+class VideoRecorder : public QObject
+{
+    Q_OBJECT
+public:
+    VideoRecorder(QObject *parent = 0);
+    ~VideoRecorder(); /* Writes what is still queued */
+
+    int open(const char *filename);
+
+    unsigned int recorded() const { return frames; }
+    unsigned int dropped() const { return dropped_frames; }
+
+public slots:
+    /* Copies the frame before it returns, so a lent frame goes back to
+     * its ring right away instead of waiting for the disk. Connect with a
+     * direct connection. */
+    void record(const QImage &image, qint64 timestamp);
+
+protected:
+    class Writer;
+    friend class Writer;
+
+    enum {
+        CHUNK_SIZE = 4 << 20,
+        CHUNK_COUNT = 8,
+        ALIGNMENT = 4096 /* Satisfies O_DIRECT on any block size */
+    };
+
+    struct Chunk {
+        unsigned char *data;
+        unsigned int size;
+    };
+
+    QString filename;
+    int fd;
+    bool direct;
+    std::vector<unsigned char *> chunks;
+    std::deque<unsigned char *> free_chunks;
+    std::deque<Chunk> full_chunks;
+    QMutex lock;
+    QWaitCondition wakeup;
+    bool stopping;
+    int write_error;
+    Writer *writer;
+
+    /* Only used by the thread calling record() */
+    unsigned char *current;
+    unsigned int current_used;
+    unsigned long long total_bytes;
+    int width;
+    int height;
+    QImage::Format format;
+    unsigned int bytes_per_pixel;
+    unsigned int frames;
+    unsigned int dropped_frames;
+
+    void queueChunk(unsigned char *data, unsigned int size);
+    void writeChunks();
+    void close();
+};
+
+#endif // VIDEORECORDER_H
@@ -0,0 +1,88 @@
+#include "videoresourcepool.h"
+
+VideoResourcePool::VideoResourcePool()
+{
+    for (unsigned int i = 0; i < RESOURCE_COUNT; ++i)
+        totals[i] = 0;
+}
+
+VideoResourcePool::Member *VideoResourcePool::find(const void *owner)
+{
+    for (std::vector<Member>::iterator it = members.begin(); it != members.end(); ++it)
+        if (it->owner == owner)
+            return &(*it);
+    return NULL;
+}
+
+void VideoResourcePool::join(const void *owner)
+{
+    if (find(owner))
+        return;
+    Member member;
+    member.owner = owner;
+    for (unsigned int i = 0; i < RESOURCE_COUNT; ++i)
+        member.used[i] = 0;
+    member.starting = false;
+    members.push_back(member);
+}
+
+void VideoResourcePool::leave(const void *owner)
+{
+    for (std::vector<Member>::iterator it = members.begin(); it != members.end(); ++it)
+    {
+        if (it->owner == owner)
+        {
+            members.erase(it);
+            return;
+        }
+    }
+}
+
+void VideoResourcePool::setStarting(const void *owner, bool starting)
+{
+    Member *member = find(owner);
+    if (member)
+        member->starting = starting;
+}
+
+unsigned int VideoResourcePool::quota(const void *owner, Resource resource) const
+{
+    unsigned int others = 0;
+    unsigned int sharing = 1; /* The owner and the others that start */
+    for (std::vector<Member>::const_iterator it = members.begin(); it != members.end(); ++it)
+    {
+        if (it->owner == owner)
+            continue;
+        others += it->used[resource];
+        if (it->starting)
+            ++sharing;
+    }
+    unsigned int available = others < totals[resource] ? totals[resource] - others : 0;
+    /* Round up, an odd one out goes to whoever asks first */
+    return (available + sharing - 1) / sharing;
+}
+
+void VideoResourcePool::setUsed(const void *owner, Resource resource, unsigned int count)
+{
+    Member *member = find(owner);
+    if (member)
+        member->used[resource] = count;
+}
+
+bool VideoResourcePool::claimDevice(const void *owner, const char *name)
+{
+    for (std::vector<Member>::const_iterator it = members.begin(); it != members.end(); ++it)
+        if (it->owner != owner && it->device == name)
+            return false;
+    Member *member = find(owner);
+    if (member)
+        member->device = name;
+    return true;
+}
+
+void VideoResourcePool::releaseDevice(const void *owner)
+{
+    Member *member = find(owner);
+    if (member)
+        member->device.clear();
+}
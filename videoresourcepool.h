@@ -0,0 +1,56 @@
+#ifndef VIDEORESOURCEPOOL_H
+#define VIDEORESOURCEPOOL_H
+
+#include <QString>
+#include <vector>
+
+/* Shares the PR regions, DMA channels and capture devices between video
+ * pipelines that run at the same time. What the others don't use is split
+ * equally between the pipelines that are starting, so a pipeline may use
+ * more than its share when the others are stopped or run in software. It
+ * only does the bookkeeping, the pipelines still allocate the nodes and
+ * fall back to software when they don't get enough of them. */
+class VideoResourcePool
+{
+public:
+    enum Resource {
+        PR_REGION,
+        DMA_CHANNEL,
+        RESOURCE_COUNT
+    };
+
+    VideoResourcePool();
+
+    void setTotal(Resource resource, unsigned int count) { totals[resource] = count; }
+
+    void join(const void *owner);
+    void leave(const void *owner); /* Releases all the owner holds */
+
+    /* Mark the pipelines that are about to start, so the first one to
+     * start leaves a share for the others */
+    void setStarting(const void *owner, bool starting);
+    /* How many the owner may hold in total, taking into account what the
+     * others already have and the share of those that are starting */
+    unsigned int quota(const void *owner, Resource resource) const;
+    void setUsed(const void *owner, Resource resource, unsigned int count);
+
+    /* Only one pipeline can capture from a device, returns false when
+     * another one has it. A pipeline holds a single device. */
+    bool claimDevice(const void *owner, const char *name);
+    void releaseDevice(const void *owner);
+
+protected:
+    struct Member {
+        const void *owner;
+        unsigned int used[RESOURCE_COUNT];
+        QString device;
+        bool starting;
+    };
+
+    unsigned int totals[RESOURCE_COUNT];
+    std::vector<Member> members;
+
+    Member *find(const void *owner);
+};
+
+#endif // VIDEORESOURCEPOOL_H
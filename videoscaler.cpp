@@ -0,0 +1,179 @@
+#include "videoscaler.h"
+#include "videokernels.h"
+
+VideoScaler::VideoScaler():
+    box(0),
+    src_width(0),
+    src_height(0),
+    dst_width(0),
+    dst_height(0)
+{
+}
+
+void VideoScaler::disable()
+{
+    box = 0;
+    dst_width = 0;
+    dst_height = 0;
+    luma_taps.clear();
+    chroma_taps.clear();
+    row_taps.clear();
+}
+
+/* Sample position "pos" in 16.16 fixed point, clamped such that both
+ * samples are inside the row */
+static void make_tap(long long pos, unsigned int count, unsigned int *index, unsigned int *weight)
+{
+    if (pos < 0)
+        pos = 0;
+    unsigned int i = pos >> 16;
+    if (i >= count - 1)
+    {
+        *index = count - 2;
+        *weight = 256;
+    }
+    else
+    {
+        *index = i;
+        *weight = (pos >> 8) & 0xFF;
+    }
+}
+
+bool VideoScaler::setup(unsigned int width, unsigned int height, unsigned int max_width, unsigned int max_height)
+{
+    disable();
+    if ((width <= max_width && height <= max_height) || width < 8 || height < 2)
+        return false;
+
+    src_width = width;
+    src_height = height;
+
+    /* A box filter is cheap and sharp, use it if that fills most of the
+     * viewport. A few pixels border is acceptable. */
+    for (unsigned int k = 4; k >= 2; k >>= 1)
+    {
+        unsigned int w = width / k;
+        unsigned int h = height / k;
+        if (w <= max_width && h <= max_height && (w * 8 >= max_width * 7 || h * 8 >= max_height * 7))
+        {
+            box = k;
+            dst_width = w & ~3;
+            dst_height = h;
+            return dst_width != 0;
+        }
+    }
+
+    /* Fit with the aspect ratio preserved */
+    if ((unsigned long long)width * max_height > (unsigned long long)height * max_width)
+    {
+        dst_width = max_width;
+        dst_height = (unsigned long long)height * max_width / width;
+    }
+    else
+    {
+        dst_width = (unsigned long long)width * max_height / height;
+        dst_height = max_height;
+    }
+    dst_width &= ~3;
+    if (!dst_width || !dst_height)
+    {
+        disable();
+        return false;
+    }
+
+    /* Sample at the centers of the output pixels */
+    long long step = ((long long)width << 16) / dst_width;
+    luma_taps.resize(dst_width);
+    for (unsigned int x = 0; x < dst_width; ++x)
+    {
+        make_tap((((2 * x + 1) * step) >> 1) - 0x8000, width, &luma_taps[x].offset, &luma_taps[x].weight);
+        luma_taps[x].offset *= 2;
+    }
+    /* A chroma sample covers a pixel pair, its center is at the edge
+     * between the two pixels */
+    chroma_taps.resize(dst_width / 2);
+    for (unsigned int p = 0; p < dst_width / 2; ++p)
+    {
+        make_tap((((2 * p + 1) * step) - 0x10000) >> 1, width / 2, &chroma_taps[p].offset, &chroma_taps[p].weight);
+        chroma_taps[p].offset *= 4;
+    }
+    step = ((long long)height << 16) / dst_height;
+    row_taps.resize(dst_height);
+    for (unsigned int y = 0; y < dst_height; ++y)
+        make_tap((((2 * y + 1) * step) >> 1) - 0x8000, height, &row_taps[y].offset, &row_taps[y].weight);
+
+    return true;
+}
+
+/* Average K x K pixels into one, per output pixel pair that is 2K pixels
+ * wide, sharing the chroma of all of them */
+template<unsigned int K> static void box_row(const unsigned char *src, unsigned int stride, unsigned int pairs, unsigned char *yuyv)
+{
+    static const unsigned int n = K * K;
+    for (unsigned int p = 0; p < pairs; ++p)
+    {
+        const unsigned char *block = src + p * 4 * K;
+        unsigned int y0 = 0, y1 = 0, u = 0, v = 0;
+        for (unsigned int r = 0; r < K; ++r)
+        {
+            const unsigned char *line = block + r * stride;
+            for (unsigned int i = 0; i < 2 * K; i += 4)
+            {
+                y0 += line[i] + line[i + 2];
+                u += line[i + 1];
+                v += line[i + 3];
+                y1 += line[2 * K + i] + line[2 * K + i + 2];
+                u += line[2 * K + i + 1];
+                v += line[2 * K + i + 3];
+            }
+        }
+        yuyv[0] = (y0 + n / 2) / n;
+        yuyv[1] = (u + n / 2) / n;
+        yuyv[2] = (y1 + n / 2) / n;
+        yuyv[3] = (v + n / 2) / n;
+        yuyv += 4;
+    }
+}
+
+static inline unsigned char bilinear(const unsigned char *r0, const unsigned char *r1, unsigned int next, unsigned int wx, unsigned int wy)
+{
+    unsigned int a = r0[0] * (256 - wx) + r0[next] * wx;
+    unsigned int b = r1[0] * (256 - wx) + r1[next] * wx;
+    return (a * (256 - wy) + b * wy + 0x8000) >> 16;
+}
+
+void VideoScaler::scaleRow(const unsigned char *frame, unsigned int stride, unsigned int y, unsigned char *yuyv) const
+{
+    switch (box)
+    {
+    case 2:
+        box_row<2>(frame + y * 2 * stride, stride, dst_width / 2, yuyv);
+        return;
+    case 4:
+        box_row<4>(frame + y * 4 * stride, stride, dst_width / 2, yuyv);
+        return;
+    }
+
+    const Tap &row = row_taps[y];
+    const unsigned char *r0 = frame + row.offset * stride;
+    const unsigned char *r1 = r0 + stride;
+    for (unsigned int x = 0; x < dst_width; ++x)
+    {
+        const Tap &t = luma_taps[x];
+        yuyv[2 * x] = bilinear(r0 + t.offset, r1 + t.offset, 2, t.weight, row.weight);
+    }
+    for (unsigned int p = 0; p < dst_width / 2; ++p)
+    {
+        const Tap &t = chroma_taps[p];
+        yuyv[4 * p + 1] = bilinear(r0 + t.offset + 1, r1 + t.offset + 1, 4, t.weight, row.weight);
+        yuyv[4 * p + 3] = bilinear(r0 + t.offset + 3, r1 + t.offset + 3, 4, t.weight, row.weight);
+    }
+}
+
+void VideoScaler::prefetchRow(const unsigned char *frame, unsigned int stride, unsigned int y) const
+{
+    unsigned int first = box ? y * box : row_taps[y].offset;
+    unsigned int count = box ? box : 2;
+    for (unsigned int r = 0; r < count; ++r)
+        video_prefetch_row(frame + (first + r) * stride, src_width * 2);
+}
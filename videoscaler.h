@@ -0,0 +1,47 @@
+#ifndef VIDEOSCALER_H
+#define VIDEOSCALER_H
+
+#include <vector>
+
+/* Downscales YUYV frames one output row at a time, so the result can go
+ * straight into the row conversion kernels while it is still in cache.
+ * Uses a box filter when the frame is about 2 or 4 times the viewport,
+ * bilinear interpolation for other ratios. */
+class VideoScaler
+{
+public:
+    VideoScaler();
+
+    /* Choose the output size that fits in max_width x max_height. Returns
+     * false (and disables scaling) when the frame already fits. */
+    bool setup(unsigned int src_width, unsigned int src_height, unsigned int max_width, unsigned int max_height);
+    void disable();
+
+    bool active() const { return dst_width != 0; }
+    unsigned int width() const { return dst_width; }
+    unsigned int height() const { return dst_height; }
+    /* Box filter size, 0 for bilinear */
+    unsigned int boxFactor() const { return box; }
+
+    /* Produce output row "y" in YUYV format, width() * 2 bytes */
+    void scaleRow(const unsigned char *frame, unsigned int stride, unsigned int y, unsigned char *yuyv) const;
+    /* Start loading the input rows that output row "y" needs */
+    void prefetchRow(const unsigned char *frame, unsigned int stride, unsigned int y) const;
+
+protected:
+    struct Tap {
+        unsigned int offset; /* Byte offset of the first sample */
+        unsigned int weight; /* 0..256, weight of the next sample */
+    };
+
+    unsigned int box;
+    unsigned int src_width;
+    unsigned int src_height;
+    unsigned int dst_width;
+    unsigned int dst_height;
+    std::vector<Tap> luma_taps;   /* Per output pixel */
+    std::vector<Tap> chroma_taps; /* Per output pixel pair */
+    std::vector<Tap> row_taps;    /* Per output row, offset in lines */
+};
+
+#endif // VIDEOSCALER_H
@@ -0,0 +1,60 @@
+#include "videosource.h"
+#include "videofilesource.h"
+#include "videopatternsource.h"
+
+#include <QDebug>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+VideoSource *createVideoSource()
+{
+    const char *env = getenv("VIDEO_SOURCE");
+    if (!env || !*env)
+        return NULL;
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    const char *size = getenv("VIDEO_SOURCE_SIZE");
+    if (size && sscanf(size, "%ux%u", &width, &height) != 2)
+    {
+        qWarning() << "VIDEO_SOURCE_SIZE should be like 1920x1080, not" << size;
+        width = height = 0;
+    }
+
+    int fps = -1; /* Same as the camera would do */
+    const char *rate = getenv("VIDEO_SOURCE_FPS");
+    if (rate)
+        fps = atoi(rate);
+
+    unsigned int format = V4L2_PIX_FMT_YUYV;
+    const char *fmt = getenv("VIDEO_SOURCE_FORMAT");
+    if (fmt && !strcmp(fmt, "nv12"))
+        format = V4L2_PIX_FMT_NV12;
+
+    if (!strcmp(env, "pattern"))
+        return new VideoPatternSource(width, height, format, fps);
+
+    if (!strncmp(env, "file:", 5))
+    {
+        /* Nothing in the file tells the size */
+        if (!width || !height)
+        {
+            width = 1920;
+            height = 1080;
+        }
+        VideoFileSource *source = new VideoFileSource(width, height, format, fps);
+        int r = source->open(env + 5);
+        if (r < 0)
+        {
+            qWarning() << "Failed to open video file" << (env + 5) << ":" << -r;
+            delete source;
+            return NULL;
+        }
+        return source;
+    }
+
+    qWarning() << "Unknown VIDEO_SOURCE" << env;
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef VIDEOSOURCE_H
+#define VIDEOSOURCE_H
+
+/* A pixel format and frame size the device supports, with the highest
+ * frame rate it can do */
+struct VideoCaptureFormat {
+  unsigned int format; /* FOURCC code */
+  unsigned int width;
+  unsigned int height;
+  unsigned int fps;
+  bool scalable; /* Any size up to width x height */
+};
+
+struct VideoCaptureSettings {
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride; /* Bytes per line */
+  unsigned int size;   /* Bytes per image */
+  unsigned int format; /* FOURCC code */
+};
+
+/* Where the video pipeline gets its frames from. This is the interface of
+ * a V4L2 capture device, implemented by VideoCapture for cameras and by
+ * file and test pattern sources for benchmarking without one. */
+class VideoSource
+{
+public:
+    VideoSource(): requested_buffers(4) {}
+    virtual ~VideoSource() {}
+
+    /* Pick the format to use for the requested size and frame rate.
+     * "formats" lists the acceptable pixel formats, cheapest first. Returns
+     * -1 when the source supports none of them. */
+    virtual int negotiate(int width, int height, int fps, const unsigned int *formats, unsigned int count, /* out */ VideoCaptureFormat *result) = 0;
+    virtual int setup(int width, int height, int fps, unsigned int pixelformat, /* out */ VideoCaptureSettings *settings) = 0;
+    /* Crop the center width x height out of the frame that setup()
+     * configured, at the source. Updates settings on success, on failure
+     * the source is back to the full frame. */
+    virtual int crop(int width, int height, /* in/out */ VideoCaptureSettings *settings) = 0;
+    /* Number of buffers init_mmap() asks for. More buffers survive longer
+     * hiccups, fewer buffers keep the latency down. */
+    void set_buffer_count(unsigned int count) { requested_buffers = count; }
+    unsigned int requested_buffer_count() const { return requested_buffers; }
+    /* Call one of these after setup() to allocate the buffers */
+    virtual int init_mmap() = 0;
+    virtual int init_userptr(void * const *pointers, unsigned int count, unsigned int length) = 0;
+    virtual int start() = 0;
+    /* Returns 1 when a buffer was dequeued, 0 when there is none yet. The
+     * timestamp is the capture time in microseconds on CLOCK_MONOTONIC.
+     * Buffers can be dequeued and queued from different threads. */
+    virtual int dequeue_buffer(unsigned int *index, unsigned int *bytesused, long long *timestamp) = 0;
+    virtual int queue_buffer(unsigned int index) = 0;
+    virtual const void *buffer_data(unsigned int index) const = 0;
+    virtual unsigned int buffer_count() const = 0;
+    virtual int stop() = 0;
+    virtual void close() = 0;
+
+    /* Readable when dequeue_buffer() may have a frame, for use in poll() */
+    virtual int device_handle() const = 0;
+
+protected:
+    unsigned int requested_buffers;
+};
+
+/* Create the source that VIDEO_SOURCE asks for, or NULL to use a camera:
+ *   VIDEO_SOURCE=pattern          Moving test pattern
+ *   VIDEO_SOURCE=file:clip.yuv    Raw frames from a file, played in a loop
+ * VIDEO_SOURCE_SIZE=1920x1080 and VIDEO_SOURCE_FORMAT=yuyv|nv12 describe
+ * the frames, the pattern follows the viewport size when no size is set.
+ * VIDEO_SOURCE_FPS sets the frame rate, 0 produces frames as fast as the
+ * pipeline takes them. */
+VideoSource *createVideoSource();
+
+#endif // VIDEOSOURCE_H
@@ -0,0 +1,80 @@
+#include "videotee.h"
+#include "framelender.h"
+
+VideoTeeBranch::VideoTeeBranch(unsigned int _depth, DropPolicy _policy, QObject *parent):
+    QObject(parent),
+    depth(_depth ? _depth : 1),
+    policy(_policy),
+    lender(NULL),
+    buffer_size(0),
+    dropped_frames(0)
+{
+}
+
+VideoTeeBranch::~VideoTeeBranch()
+{
+    clear();
+    if (lender)
+        lender->retire();
+}
+
+bool VideoTeeBranch::acceptFrame()
+{
+    /* Nobody would take the frame */
+    if (!receivers(SIGNAL(frameReady())))
+        return false;
+    if (policy == DropOldest || frames.size() < depth)
+        return true;
+    ++dropped_frames;
+    return false;
+}
+
+unsigned char *VideoTeeBranch::buffer(unsigned int size)
+{
+    /* A new frame size, images that are still out keep the old lender */
+    if (size != buffer_size)
+    {
+        if (lender)
+            lender->retire();
+        lender = new BufferFrameLender(size);
+        buffer_size = size;
+    }
+    return lender->take();
+}
+
+void VideoTeeBranch::push(unsigned char *buffer, int width, int height, int bytesPerLine, QImage::Format format, qint64 timestamp)
+{
+    push(lender->lend(buffer, buffer, width, height, bytesPerLine, format), timestamp);
+}
+
+void VideoTeeBranch::push(const QImage &image, qint64 timestamp)
+{
+    Frame frame;
+    frame.image = image;
+    frame.timestamp = timestamp;
+    if (frames.size() >= depth)
+    {
+        ++dropped_frames;
+        if (policy == DropNewest)
+            return; /* The image goes, and its buffer back to the lender */
+        frames.pop_front();
+    }
+    frames.push_back(frame);
+    emit frameReady();
+}
+
+bool VideoTeeBranch::take(QImage *image, qint64 *timestamp)
+{
+    if (frames.empty())
+        return false;
+    *image = frames.front().image;
+    *timestamp = frames.front().timestamp;
+    frames.pop_front();
+    return true;
+}
+
+void VideoTeeBranch::clear()
+{
+    frames.clear();
+    dropped_frames = 0;
+}
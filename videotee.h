@@ -0,0 +1,67 @@
+#ifndef VIDEOTEE_H
+#define VIDEOTEE_H
+
+#include <QObject>
+#include <QImage>
+#include <deque>
+
+class BufferFrameLender;
+
+/* A second output of the video pipeline, next to the preview. It gets the
+ * full resolution frames, converted from the same capture buffer as the
+ * preview, or the preview image itself when that is the full frame. It
+ * only converts frames while something is connected to frameReady(). Up
+ * to "depth" frames wait here until the consumer takes them, frameReady()
+ * tells there's one. When the consumer falls behind, either the oldest
+ * waiting frame or the new one is dropped. Everything happens in the
+ * thread that runs the pipeline, a consumer in another thread must copy
+ * the image before it leaves this thread. */
+class VideoTeeBranch : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum DropPolicy
+    {
+        DropOldest,
+        DropNewest
+    };
+
+    VideoTeeBranch(unsigned int depth, DropPolicy policy, QObject *parent = 0);
+    ~VideoTeeBranch();
+
+    /* False when there is no consumer, or, counted as dropped, when the
+     * new frame would not be kept. The pipeline then doesn't convert it. */
+    bool acceptFrame();
+    /* A buffer of "size" bytes to convert into, pass it to push() */
+    unsigned char *buffer(unsigned int size);
+    void push(unsigned char *buffer, int width, int height, int bytesPerLine, QImage::Format format, qint64 timestamp);
+    /* Queue an image that exists already, shared with its other users */
+    void push(const QImage &image, qint64 timestamp);
+
+    /* The oldest waiting frame, false when there is none */
+    bool take(QImage *image, qint64 *timestamp);
+    unsigned int dropped() const { return dropped_frames; }
+    /* Drops the waiting frames and resets the count, for when the
+     * pipeline stops */
+    void clear();
+
+signals:
+    void frameReady();
+
+protected:
+    struct Frame
+    {
+        QImage image;
+        qint64 timestamp;
+    };
+
+    unsigned int depth;
+    DropPolicy policy;
+    BufferFrameLender *lender;
+    unsigned int buffer_size;
+    std::deque<Frame> frames;
+    unsigned int dropped_frames;
+};
+
+#endif // VIDEOTEE_H
@@ -3,7 +3,8 @@
 
 VideoWidget::VideoWidget(QWidget *parent) :
     QWidget(parent),
-    previoussize(-1, -1)
+    previoussize(-1, -1),
+    pixmapTimestamp(0)
 {
     setAttribute(Qt::WA_OpaquePaintEvent);
     //setAttribute(Qt::WA_PaintOnScreen);
@@ -14,10 +15,21 @@ void VideoWidget::paintEvent(QPaintEvent * /* event */)
     QPainter painter(this);
     int w = width();
     int h = height();
-    int pw = pixmap.width();
-    int ph = pixmap.height();
+    int pw;
+    int ph;
 
-    painter.drawPixmap(0, 0, pixmap);
+    if (frame.isNull())
+    {
+        pw = pixmap.width();
+        ph = pixmap.height();
+        painter.drawPixmap(0, 0, pixmap);
+    }
+    else
+    {
+        pw = frameRect.width();
+        ph = frameRect.height();
+        painter.drawImage(QPoint(0, 0), frame, frameRect);
+    }
     /* Paint the areas the pixmap did not cover in black */
     if (previoussize.width() != pw || previoussize.height() != ph)
     {
@@ -25,6 +37,12 @@ void VideoWidget::paintEvent(QPaintEvent * /* event */)
         painter.fillRect(0, ph, w, h - ph, Qt::black);
         previoussize = QSize(pw, ph);
     }
+
+    if (pixmapTimestamp)
+    {
+        latency.add(monotonicMicroseconds() - pixmapTimestamp);
+        pixmapTimestamp = 0;
+    }
 }
 
 void VideoWidget::mousePressEvent(QMouseEvent *event)
@@ -38,9 +56,37 @@ void VideoWidget::resizeEvent(QResizeEvent *)
     emit resized(this);
 }
 
+/* The video pipeline lends out its buffers, so this keeps the image
+ * itself instead of a copy. The buffer goes back to the pipeline when the
+ * next frame replaces it. */
+void VideoWidget::updateFrame(const QImage &image, qint64 timestamp)
+{
+    framerateCounter.frame();
+    pixmap = QPixmap();
+    frame = image;
+    /* Show the center part when the image doesn't fit */
+    int w = width();
+    int h = height();
+    frameRect = image.rect();
+    if (frameRect.width() > w)
+    {
+        frameRect.setLeft((image.width() - w) >> 1);
+        frameRect.setWidth(w);
+    }
+    if (frameRect.height() > h)
+    {
+        frameRect.setTop((image.height() - h) >> 1);
+        frameRect.setHeight(h);
+    }
+    /* Frames that were replaced before they got painted don't count */
+    pixmapTimestamp = image.isNull() ? 0 : timestamp;
+    update();
+}
+
 void VideoWidget::updatePixmap(const QImage& image)
 {
     framerateCounter.frame();
+    frame = QImage();
     int w = width();
     int h = height();
     if (image.width() <= w && image.height() <= h)
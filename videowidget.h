@@ -4,6 +4,7 @@
 #include <QPixmap>
 #include <QWidget>
 #include "frameratecounter.h"
+#include "latencyhistogram.h"
 
 class VideoWidget : public QWidget
 {
@@ -20,6 +21,9 @@ protected:
 
 public slots:
     void updatePixmap(const QImage &image);
+    /* As updatePixmap without the copy, and measure the latency from
+     * capture to paint. The image must stay valid while it is kept. */
+    void updateFrame(const QImage &image, qint64 timestamp);
 
 signals:
     void clicked(QMouseEvent *event);
@@ -27,9 +31,13 @@ signals:
 
 public:
     FrameRateCounter framerateCounter;
+    LatencyHistogram latency;
 
 private:
     QPixmap pixmap;
+    QImage frame; /* Drawn instead of the pixmap when set */
+    QRect frameRect;
+    qint64 pixmapTimestamp; /* Capture time of the pixmap if not painted yet */
 };
 
 #endif